@@ -1,519 +1,1868 @@
-#include "stdafx.h"
-
-#include "XpNamedPipe.h"
-#include "util.hpp"
-using namespace util;
-
-// Impl based on http://msdn.microsoft.com/en-us/library/windows/desktop/aa365603(v=vs.85).aspx
-
-const int PIPE_BUF_SIZE = 10 * 1024;
-
-// Globals
-static boost::thread_specific_ptr<ErrorInfo> GBL_errorInfo;
-
-// Type definitions
-
-class PipeInfo {
-public:
-    PipeInfo(const std::string& pipeName, bool privatePipe, HANDLE pipeHandle) : 
-            pipeName(pipeName), privatePipe(privatePipe), pipeHandle(pipeHandle) {
-
-        stoppedEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
-        stoppedEvent.check("CreateEvent");
-    }
-
-    HANDLE getPipeHandle() {
-        return pipeHandle;
-    }
-
-    HANDLE getStoppedEvent() {
-        return stoppedEvent;
-    }
-
-    const std::string& getName() {
-        return pipeName;
-    }
-
-    bool isPrivatePipe() {
-        return privatePipe;
-    }
-
-    void stop() {
-        checkWindowsResult(SetEvent(stoppedEvent), "SetEvent");
-    }
-
-private:
-    std::string pipeName;
-    bool privatePipe;
-    ScopedFileHandle pipeHandle;
-    ScopedHandle stoppedEvent;
-};
-
-// Local function definitions
-
-static void setErrorInfo(const std::string& errorMessage, int errorCode = 0) {
-    GBL_errorInfo.reset(new ErrorInfo(errorMessage, errorCode));
-}
-
-static void setErrorInfo(const ErrorInfo& info) {
-    GBL_errorInfo.reset(new ErrorInfo(info));
-}
-
-static std::string getUserSid() {
-    bool error = false;
-    std::exception except;
-
-    HANDLE tokenHandle = NULL;
-    PTOKEN_USER pUserInfo = NULL;
-    char* pSidString = NULL;
-    std::string sid;
-    try {
-        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &tokenHandle)) {
-            throwWindowsError("OpenThreadToken");
-        }
-        DWORD userInfoSize = 0;
-        GetTokenInformation(tokenHandle, TokenUser, NULL, 0, &userInfoSize);
-        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
-            throwWindowsError("GetTokenInformation");
-        }
-        pUserInfo = (PTOKEN_USER)malloc(userInfoSize);
-        if (pUserInfo == NULL) {
-            throw std::bad_alloc();
-        }
-        if (!GetTokenInformation(tokenHandle, TokenUser, pUserInfo, userInfoSize, &userInfoSize)) {
-            throwWindowsError("GetTokenInformation");
-        }
-        if (!ConvertSidToStringSidA(pUserInfo->User.Sid, &pSidString)) {
-            throwWindowsError("ConvertSidToStringSid");
-        }
-        sid = pSidString;
-            
-    } catch (std::exception& e) {
-        error = true;
-        except = e;
-    }
-    if (tokenHandle != NULL) {
-        CloseHandle(tokenHandle);
-    }
-    if (pUserInfo != NULL) {
-        free(pUserInfo);
-    }
-    if (pSidString != NULL) {
-        LocalFree(pSidString);
-    }
-    if (error) {
-        throw except;
-    }
-    return sid;
-}
-
-static std::string createUuid() {
-    boost::uuids::uuid uuid = boost::uuids::random_generator()();
-    std::stringstream stream;
-    stream << uuid;
-    return stream.str();
-}
-
-static HANDLE createPipe(const std::string& pipeName, bool privatePipe) {
-    bool error = false;
-    std::exception except;
-
-    HANDLE pipeHandle = INVALID_HANDLE_VALUE;
-    SECURITY_ATTRIBUTES* pSA = NULL;
-    try {
-        if (privatePipe) {
-            pSA = new SECURITY_ATTRIBUTES;
-
-            pSA->nLength = sizeof(SECURITY_ATTRIBUTES);
-            pSA->bInheritHandle = FALSE;
-            pSA->lpSecurityDescriptor = NULL;
-            std::string userSid = getUserSid();
-
-            // Allow GA access (generic all, i.e. full control) to the local system account, builtin administrators,
-            // and the current user's SID.  Inheritance is disabled (I don't think inheritance has any meaning in the context of
-            // pipes).  Because there is no inheritance, there is need to mention CO (creator owner).  CO represents the SID of a 
-            // user who creates a new object underneath a given object.  Deny access to processes on other machines 
-            // (whose token contains NU, the network logon user SID).
-            std::string sddl = "D:(A;;GA;;;SY)(A;;GA;;;BA)(A;;GA;;;";
-            sddl.append(userSid);
-            sddl.append(")(D;;GA;;;NU)");
-            if (!ConvertStringSecurityDescriptorToSecurityDescriptorA(sddl.c_str(), SDDL_REVISION_1, &(pSA->lpSecurityDescriptor), NULL)) {
-                throwWindowsError("ConvertStringSecurityDescriptorToSecurityDescriptor");
-            }
-        }
-        pipeHandle = CreateNamedPipe(toUtf16(pipeName).c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
-                PIPE_WAIT, PIPE_UNLIMITED_INSTANCES, PIPE_BUF_SIZE, PIPE_BUF_SIZE, 0, pSA);
-        if (pipeHandle == INVALID_HANDLE_VALUE) {
-            throwWindowsError("CreateNamedPipe");
-        }
-    } catch (std::exception& e) {
-        error = true;
-        except = e;
-    }
-
-    if (pSA != NULL) {
-        if (pSA->lpSecurityDescriptor != NULL) {
-            LocalFree(pSA->lpSecurityDescriptor);
-        }
-        delete pSA;
-    }
-    if (error) {
-        throw except;
-    }
-    return pipeHandle;
-}
-
-static std::string makePipeName(const std::string& baseName, bool userLocal) {
-    std::stringstream pipeName;
-    const char* PIPE_PREFIX = "\\\\.\\pipe\\";
-
-    if (userLocal) {
-        pipeName << PIPE_PREFIX << getUserSid() << "\\" << baseName;
-    } else {
-        pipeName << PIPE_PREFIX << baseName;
-    }
-    return pipeName.str();
-}
-
-static void writeBytes(HANDLE pipeHandle, const char* pipeMsg, int bytesToWrite) {
-    OVERLAPPED overlapped;
-    memset(&overlapped, 0, sizeof(overlapped));
-
-    ScopedHandle evt = overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-    evt.check("CreateEvent");
-
-    DWORD bytesWritten = 0;
-    BOOL writeResult = WriteFile(pipeHandle, pipeMsg, bytesToWrite, &bytesWritten, &overlapped);
-    if (!writeResult && GetLastError() == ERROR_IO_PENDING){
-        writeResult = GetOverlappedResult(pipeHandle, &overlapped, &bytesWritten, TRUE);
-    }
-
-    checkWindowsResult(writeResult, "WriteFile");
-}
-
-static int readPipe(PipeInfo* pipeInfo, char* buffer, int bufLen, int timeoutMsecs) {
-    OVERLAPPED overlapped;
-    memset(&overlapped, 0, sizeof(overlapped));
-
-    ScopedHandle evt = overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-    evt.check("CreateEvent");
-
-    int bytesRead = 0;
-    BOOL result = ReadFile(pipeInfo->getPipeHandle(), buffer, bufLen, (LPDWORD)&bytesRead, &overlapped);
-    DWORD errorCode = GetLastError();
-    if (!result && errorCode != ERROR_IO_PENDING) {
-        throwWindowsError("ReadFile");
-    }
-    if (GetLastError() == ERROR_IO_PENDING) {
-        HANDLE handles[2] = {pipeInfo->getStoppedEvent(), evt};
-        DWORD waitResult = WaitForMultipleObjects(2, handles, FALSE, timeoutMsecs);
-        if (waitResult == WAIT_FAILED || waitResult == WAIT_TIMEOUT || waitResult == WAIT_OBJECT_0) {
-            std::string errorMsg = getWindowsErrorMessage("WaitForMultipleObjects");
-            CancelIo(pipeInfo->getPipeHandle());
-
-            DWORD unused = 0;
-            GetOverlappedResult(pipeInfo->getPipeHandle(), &overlapped, &unused, TRUE);
-
-            if (waitResult == WAIT_FAILED) {
-                throw std::runtime_error(errorMsg);
-            } else if (waitResult == WAIT_OBJECT_0) {
-                throw std::runtime_error("Interrupted while reading message");
-            } else {
-                throw ErrorInfo("Timed out while reading message", XPNP_ERROR_TIMEOUT);
-            }
-        }
-        result = GetOverlappedResult(pipeInfo->getPipeHandle(), &overlapped, (LPDWORD)&bytesRead, TRUE);
-        checkWindowsResult(result, "GetOverlappedResult");
-    }
-    return bytesRead;
-}
-
-static void readBytes(PipeInfo* pipeInfo, char* buffer, int bytesToRead, int timeoutMsecs) {
-    int totalBytesRead = 0;
-    while (totalBytesRead < bytesToRead) {
-        totalBytesRead += readPipe(pipeInfo, buffer + totalBytesRead, bytesToRead - totalBytesRead, timeoutMsecs);
-    }
-}
-
-static void writeMessage(HANDLE pipeHandle, const char* msg, int msgLen) {
-    int msgLenNetwork = htonl(msgLen);
-    writeBytes(pipeHandle, (const char*)&msgLenNetwork, sizeof(msgLenNetwork));
-    writeBytes(pipeHandle, msg, msgLen);
-}
-
-static void readMessage(PipeInfo* pipeInfo, std::vector<char>& msg, int timeoutMsecs){
-    int msgLen = 0;
-    readBytes(pipeInfo, (char*)&msgLen, sizeof(msgLen), timeoutMsecs);
-    msgLen = ntohl(msgLen);
-
-    if (msgLen > 0) {
-        msg.resize(msgLen);
-        readBytes(pipeInfo, &(msg[0]), msgLen, timeoutMsecs);
-    }
-}
-
-static PipeInfo* getPipeInfo(XPNP_PipeHandle handle) {
-    if (handle == 0) {
-        throw std::invalid_argument("Pipe handle is null");
-    }
-    return (PipeInfo*)handle;
-}
-
-// Exported function definitions
-
-void XPNP_getErrorMessage(char* buffer, int bufLen) {
-    ErrorInfo* pErrorInfo = GBL_errorInfo.get();
-    const char* errorMsg = "";
-    if (pErrorInfo != NULL) {
-        errorMsg = pErrorInfo->what();
-    }
-    if (strcpy_s(buffer, bufLen, errorMsg) != 0) {
-        strcpy_s(buffer, bufLen, "Buffer too small");
-    }
-}
-
-int XPNP_getErrorCode() {
-    ErrorInfo* pErrorInfo = GBL_errorInfo.get();
-    int errorCode = 0;
-    if (pErrorInfo != NULL) {
-        errorCode = pErrorInfo->getErrorCode();
-    }
-    return errorCode;
-}
-
-int XPNP_makePipeName(const char* baseName, int userLocal, char* pipeNameBuf, int bufLen) {
-    try {
-        std::string fullPipeName = makePipeName(baseName, userLocal != 0);
-        if (strcpy_s(pipeNameBuf, bufLen, fullPipeName.c_str()) != 0) {
-            throw std::runtime_error("Buffer too small");
-        }
-        return 1;
-    } catch (std::exception& e) {
-        setErrorInfo(e.what());
-        return 0;
-    }
-}
-
-XPNP_PipeHandle XPNP_createPipe(const char* pipeName, int privatePipe) {
-    HANDLE pipeHandle = INVALID_HANDLE_VALUE;
-    try {
-        pipeHandle = createPipe(pipeName, privatePipe != 0);
-        return (XPNP_PipeHandle)new PipeInfo(pipeName, privatePipe != 0, pipeHandle);
-    } catch (std::exception& e) {
-        setErrorInfo(e.what());
-        if (pipeHandle != INVALID_HANDLE_VALUE) {
-            CloseHandle(pipeHandle);
-        }
-        return NULL;
-    }
-}
-
-int XPNP_stopPipe(XPNP_PipeHandle pipe) {
-    try {
-        PipeInfo* pipeInfo = getPipeInfo(pipe);
-        pipeInfo->stop();
-        return 1;
-    } catch (std::exception& e) {
-        setErrorInfo(e.what());
-        return 0;
-    }
-}
-
-int XPNP_closePipe(XPNP_PipeHandle pipe) {
-    try {
-        PipeInfo* pipeInfo = getPipeInfo(pipe);
-        delete pipeInfo;
-        return 1;
-    } catch (std::exception& e) {
-        setErrorInfo(e.what());
-        return 0;
-    }
-}
-
-XPNP_PipeHandle XPNP_acceptConnection(XPNP_PipeHandle pipe, int timeoutMsecs) {
-    HANDLE newPipeHandle = INVALID_HANDLE_VALUE;
-    PipeInfo* pipeInfo = NULL;
-    PipeInfo* newPipeInfo = NULL;    
-    bool connectAttempted = false;
-    bool errorOccurred = false;
-
-    try {
-        pipeInfo = getPipeInfo(pipe);
-
-        OVERLAPPED overlapped;
-        memset(&overlapped, 0, sizeof(overlapped));
-
-        ScopedHandle evt = overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-        evt.check("CreateEvent");
-        
-        BOOL result = ConnectNamedPipe(pipeInfo->getPipeHandle(), &overlapped);
-        connectAttempted = true;
-
-        if (!result && GetLastError() == ERROR_IO_PENDING) {
-            DWORD unused = 0;
-            HANDLE handles[2] = {pipeInfo->getStoppedEvent(), evt};
-            DWORD waitResult = WaitForMultipleObjects(2, handles, FALSE, timeoutMsecs);
-            if (waitResult == WAIT_FAILED || waitResult == WAIT_TIMEOUT || waitResult == WAIT_OBJECT_0) {
-                std::string errorMsg = getWindowsErrorMessage("WaitForMultipleObjects");
-                CancelIo(pipeInfo->getPipeHandle());
-                GetOverlappedResult(pipeInfo->getPipeHandle(), &overlapped, &unused, TRUE);
-                if (waitResult == WAIT_FAILED) {
-                    throw std::runtime_error(errorMsg);
-                } else if (waitResult == WAIT_OBJECT_0) {
-                    throw std::runtime_error("Interrupted while waiting for client to connect");
-                } else {
-                    throw ErrorInfo("Timed out waiting for client to connect", XPNP_ERROR_TIMEOUT);
-                }
-            }
-            result = GetOverlappedResult(pipeInfo->getPipeHandle(), &overlapped, &unused, TRUE);
-        }
-        if (!result && GetLastError() != ERROR_PIPE_CONNECTED) {
-            throwWindowsError("ConnectNamedPipe");
-        }
-
-        std::vector<char> readBuf;
-        readMessage(pipeInfo, readBuf, timeoutMsecs);
-
-        std::string newPipeName(readBuf.begin(), readBuf.end());
-
-        newPipeHandle = CreateFile(toUtf16(newPipeName).c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
-
-        if (newPipeHandle == INVALID_HANDLE_VALUE) {
-            throwWindowsError("CreateFile");
-        }
-
-        newPipeInfo = new PipeInfo(newPipeName, pipeInfo->isPrivatePipe(), newPipeHandle);
-    } catch (ErrorInfo& info) {
-        setErrorInfo(info);
-        errorOccurred = true;
-    } catch (std::exception& e) {
-        setErrorInfo(e.what());
-        errorOccurred = true;
-    }
-    if (errorOccurred) {
-        if (newPipeHandle != INVALID_HANDLE_VALUE) {
-            CloseHandle(newPipeHandle);
-        }
-    }
-    if (connectAttempted) {
-        DisconnectNamedPipe(pipeInfo->getPipeHandle());
-    }
-    return (XPNP_PipeHandle)newPipeInfo;
-}
-
-int XPNP_readPipe(XPNP_PipeHandle pipe, char* buffer, int bufLen, int timeoutMsecs) {
-    try {
-        if (bufLen <= 0) {
-            throw std::invalid_argument("bufLen <= 0");
-        }
-        PipeInfo* pipeInfo = getPipeInfo(pipe);
-        return readPipe(pipeInfo, buffer, bufLen, timeoutMsecs);
-    } catch (ErrorInfo& e) {
-        setErrorInfo(e);
-        return 0;
-    } catch (std::exception& e) { 
-        setErrorInfo(e.what());
-        return 0;
-    }
-}
-
-int XPNP_readBytes(XPNP_PipeHandle pipe, char* buffer, int bytesToRead, int timeoutMsecs) {
-    try {
-        if (bytesToRead <= 0) {
-            throw std::invalid_argument("bytesToRead <= 0");
-        }
-        PipeInfo* pipeInfo = getPipeInfo(pipe);
-        readBytes(pipeInfo, buffer, bytesToRead, timeoutMsecs);
-        return 1;
-    } catch (ErrorInfo& e) {
-        setErrorInfo(e);
-        return 0;
-    } catch (std::exception& e) {
-        setErrorInfo(e.what());
-        return 0;
-    }
-}
-
-XPNP_PipeHandle XPNP_openPipe(const char* pipeName, int privatePipe) {
-    PipeInfo* pipeInfo = NULL;
-    HANDLE newPipeHandle = INVALID_HANDLE_VALUE;
-    try {
-        ScopedFileHandle listeningPipeHandle;
-
-        int tries = 0; 
-        DWORD createError = 0;
-
-        const int MAX_TRIES = 15;
-        std::wstring pipeNameUtf16 = toUtf16(pipeName);
-        do {
-            listeningPipeHandle = CreateFile(pipeNameUtf16.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
-            tries++;
-            if (listeningPipeHandle == INVALID_HANDLE_VALUE && tries < MAX_TRIES) {
-                createError = GetLastError();
-                if (createError == ERROR_PIPE_BUSY) {
-                    Sleep(100);
-                }
-            }
-        } while (listeningPipeHandle == INVALID_HANDLE_VALUE && tries < MAX_TRIES && createError == ERROR_PIPE_BUSY);
-
-        listeningPipeHandle.check("CreateFile");
-
-        std::string newPipeName = makePipeName(createUuid(), false);
-
-        newPipeHandle = createPipe(newPipeName, privatePipe != 0);
-
-        writeMessage(listeningPipeHandle, newPipeName.c_str(), (int)newPipeName.length());
-
-        OVERLAPPED overlapped;
-        memset(&overlapped, 0, sizeof(overlapped));
-
-        ScopedHandle evt = overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-        evt.check("CreateEvent");
-
-        BOOL connectResult = ConnectNamedPipe(newPipeHandle, &overlapped);
-        if (!connectResult && GetLastError() == ERROR_IO_PENDING) {
-            DWORD unused = 0;
-            DWORD waitResult = WaitForSingleObject(overlapped.hEvent, 2000);
-            if (waitResult == WAIT_FAILED || waitResult == WAIT_TIMEOUT) {
-                std::string errorMsg = getWindowsErrorMessage("WaitForSingleObject");
-                CancelIo(pipeInfo->getPipeHandle());
-                GetOverlappedResult(pipeInfo->getPipeHandle(), &overlapped, &unused, TRUE);
-                if (waitResult == WAIT_FAILED) {
-                    throw std::runtime_error(errorMsg);
-                } else {
-                    throw std::runtime_error("Timed out waiting for server to connect");
-                }
-            }
-            connectResult = GetOverlappedResult(newPipeHandle, &overlapped, &unused, TRUE);
-        }
-        if (!connectResult && GetLastError() != ERROR_PIPE_CONNECTED) {
-            throwWindowsError("ConnectNamedPipe");
-        }
-
-        pipeInfo = new PipeInfo(newPipeName, privatePipe != 0, newPipeHandle);
-    } catch (std::exception& e) {
-        setErrorInfo(e.what());
-        if (newPipeHandle != INVALID_HANDLE_VALUE) {
-            CloseHandle(newPipeHandle);
-        }
-    }
-    return (XPNP_PipeHandle)pipeInfo;
-}
-
-int XPNP_writePipe(XPNP_PipeHandle pipe, const char* data, int bytesToWrite) {
-    try {
-        if (bytesToWrite <= 0) {
-            throw std::invalid_argument("bytesToWrite <= 0");
-        }
-        PipeInfo* pipeInfo = getPipeInfo(pipe);
-        writeBytes(pipeInfo->getPipeHandle(), data, bytesToWrite);
-        return 1;
-    } catch (std::exception& e) {
-        setErrorInfo(e.what());
-        return 0;
-    }
-}
-
-
-
-
+#include "stdafx.h"
+
+#include "XpNamedPipe.h"
+#include "util.hpp"
+#include "internal.hpp"
+#include "compress.hpp"
+#include "handles.hpp"
+#include "stats.hpp"
+using namespace util;
+
+// Impl based on http://msdn.microsoft.com/en-us/library/windows/desktop/aa365603(v=vs.85).aspx
+
+const int PIPE_BUF_SIZE = 10 * 1024;
+
+// Time allowed for each step of the connect handshake that runs after the listening pipe has been opened.
+const int HANDSHAKE_TIMEOUT_MSECS = 2000;
+
+// The client appends a NUL and a hello to the reply pipe name it sends.  Legacy servers stop reading the name at
+// the NUL and never answer; a server that understands the hello answers on the listening pipe with its own
+// hello, carrying the agreed options, before disconnecting.  A hello is HELLO_MAGIC followed by network order
+// ints: the options (capability bits), then, from protocol version 2, the protocol version and the sender's
+// pipe buffer size.  Fields are only ever appended, and readers ignore any they do not know, so each version
+// can talk to the ones before it.  Version 1 hellos end after the options.
+const char HELLO_MAGIC[4] = {'X', 'P', 'N', 'P'};
+const int HELLO_V1_SIZE = sizeof(HELLO_MAGIC) + sizeof(int);
+const int HELLO_V2_SIZE = HELLO_V1_SIZE + 2 * sizeof(int);
+const int PROTOCOL_VERSION = 2;
+
+// On connections using XPNP_OPTION_COMPRESSION, the top bit of a framed message's length marks a compressed
+// body, which starts with the uncompressed length.  Messages shorter than COMPRESSION_THRESHOLD, longer than
+// MAX_COMPRESSED_MESSAGE_SIZE, or that do not shrink, are sent as is.  Since the lengths come from the peer, a
+// reader rejects any over MAX_COMPRESSED_MESSAGE_SIZE, or that would expand the body by more than the block format
+// can (MAX_COMPRESSION_RATIO), before allocating for them.
+const unsigned int COMPRESSED_FLAG = 0x80000000;
+const int COMPRESSION_THRESHOLD = 256;
+const int MAX_COMPRESSED_MESSAGE_SIZE = 64 * 1024 * 1024;
+const int MAX_COMPRESSION_RATIO = 255;
+
+// Framed messages up to this size are copied behind their length and written in one call; for larger ones the
+// copy costs more than the second WriteFile saves.
+const int COALESCE_LIMIT = 16 * 1024;
+
+// On connections using XPNP_OPTION_FLOW_CONTROL, each end may send INITIAL_WRITE_CREDIT messages before the
+// receiver grants more.  The receiver grants credit, in control frames, once its caller has taken
+// CREDIT_GRANT_BATCH messages.  Grants are written without waiting, so that a reader never blocks on the pipe's
+// writers or on the peer; a grant that cannot go out at once is added to the next one.  Control frames are marked
+// by CONTROL_FLAG in the length and carry a type byte and a value (network order); they are only used on
+// connections with one of CONTROL_FRAME_OPTIONS.
+const int INITIAL_WRITE_CREDIT = 64;
+const int CREDIT_GRANT_BATCH = INITIAL_WRITE_CREDIT / 2;
+const unsigned int CONTROL_FLAG = 0x40000000;
+const int CONTROL_FRAME_SIZE = 1 + sizeof(int);
+const char CONTROL_CREDIT = 1;
+const char CONTROL_PING = 2;
+const int CONTROL_FRAME_OPTIONS = XPNP_OPTION_FLOW_CONTROL | XPNP_OPTION_HEARTBEAT;
+
+const int DEFAULT_HEARTBEAT_INTERVAL_MSECS = 1000;
+const int DEFAULT_HEARTBEAT_MAX_MISSED = 3;
+
+// Returned by readPipe for routine failures (timing out, the pipe being stopped, or the peer closing the pipe or
+// going quiet), with the error already recorded.
+const int READ_FAILED = -1;
+
+enum FrameHeaderResult {
+    FRAME_DATA,
+    FRAME_CONTROL,
+    FRAME_FAILED
+};
+
+// Type definitions
+
+// The last error on a thread.  Errors raised as exceptions keep their message; routine ones (timeouts, short
+// buffers) record only a code and a static context string, plus the Windows error if there is one, and the
+// message is put together when XPNP_getErrorMessage asks for it.  Each thread allocates its slot once and
+// then reuses it.
+struct ErrorSlot {
+    ErrorSlot() : errorCode(0), context(""), windowsError(0), hasMessage(false) {
+    }
+
+    int errorCode;
+    const char* context;
+    DWORD windowsError;
+    std::string message;
+    bool hasMessage;
+};
+
+struct Hello {
+    Hello(int version = 0, int options = 0, int bufferSize = 0) : version(version), options(options),
+            bufferSize(bufferSize) {
+    }
+
+    int version;
+    int options;
+    int bufferSize;
+};
+
+class PipeInfo {
+public:
+    PipeInfo(const std::string& pipeName, bool privatePipe, HANDLE pipeHandle, const Hello& peer = Hello()) : 
+            pipeName(pipeName), privatePipe(privatePipe), pipeHandle(pipeHandle), options(peer.options),
+            protocolVersion(peer.version), peerBufferSize(peer.bufferSize), messagePending(false),
+            writeCredit(INITIAL_WRITE_CREDIT), consumedMessages(0), unsentGrant(0), grantWriting(false),
+            dataReceived(0), dataSent(0), lookahead(0), lookaheadHeld(0) {
+
+        stoppedEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        stoppedEvent.check("CreateEvent");
+        peerDeadEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        peerDeadEvent.check("CreateEvent");
+        if (options & XPNP_OPTION_FLOW_CONTROL) {
+            grantEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+            grantEvent.check("CreateEvent");
+        }
+    }
+
+    ~PipeInfo() {
+        if (grantWriting) {
+            // Closing the pipe completes the write, which must finish before its buffer is freed.
+            pipeHandle = INVALID_HANDLE_VALUE;
+            WaitForSingleObject(grantEvent, INFINITE);
+        }
+    }
+
+    HANDLE getPipeHandle() {
+        return pipeHandle;
+    }
+
+    HANDLE getStoppedEvent() {
+        return stoppedEvent;
+    }
+
+    // Set (and left set) once heartbeats show the peer has stopped responding.
+    HANDLE getPeerDeadEvent() {
+        return peerDeadEvent;
+    }
+
+    const std::string& getName() {
+        return pipeName;
+    }
+
+    bool isPrivatePipe() {
+        return privatePipe;
+    }
+
+    int getOptions() {
+        return options;
+    }
+
+    // The protocol version agreed with the peer; 0 for a peer that predates the hello.
+    int getProtocolVersion() {
+        return protocolVersion;
+    }
+
+    // The peer's pipe buffer size, or 0 if it did not say.
+    int getPeerBufferSize() {
+        return peerBufferSize;
+    }
+
+    boost::mutex& getWriteMutex() {
+        return writeMutex;
+    }
+
+    // Scratch space for outgoing frames, only used while holding the write mutex.
+    std::vector<char>& getWriteBuffer() {
+        return writeBuffer;
+    }
+
+    // Scratch space for incoming compressed frames.
+    std::vector<char>& getReadBuffer() {
+        return readBuffer;
+    }
+
+    // A received message that did not fit in the caller's buffer.
+    std::vector<char>& getPendingMessage() {
+        return pendingMessage;
+    }
+
+    bool isMessagePending() {
+        return messagePending;
+    }
+
+    void setMessagePending(bool pending) {
+        messagePending = pending;
+    }
+
+    boost::mutex& getReadMutex() {
+        return readMutex;
+    }
+
+    // Messages read by a writer waiting for credit, to be returned before anything still in the pipe.
+    std::deque<std::vector<char> >& getQueuedMessages() {
+        return queuedMessages;
+    }
+
+    // Guards the credit counts below.
+    boost::mutex& getFlowMutex() {
+        return flowMutex;
+    }
+
+    // Signalled when credit is granted or the read mutex is released.
+    boost::condition_variable& getFlowChanged() {
+        return flowChanged;
+    }
+
+    int getWriteCredit() {
+        return writeCredit;
+    }
+
+    void setWriteCredit(int credit) {
+        writeCredit = credit;
+    }
+
+    // Messages taken by the caller since credit for them was last granted to the peer.
+    int getConsumedMessages() {
+        return consumedMessages;
+    }
+
+    void setConsumedMessages(int count) {
+        consumedMessages = count;
+    }
+
+    // Credit granted to the peer but not yet written.
+    int getUnsentGrant() {
+        return unsentGrant;
+    }
+
+    void setUnsentGrant(int credit) {
+        unsentGrant = credit;
+    }
+
+    // Starts writing a credit grant without waiting for it to complete.  Returns false, writing nothing, if the
+    // last grant is still being written.  Called with the write mutex held, so the grant cannot land inside
+    // another frame.
+    bool startGrantWrite(int credit) {
+        if (grantWriting && !HasOverlappedIoCompleted(&grantOverlapped)) {
+            return false;
+        }
+        int header = htonl(CONTROL_FRAME_SIZE | CONTROL_FLAG);
+        int creditNetwork = htonl(credit);
+        memcpy(grantFrame, &header, sizeof(header));
+        grantFrame[sizeof(int)] = CONTROL_CREDIT;
+        memcpy(grantFrame + sizeof(int) + 1, &creditNetwork, sizeof(creditNetwork));
+
+        memset(&grantOverlapped, 0, sizeof(grantOverlapped));
+        grantOverlapped.hEvent = grantEvent;
+        ResetEvent(grantEvent);
+        // A write that fails outright is left for the connection's next read or write to report.
+        BOOL result = WriteFile(pipeHandle, grantFrame, sizeof(grantFrame), NULL, &grantOverlapped);
+        grantWriting = result || GetLastError() == ERROR_IO_PENDING;
+        return true;
+    }
+
+    // Activity flags for the heartbeat monitor, which clears them on each tick.
+    void noteDataReceived() {
+        InterlockedExchange(&dataReceived, 1);
+    }
+
+    bool takeDataReceived() {
+        return InterlockedExchange(&dataReceived, 0) != 0;
+    }
+
+    void noteDataSent() {
+        InterlockedExchange(&dataSent, 1);
+    }
+
+    bool takeDataSent() {
+        return InterlockedExchange(&dataSent, 0) != 0;
+    }
+
+    // A byte read ahead by a selector's readiness probe, returned by readPipe before anything still in the pipe.
+    void setLookahead(char byte) {
+        lookahead = byte;
+        InterlockedExchange(&lookaheadHeld, 1);
+    }
+
+    bool hasLookahead() {
+        return lookaheadHeld != 0;
+    }
+
+    bool takeLookahead(char& byte) {
+        if (lookaheadHeld == 0 || InterlockedExchange(&lookaheadHeld, 0) == 0) {
+            return false;
+        }
+        byte = lookahead;
+        return true;
+    }
+
+    void stop() {
+        checkWindowsResult(SetEvent(stoppedEvent), "SetEvent");
+    }
+
+    stats::PipeStats& getStats() {
+        return pipeStats;
+    }
+
+private:
+    std::string pipeName;
+    bool privatePipe;
+    ScopedFileHandle pipeHandle;
+    ScopedHandle stoppedEvent;
+    ScopedHandle peerDeadEvent;
+    int options;
+    int protocolVersion;
+    int peerBufferSize;
+    boost::mutex writeMutex;
+    std::vector<char> writeBuffer;
+    std::vector<char> readBuffer;
+    std::vector<char> pendingMessage;
+    bool messagePending;
+    boost::mutex readMutex;
+    std::deque<std::vector<char> > queuedMessages;
+    boost::mutex flowMutex;
+    boost::condition_variable flowChanged;
+    int writeCredit;
+    int consumedMessages;
+    int unsentGrant;
+    char grantFrame[sizeof(int) + CONTROL_FRAME_SIZE];
+    OVERLAPPED grantOverlapped;
+    ScopedHandle grantEvent;
+    bool grantWriting;
+    volatile LONG dataReceived;
+    volatile LONG dataSent;
+    char lookahead;
+    volatile LONG lookaheadHeld;
+    stats::PipeStats pipeStats;
+};
+
+// Holds a connection's read mutex.  Releasing it wakes writers waiting for credit, since they may need to read
+// the peer's credit grants themselves.
+class ReadLock {
+public:
+    ReadLock(PipeInfo* pipeInfo, bool alreadyLocked = false) : pipeInfo(pipeInfo) {
+        if (!alreadyLocked) {
+            pipeInfo->getReadMutex().lock();
+        }
+    }
+
+    ~ReadLock() {
+        pipeInfo->getReadMutex().unlock();
+        if (pipeInfo->getOptions() & XPNP_OPTION_FLOW_CONTROL) {
+            boost::mutex::scoped_lock lock(pipeInfo->getFlowMutex());
+            pipeInfo->getFlowChanged().notify_all();
+        }
+    }
+
+private:
+    PipeInfo* pipeInfo;
+};
+
+// One thread serving every connection using XPNP_OPTION_HEARTBEAT.  Each interval it sends a ping on connections
+// that have sent nothing else, and counts an interval as missed if nothing arrived and nothing is waiting to be
+// read.  After maxMissed intervals in a row the peer is taken to be dead, which wakes any blocked readers.  Pings
+// are written without waiting for them, and a connection only has one in flight.  The thread exits when there
+// are no connections to watch.
+class HeartbeatMonitor {
+public:
+    HeartbeatMonitor() : intervalMsecs(DEFAULT_HEARTBEAT_INTERVAL_MSECS), maxMissed(DEFAULT_HEARTBEAT_MAX_MISSED),
+            running(false) {
+    }
+
+    void configure(int intervalMsecs, int maxMissed) {
+        boost::mutex::scoped_lock lock(mutex);
+        this->intervalMsecs = intervalMsecs;
+        this->maxMissed = maxMissed;
+        changed.notify_all();
+    }
+
+    void add(PipeInfo* pipeInfo) {
+        boost::mutex::scoped_lock lock(mutex);
+        Watch* watch = new Watch();
+        watch->pingEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (watch->pingEvent == NULL) {
+            delete watch;
+            throwWindowsError("CreateEvent");
+        }
+        watches[pipeInfo] = watch;
+        if (!running) {
+            running = true;
+            boost::thread(&HeartbeatMonitor::run, this);
+        }
+    }
+
+    // Waits for the monitor thread to let go of the connection, which it does after any ping in flight ends.
+    void remove(PipeInfo* pipeInfo) {
+        boost::mutex::scoped_lock lock(mutex);
+        std::map<PipeInfo*, Watch*>::iterator it = watches.find(pipeInfo);
+        if (it == watches.end()) {
+            return;
+        }
+        it->second->removed = true;
+        changed.notify_all();
+        while (watches.find(pipeInfo) != watches.end()) {
+            changed.wait(lock);
+        }
+    }
+
+private:
+    struct Watch {
+        Watch() : missed(0), pinging(false), removed(false) {
+            memset(&overlapped, 0, sizeof(overlapped));
+        }
+
+        ScopedHandle pingEvent;
+        OVERLAPPED overlapped;
+        char ping[sizeof(int) + CONTROL_FRAME_SIZE];
+        int missed;
+        bool pinging;
+        bool removed;
+    };
+
+    // Called on the monitor thread with the mutex held.
+    void sendPing(PipeInfo* pipeInfo, Watch* watch) {
+        boost::mutex& writeMutex = pipeInfo->getWriteMutex();
+        if (!writeMutex.try_lock()) {
+            return;
+        }
+        int header = htonl(CONTROL_FRAME_SIZE | CONTROL_FLAG);
+        memset(watch->ping, 0, sizeof(watch->ping));
+        memcpy(watch->ping, &header, sizeof(header));
+        watch->ping[sizeof(int)] = CONTROL_PING;
+
+        memset(&watch->overlapped, 0, sizeof(watch->overlapped));
+        watch->overlapped.hEvent = watch->pingEvent;
+        ResetEvent(watch->pingEvent);
+        // A write queued while holding the write mutex cannot land inside another frame.
+        BOOL result = WriteFile(pipeInfo->getPipeHandle(), watch->ping, sizeof(watch->ping), NULL, &watch->overlapped);
+        watch->pinging = result || GetLastError() == ERROR_IO_PENDING;
+        writeMutex.unlock();
+    }
+
+    // Called on the monitor thread with the mutex held.  Returns false once the watch can be discarded.
+    bool check(PipeInfo* pipeInfo, Watch* watch) {
+        if (watch->pinging && HasOverlappedIoCompleted(&watch->overlapped)) {
+            watch->pinging = false;
+        }
+        if (watch->removed) {
+            if (watch->pinging) {
+                DWORD unused = 0;
+                CancelIo(pipeInfo->getPipeHandle());
+                GetOverlappedResult(pipeInfo->getPipeHandle(), &watch->overlapped, &unused, TRUE);
+            }
+            return false;
+        }
+
+        DWORD bytesAvailable = 0;
+        PeekNamedPipe(pipeInfo->getPipeHandle(), NULL, 0, NULL, &bytesAvailable, NULL);
+        if (pipeInfo->takeDataReceived() || bytesAvailable > 0 || pipeInfo->hasLookahead()) {
+            watch->missed = 0;
+        } else if (++watch->missed >= maxMissed) {
+            SetEvent(pipeInfo->getPeerDeadEvent());
+        }
+
+        if (!pipeInfo->takeDataSent() && !watch->pinging) {
+            sendPing(pipeInfo, watch);
+        }
+        return true;
+    }
+
+    void run() {
+        boost::mutex::scoped_lock lock(mutex);
+        boost::system_time nextTick = boost::get_system_time() + boost::posix_time::milliseconds(intervalMsecs);
+        while (!watches.empty()) {
+            changed.timed_wait(lock, nextTick);
+            bool tick = boost::get_system_time() >= nextTick;
+            if (tick) {
+                nextTick = boost::get_system_time() + boost::posix_time::milliseconds(intervalMsecs);
+            }
+
+            bool removedAny = false;
+            std::map<PipeInfo*, Watch*>::iterator it = watches.begin();
+            while (it != watches.end()) {
+                if ((tick || it->second->removed) && !check(it->first, it->second)) {
+                    delete it->second;
+                    watches.erase(it++);
+                    removedAny = true;
+                } else {
+                    ++it;
+                }
+            }
+            if (removedAny) {
+                changed.notify_all();
+            }
+        }
+        running = false;
+    }
+
+    int intervalMsecs;
+    int maxMissed;
+
+    boost::mutex mutex;
+    boost::condition_variable changed;
+    std::map<PipeInfo*, Watch*> watches;
+    bool running;
+};
+
+// Globals
+static boost::thread_specific_ptr<ErrorSlot> GBL_errorSlot;
+static HeartbeatMonitor GBL_heartbeatMonitor;
+// Every open pipe, keyed by its XPNP_PipeHandle.
+static handles::HandleTable<PipeInfo> GBL_pipes;
+// The process token's user cannot change, so its SID is looked up once.
+static boost::mutex GBL_userSidMutex;
+static std::string GBL_userSid;
+
+static volatile LONG GBL_latencyEnabled = 0;
+static stats::LatencyHistograms GBL_latencies;
+
+// A reference to an open pipe, which keeps its PipeInfo alive until it goes out of scope, even if the pipe is
+// closed meanwhile.
+class PipeRef {
+public:
+    PipeRef() : handle(NULL), pipeInfo(NULL) {
+    }
+
+    explicit PipeRef(XPNP_PipeHandle handle) : handle(NULL), pipeInfo(NULL) {
+        acquire(handle);
+    }
+
+    ~PipeRef() {
+        if (pipeInfo != NULL) {
+            releasePipe(handle);
+        }
+    }
+
+    void acquire(XPNP_PipeHandle handle) {
+        pipeInfo = holdPipe(handle);
+        this->handle = handle;
+    }
+
+    PipeInfo* get() const {
+        return pipeInfo;
+    }
+
+    PipeInfo* operator->() const {
+        return pipeInfo;
+    }
+
+    operator PipeInfo*() const {
+        return pipeInfo;
+    }
+
+private:
+    PipeRef(const PipeRef&);
+    PipeRef& operator=(const PipeRef&);
+
+    XPNP_PipeHandle handle;
+    PipeInfo* pipeInfo;
+};
+
+// Local function definitions
+
+static ErrorSlot& getErrorSlot() {
+    ErrorSlot* slot = GBL_errorSlot.get();
+    if (slot == NULL) {
+        slot = new ErrorSlot();
+        GBL_errorSlot.reset(slot);
+    }
+    return *slot;
+}
+
+static void formatError(const ErrorSlot& slot, char* buffer, int bufLen) {
+    if (slot.windowsError == 0) {
+        strcpy_s(buffer, bufLen, slot.context);
+        return;
+    }
+    char systemMsg[512] = "";
+    FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, slot.windowsError, 0,
+            systemMsg, sizeof(systemMsg), NULL);
+    _snprintf_s(buffer, bufLen, _TRUNCATE, "%s failed with %lu: %s", slot.context, slot.windowsError, systemMsg);
+}
+
+// Turns an error recorded with setError into an exception, for callers where it is not routine.
+static void throwRecordedError() {
+    ErrorSlot& slot = getErrorSlot();
+    char message[1024] = "";
+    formatError(slot, message, sizeof(message));
+    throw ErrorInfo(message, slot.errorCode);
+}
+
+void setError(int errorCode, const char* context, DWORD windowsError) {
+    ErrorSlot& slot = getErrorSlot();
+    slot.errorCode = errorCode;
+    slot.context = context;
+    slot.windowsError = windowsError;
+    slot.hasMessage = false;
+}
+
+static void setErrorInfo(const std::string& errorMessage, int errorCode) {
+    ErrorSlot& slot = getErrorSlot();
+    slot.errorCode = errorCode;
+    slot.context = "";
+    slot.windowsError = 0;
+    // Reuses the string's existing capacity where it can.
+    slot.message.assign(errorMessage);
+    slot.hasMessage = true;
+}
+
+int recordError(const std::exception& e) {
+    int errorCode = XPNP_ERROR_SYSTEM;
+    const ErrorInfo* info = dynamic_cast<const ErrorInfo*>(&e);
+    if (info != NULL && info->getErrorCode() != 0) {
+        errorCode = info->getErrorCode();
+    } else if (dynamic_cast<const std::invalid_argument*>(&e) != NULL) {
+        errorCode = XPNP_ERROR_INVALID_ARGUMENT;
+    }
+    setErrorInfo(e.what(), errorCode);
+    return errorCode;
+}
+
+static std::string lookupUserSid() {
+    bool error = false;
+    std::exception except;
+
+    HANDLE tokenHandle = NULL;
+    PTOKEN_USER pUserInfo = NULL;
+    char* pSidString = NULL;
+    std::string sid;
+    try {
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &tokenHandle)) {
+            throwWindowsError("OpenThreadToken");
+        }
+        DWORD userInfoSize = 0;
+        GetTokenInformation(tokenHandle, TokenUser, NULL, 0, &userInfoSize);
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+            throwWindowsError("GetTokenInformation");
+        }
+        pUserInfo = (PTOKEN_USER)malloc(userInfoSize);
+        if (pUserInfo == NULL) {
+            throw std::bad_alloc();
+        }
+        if (!GetTokenInformation(tokenHandle, TokenUser, pUserInfo, userInfoSize, &userInfoSize)) {
+            throwWindowsError("GetTokenInformation");
+        }
+        if (!ConvertSidToStringSidA(pUserInfo->User.Sid, &pSidString)) {
+            throwWindowsError("ConvertSidToStringSid");
+        }
+        sid = pSidString;
+            
+    } catch (std::exception& e) {
+        error = true;
+        except = e;
+    }
+    if (tokenHandle != NULL) {
+        CloseHandle(tokenHandle);
+    }
+    if (pUserInfo != NULL) {
+        free(pUserInfo);
+    }
+    if (pSidString != NULL) {
+        LocalFree(pSidString);
+    }
+    if (error) {
+        throw except;
+    }
+    return sid;
+}
+
+static std::string getUserSid() {
+    boost::mutex::scoped_lock lock(GBL_userSidMutex);
+    if (GBL_userSid.empty()) {
+        GBL_userSid = lookupUserSid();
+    }
+    return GBL_userSid;
+}
+
+static std::string createUuid() {
+    boost::uuids::uuid uuid = boost::uuids::random_generator()();
+    std::stringstream stream;
+    stream << uuid;
+    return stream.str();
+}
+
+static HANDLE createPipe(const std::string& pipeName, bool privatePipe) {
+    bool error = false;
+    std::exception except;
+
+    HANDLE pipeHandle = INVALID_HANDLE_VALUE;
+    SECURITY_ATTRIBUTES* pSA = NULL;
+    try {
+        if (privatePipe) {
+            pSA = new SECURITY_ATTRIBUTES;
+
+            pSA->nLength = sizeof(SECURITY_ATTRIBUTES);
+            pSA->bInheritHandle = FALSE;
+            pSA->lpSecurityDescriptor = NULL;
+            std::string userSid = getUserSid();
+
+            // Allow GA access (generic all, i.e. full control) to the local system account, builtin administrators,
+            // and the current user's SID.  Inheritance is disabled (I don't think inheritance has any meaning in the context of
+            // pipes).  Because there is no inheritance, there is need to mention CO (creator owner).  CO represents the SID of a 
+            // user who creates a new object underneath a given object.  Deny access to processes on other machines 
+            // (whose token contains NU, the network logon user SID).
+            std::string sddl = "D:(A;;GA;;;SY)(A;;GA;;;BA)(A;;GA;;;";
+            sddl.append(userSid);
+            sddl.append(")(D;;GA;;;NU)");
+            if (!ConvertStringSecurityDescriptorToSecurityDescriptorA(sddl.c_str(), SDDL_REVISION_1, &(pSA->lpSecurityDescriptor), NULL)) {
+                throwWindowsError("ConvertStringSecurityDescriptorToSecurityDescriptor");
+            }
+        }
+        pipeHandle = CreateNamedPipe(toUtf16(pipeName).c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                PIPE_WAIT, PIPE_UNLIMITED_INSTANCES, PIPE_BUF_SIZE, PIPE_BUF_SIZE, 0, pSA);
+        if (pipeHandle == INVALID_HANDLE_VALUE) {
+            throwWindowsError("CreateNamedPipe");
+        }
+    } catch (std::exception& e) {
+        error = true;
+        except = e;
+    }
+
+    if (pSA != NULL) {
+        if (pSA->lpSecurityDescriptor != NULL) {
+            LocalFree(pSA->lpSecurityDescriptor);
+        }
+        delete pSA;
+    }
+    if (error) {
+        throw except;
+    }
+    return pipeHandle;
+}
+
+static std::string makePipeName(const std::string& baseName, bool userLocal) {
+    std::stringstream pipeName;
+    const char* PIPE_PREFIX = "\\\\.\\pipe\\";
+
+    if (userLocal) {
+        pipeName << PIPE_PREFIX << getUserSid() << "\\" << baseName;
+    } else {
+        pipeName << PIPE_PREFIX << baseName;
+    }
+    return pipeName.str();
+}
+
+// The start time of a call to be timed for the latency histograms, or 0 if they are off.
+static __int64 startLatency() {
+    return GBL_latencyEnabled != 0 ? stats::getTicks() : 0;
+}
+
+static void recordLatency(__int64 startTicks, int operation, stats::PipeStats* pipeStats) {
+    if (startTicks == 0) {
+        return;
+    }
+    __int64 micros = stats::ticksToMicros(stats::getTicks() - startTicks);
+    GBL_latencies.get(operation).record(micros);
+    if (pipeStats != NULL) {
+        pipeStats->getLatencyHistogram(operation).record(micros);
+    }
+}
+
+static bool isPipeClosedError(DWORD error) {
+    return error == ERROR_BROKEN_PIPE || error == ERROR_PIPE_NOT_CONNECTED;
+}
+
+int getRemainingMsecs(const boost::system_time& deadline, int timeoutMsecs) {
+    if (timeoutMsecs < 0) {
+        return timeoutMsecs;
+    }
+    boost::posix_time::time_duration remaining = deadline - boost::get_system_time();
+    return remaining.is_negative() ? 0 : (int)remaining.total_milliseconds();
+}
+
+// pipeStats, if given, is the connection's to count the write against.  Returns false, with the error recorded, if
+// it times out.
+static bool writeBytes(HANDLE pipeHandle, const char* pipeMsg, int bytesToWrite, int timeoutMsecs = -1,
+        stats::PipeStats* pipeStats = NULL) {
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+
+    ScopedHandle evt = overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    evt.check("CreateEvent");
+
+    if (pipeStats != NULL) {
+        pipeStats->writeCalls.increment();
+    }
+    __int64 startTicks = startLatency();
+    DWORD bytesWritten = 0;
+    BOOL writeResult = WriteFile(pipeHandle, pipeMsg, bytesToWrite, &bytesWritten, &overlapped);
+    if (!writeResult && GetLastError() == ERROR_IO_PENDING){
+        stats::WaitTimer waitTimer(pipeStats != NULL ? &pipeStats->writeWaitMicros : NULL);
+        if (timeoutMsecs >= 0) {
+            DWORD waitResult = WaitForSingleObject(evt, timeoutMsecs);
+            if (waitResult == WAIT_FAILED || waitResult == WAIT_TIMEOUT) {
+                std::string errorMsg = getWindowsErrorMessage("WaitForSingleObject");
+                CancelIo(pipeHandle);
+                GetOverlappedResult(pipeHandle, &overlapped, &bytesWritten, TRUE);
+                if (waitResult == WAIT_FAILED) {
+                    throw std::runtime_error(errorMsg);
+                } else {
+                    if (pipeStats != NULL) {
+                        pipeStats->timeouts.increment();
+                    }
+                    setError(XPNP_ERROR_TIMEOUT, "Timed out while writing");
+                    return false;
+                }
+            }
+        }
+        writeResult = GetOverlappedResult(pipeHandle, &overlapped, &bytesWritten, TRUE);
+    }
+
+    if (!writeResult && isPipeClosedError(GetLastError())) {
+        throw ErrorInfo(getWindowsErrorMessage("WriteFile"), XPNP_ERROR_PIPE_CLOSED);
+    }
+    checkWindowsResult(writeResult, "WriteFile");
+    recordLatency(startTicks, XPNP_LATENCY_WRITE, pipeStats);
+    if (pipeStats != NULL) {
+        pipeStats->bytesWritten.add(bytesWritten);
+    }
+    return true;
+}
+
+static int readPipe(PipeInfo* pipeInfo, char* buffer, int bufLen, int timeoutMsecs) {
+    stats::PipeStats& pipeStats = pipeInfo->getStats();
+    if (pipeInfo->takeLookahead(buffer[0])) {
+        pipeStats.bytesRead.increment();
+        // Add whatever else has already arrived, which can be read without waiting.
+        DWORD bytesAvailable = 0;
+        if (bufLen > 1 && PeekNamedPipe(pipeInfo->getPipeHandle(), NULL, 0, NULL, &bytesAvailable, NULL) &&
+                bytesAvailable > 0) {
+            int bytesToRead = bytesAvailable < (DWORD)(bufLen - 1) ? (int)bytesAvailable : bufLen - 1;
+            int bytesRead = readPipe(pipeInfo, buffer + 1, bytesToRead, -1);
+            if (bytesRead != READ_FAILED) {
+                return 1 + bytesRead;
+            }
+        }
+        return 1;
+    }
+
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+
+    ScopedHandle evt = overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    evt.check("CreateEvent");
+
+    pipeStats.readCalls.increment();
+    __int64 startTicks = startLatency();
+    int bytesRead = 0;
+    BOOL result = ReadFile(pipeInfo->getPipeHandle(), buffer, bufLen, (LPDWORD)&bytesRead, &overlapped);
+    DWORD errorCode = GetLastError();
+    if (!result && errorCode != ERROR_IO_PENDING) {
+        if (isPipeClosedError(errorCode)) {
+            setError(XPNP_ERROR_PIPE_CLOSED, "ReadFile", errorCode);
+            return READ_FAILED;
+        }
+        throwWindowsError("ReadFile");
+    }
+    if (GetLastError() == ERROR_IO_PENDING) {
+        stats::WaitTimer waitTimer(&pipeStats.readWaitMicros);
+        HANDLE handles[3] = {pipeInfo->getStoppedEvent(), evt, pipeInfo->getPeerDeadEvent()};
+        DWORD waitResult = WaitForMultipleObjects(3, handles, FALSE, timeoutMsecs);
+        if (waitResult != WAIT_OBJECT_0 + 1) {
+            DWORD waitError = GetLastError();
+            CancelIo(pipeInfo->getPipeHandle());
+
+            DWORD unused = 0;
+            GetOverlappedResult(pipeInfo->getPipeHandle(), &overlapped, &unused, TRUE);
+
+            if (waitResult == WAIT_TIMEOUT) {
+                // Routine for callers that poll, so recorded without formatting a message or throwing.
+                pipeStats.timeouts.increment();
+                setError(XPNP_ERROR_TIMEOUT, "Timed out while reading message");
+                return READ_FAILED;
+            } else if (waitResult == WAIT_FAILED) {
+                SetLastError(waitError);
+                throwWindowsError("WaitForMultipleObjects");
+            } else if (waitResult == WAIT_OBJECT_0) {
+                pipeStats.interruptions.increment();
+                setError(XPNP_ERROR_INTERRUPTED, "Interrupted while reading message");
+                return READ_FAILED;
+            } else {
+                setError(XPNP_ERROR_PEER_DEAD, "Peer stopped responding to heartbeats");
+                return READ_FAILED;
+            }
+        }
+        result = GetOverlappedResult(pipeInfo->getPipeHandle(), &overlapped, (LPDWORD)&bytesRead, TRUE);
+        if (!result && isPipeClosedError(GetLastError())) {
+            setError(XPNP_ERROR_PIPE_CLOSED, "GetOverlappedResult", GetLastError());
+            return READ_FAILED;
+        }
+        checkWindowsResult(result, "GetOverlappedResult");
+    }
+    recordLatency(startTicks, XPNP_LATENCY_READ, &pipeStats);
+    pipeStats.bytesRead.add(bytesRead);
+    if (bytesRead < bufLen) {
+        pipeStats.partialReads.increment();
+    }
+    pipeInfo->noteDataReceived();
+    return bytesRead;
+}
+
+// A timeout or stop once part of a frame has been read leaves the stream out of step, so it is recorded as a
+// protocol error rather than as something the caller could retry.
+static void recordPartialRead() {
+    int errorCode = getErrorSlot().errorCode;
+    if (errorCode == XPNP_ERROR_TIMEOUT || errorCode == XPNP_ERROR_INTERRUPTED) {
+        setError(XPNP_ERROR_PROTOCOL, "Read stopped in the middle of a message; the connection can no longer be used");
+    }
+}
+
+// Returns false, with the error recorded, if readPipe fails.
+static bool readBytes(PipeInfo* pipeInfo, char* buffer, int bytesToRead, int timeoutMsecs) {
+    int totalBytesRead = 0;
+    while (totalBytesRead < bytesToRead) {
+        int bytesRead = readPipe(pipeInfo, buffer + totalBytesRead, bytesToRead - totalBytesRead, timeoutMsecs);
+        if (bytesRead == READ_FAILED) {
+            if (totalBytesRead > 0) {
+                recordPartialRead();
+            }
+            return false;
+        }
+        totalBytesRead += bytesRead;
+    }
+    return true;
+}
+
+// For data that must follow what has already been read, where failing to get it is not routine and is thrown.
+static void readRemainingBytes(PipeInfo* pipeInfo, char* buffer, int bytesToRead, int timeoutMsecs) {
+    if (!readBytes(pipeInfo, buffer, bytesToRead, timeoutMsecs)) {
+        recordPartialRead();
+        throwRecordedError();
+    }
+}
+
+// Frames up to COALESCE_LIMIT are assembled in frame so that the length and body go out in one WriteFile.  Returns
+// false, with the error recorded, if it times out.
+static bool writeMessage(HANDLE pipeHandle, const char* msg, int msgLen, std::vector<char>& frame, int timeoutMsecs = -1,
+        stats::PipeStats* pipeStats = NULL) {
+    int msgLenNetwork = htonl(msgLen);
+    if (msgLen <= COALESCE_LIMIT) {
+        frame.resize(sizeof(msgLenNetwork) + msgLen);
+        memcpy(&frame[0], &msgLenNetwork, sizeof(msgLenNetwork));
+        if (msgLen > 0) {
+            memcpy(&frame[sizeof(msgLenNetwork)], msg, msgLen);
+        }
+        return writeBytes(pipeHandle, &frame[0], (int)frame.size(), timeoutMsecs, pipeStats);
+    }
+    boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeoutMsecs);
+    return writeBytes(pipeHandle, (const char*)&msgLenNetwork, sizeof(msgLenNetwork), timeoutMsecs, pipeStats)
+            && writeBytes(pipeHandle, msg, msgLen, getRemainingMsecs(deadline, timeoutMsecs), pipeStats);
+}
+
+static void readMessage(PipeInfo* pipeInfo, std::vector<char>& msg, int timeoutMsecs){
+    int msgLen = 0;
+    if (!readBytes(pipeInfo, (char*)&msgLen, sizeof(msgLen), timeoutMsecs)) {
+        throwRecordedError();
+    }
+    msgLen = ntohl(msgLen);
+
+    if (msgLen > 0) {
+        msg.resize(msgLen);
+        readRemainingBytes(pipeInfo, &(msg[0]), msgLen, timeoutMsecs);
+    }
+}
+
+// Starts writing any credit granted to the peer but not yet written.  Called with the write mutex held.  Returns
+// false if a grant is still waiting because the last one is still being written.
+static bool flushCreditGrant(PipeInfo* pipeInfo) {
+    boost::mutex::scoped_lock flowLock(pipeInfo->getFlowMutex());
+    int credit = pipeInfo->getUnsentGrant();
+    if (credit == 0) {
+        return true;
+    }
+    if (!pipeInfo->startGrantWrite(credit)) {
+        return false;
+    }
+    pipeInfo->setUnsentGrant(0);
+    pipeInfo->noteDataSent();
+    return true;
+}
+
+// Writes unsent credit grants unless another thread holds the write mutex, in which case that thread writes them
+// once it releases it.  Never blocks.
+static void sendCreditGrants(PipeInfo* pipeInfo) {
+    while (true) {
+        {
+            boost::mutex::scoped_lock flowLock(pipeInfo->getFlowMutex());
+            if (pipeInfo->getUnsentGrant() == 0) {
+                return;
+            }
+        }
+        if (!pipeInfo->getWriteMutex().try_lock()) {
+            return;
+        }
+        bool flushed = flushCreditGrant(pipeInfo);
+        pipeInfo->getWriteMutex().unlock();
+        if (!flushed) {
+            return;
+        }
+    }
+}
+
+static void readControlFrame(PipeInfo* pipeInfo, int frameLen, int timeoutMsecs) {
+    if (frameLen != CONTROL_FRAME_SIZE) {
+        throw ErrorInfo("Invalid control frame length", XPNP_ERROR_PROTOCOL);
+    }
+    char frame[CONTROL_FRAME_SIZE];
+    readRemainingBytes(pipeInfo, frame, CONTROL_FRAME_SIZE, timeoutMsecs);
+    int value = 0;
+    memcpy(&value, frame + 1, sizeof(value));
+    value = ntohl(value);
+
+    if (frame[0] == CONTROL_CREDIT) {
+        boost::mutex::scoped_lock lock(pipeInfo->getFlowMutex());
+        pipeInfo->setWriteCredit(pipeInfo->getWriteCredit() + value);
+        pipeInfo->getFlowChanged().notify_all();
+    } else if (frame[0] != CONTROL_PING) {
+        throw ErrorInfo("Unknown control frame type", XPNP_ERROR_PROTOCOL);
+    }
+}
+
+// Reads the next frame header.  Control frames are handled here.  Called with the read mutex held.
+static FrameHeaderResult readFrameHeader(PipeInfo* pipeInfo, unsigned int& header, int timeoutMsecs) {
+    if (!readBytes(pipeInfo, (char*)&header, sizeof(header), timeoutMsecs)) {
+        return FRAME_FAILED;
+    }
+    header = ntohl(header);
+    if ((pipeInfo->getOptions() & CONTROL_FRAME_OPTIONS) && (header & CONTROL_FLAG) && !(header & COMPRESSED_FLAG)) {
+        readControlFrame(pipeInfo, (int)(header & ~CONTROL_FLAG), timeoutMsecs);
+        return FRAME_CONTROL;
+    }
+    return FRAME_DATA;
+}
+
+static void readCompressedBody(PipeInfo* pipeInfo, unsigned int header, std::vector<char>& msg, int timeoutMsecs) {
+    if (!(pipeInfo->getOptions() & XPNP_OPTION_COMPRESSION)) {
+        throw ErrorInfo("Received compressed message on a connection without compression", XPNP_ERROR_PROTOCOL);
+    }
+    int frameLen = (int)(header & ~COMPRESSED_FLAG);
+    if (frameLen <= (int)sizeof(int) || frameLen - (int)sizeof(int) >= MAX_COMPRESSED_MESSAGE_SIZE) {
+        throw ErrorInfo("Invalid compressed message length", XPNP_ERROR_PROTOCOL);
+    }
+    std::vector<char>& frame = pipeInfo->getReadBuffer();
+    frame.resize(frameLen);
+    readRemainingBytes(pipeInfo, &frame[0], frameLen, timeoutMsecs);
+
+    int rawLen = 0;
+    memcpy(&rawLen, &frame[0], sizeof(rawLen));
+    rawLen = ntohl(rawLen);
+    int compressedLen = frameLen - (int)sizeof(int);
+    if (rawLen <= 0 || rawLen > MAX_COMPRESSED_MESSAGE_SIZE || rawLen / MAX_COMPRESSION_RATIO > compressedLen) {
+        throw ErrorInfo("Invalid compressed message length", XPNP_ERROR_PROTOCOL);
+    }
+    msg.resize(rawLen);
+    try {
+        compress::decompressBlock(&frame[sizeof(int)], compressedLen, &msg[0], rawLen);
+    } catch (std::runtime_error& e) {
+        throw ErrorInfo(e.what(), XPNP_ERROR_PROTOCOL);
+    }
+}
+
+static void readBody(PipeInfo* pipeInfo, unsigned int header, std::vector<char>& msg, int timeoutMsecs) {
+    if (header & COMPRESSED_FLAG) {
+        readCompressedBody(pipeInfo, header, msg, timeoutMsecs);
+    } else {
+        msg.resize(header);
+        if (header > 0) {
+            readRemainingBytes(pipeInfo, &msg[0], (int)header, timeoutMsecs);
+        }
+    }
+}
+
+// Waits until the peer has granted credit to send a message, and takes it.  The caller must not hold the write
+// mutex, since a reader granting credit to the peer needs it.  If no other thread is reading, the peer's grants
+// are read here, and any messages ahead of them are queued for the next read.  Returns false, with the error
+// recorded, if it times out.
+static bool takeWriteCredit(PipeInfo* pipeInfo, const boost::system_time& deadline, int timeoutMsecs) {
+    boost::mutex::scoped_lock flowLock(pipeInfo->getFlowMutex());
+    while (pipeInfo->getWriteCredit() == 0) {
+        bool timedOut = false;
+        bool readFailed = false;
+        if (pipeInfo->getReadMutex().try_lock()) {
+            flowLock.unlock();
+            {
+                ReadLock readLock(pipeInfo, true);
+                unsigned int header = 0;
+                FrameHeaderResult result = readFrameHeader(pipeInfo, header, getRemainingMsecs(deadline, timeoutMsecs));
+                if (result == FRAME_DATA) {
+                    std::deque<std::vector<char> >& queued = pipeInfo->getQueuedMessages();
+                    queued.push_back(std::vector<char>());
+                    try {
+                        readBody(pipeInfo, header, queued.back(), getRemainingMsecs(deadline, timeoutMsecs));
+                    } catch (ErrorInfo&) {
+                        queued.pop_back();
+                        throw;
+                    }
+                }
+                readFailed = result == FRAME_FAILED;
+            }
+            flowLock.lock();
+        } else if (timeoutMsecs < 0) {
+            pipeInfo->getFlowChanged().wait(flowLock);
+        } else {
+            timedOut = !pipeInfo->getFlowChanged().timed_wait(flowLock, deadline);
+        }
+        if (readFailed && getErrorSlot().errorCode != XPNP_ERROR_TIMEOUT) {
+            return false;
+        }
+        if ((readFailed || timedOut) && pipeInfo->getWriteCredit() == 0) {
+            pipeInfo->getStats().timeouts.increment();
+            setError(XPNP_ERROR_TIMEOUT, "Timed out waiting for write credit");
+            return false;
+        }
+    }
+    pipeInfo->setWriteCredit(pipeInfo->getWriteCredit() - 1);
+    return true;
+}
+
+// Returns false, with the error recorded, if it times out.  Called with the write mutex held.
+static bool writeFramedMessage(PipeInfo* pipeInfo, const char* msg, int msgLen, int timeoutMsecs) {
+    pipeInfo->noteDataSent();
+
+    if ((pipeInfo->getOptions() & XPNP_OPTION_COMPRESSION) && msgLen >= COMPRESSION_THRESHOLD &&
+            msgLen <= MAX_COMPRESSED_MESSAGE_SIZE) {
+        const int HEADER_SIZE = 2 * sizeof(int);
+        std::vector<char>& frame = pipeInfo->getWriteBuffer();
+        frame.resize(HEADER_SIZE + msgLen - 1);
+
+        int compressedLen = compress::compressBlock(msg, msgLen, &frame[HEADER_SIZE], msgLen - 1);
+        if (compressedLen > 0) {
+            int header[2] = {(int)htonl((sizeof(int) + compressedLen) | COMPRESSED_FLAG), (int)htonl(msgLen)};
+            memcpy(&frame[0], header, HEADER_SIZE);
+            if (!writeBytes(pipeInfo->getPipeHandle(), &frame[0], HEADER_SIZE + compressedLen, timeoutMsecs,
+                    &pipeInfo->getStats())) {
+                return false;
+            }
+            pipeInfo->getStats().messagesWritten.increment();
+            return true;
+        }
+    }
+    if (!writeMessage(pipeInfo->getPipeHandle(), msg, msgLen, pipeInfo->getWriteBuffer(), timeoutMsecs,
+            &pipeInfo->getStats())) {
+        return false;
+    }
+    pipeInfo->getStats().messagesWritten.increment();
+    return true;
+}
+
+// Returns false, with the error recorded, if it times out waiting for credit or writing.
+static bool sendMessage(PipeInfo* pipeInfo, const char* msg, int msgLen, int timeoutMsecs) {
+    boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeoutMsecs);
+    if ((pipeInfo->getOptions() & CONTROL_FRAME_OPTIONS) && (unsigned int)msgLen >= CONTROL_FLAG) {
+        throw std::invalid_argument("Message too long for a connection with flow control or heartbeats");
+    }
+    bool flowControl = (pipeInfo->getOptions() & XPNP_OPTION_FLOW_CONTROL) != 0;
+    if (flowControl && !takeWriteCredit(pipeInfo, deadline, timeoutMsecs)) {
+        return false;
+    }
+
+    bool written;
+    {
+        boost::mutex::scoped_lock lock(pipeInfo->getWriteMutex());
+        if (flowControl) {
+            flushCreditGrant(pipeInfo);
+        }
+        written = writeFramedMessage(pipeInfo, msg, msgLen, getRemainingMsecs(deadline, timeoutMsecs));
+    }
+    // Grants made by readers while this held the write mutex.
+    if (flowControl) {
+        sendCreditGrants(pipeInfo);
+    }
+    return written;
+}
+
+// Returns false, with the error recorded, if it times out or the pipe is closed before a message starts to
+// arrive, or if the message does not fit in buffer (leaving it pending, with msgLen set to its size).  Called
+// with the read mutex held.
+static bool takeMessage(PipeInfo* pipeInfo, char* buffer, int bufLen, int& msgLen, int timeoutMsecs) {
+    std::vector<char>& pending = pipeInfo->getPendingMessage();
+    std::deque<std::vector<char> >& queued = pipeInfo->getQueuedMessages();
+    if (!pipeInfo->isMessagePending() && !queued.empty()) {
+        pending.swap(queued.front());
+        queued.pop_front();
+        pipeInfo->setMessagePending(true);
+    }
+    if (!pipeInfo->isMessagePending()) {
+        unsigned int header = 0;
+        FrameHeaderResult result = FRAME_CONTROL;
+        while (result == FRAME_CONTROL) {
+            result = readFrameHeader(pipeInfo, header, timeoutMsecs);
+        }
+        if (result == FRAME_FAILED) {
+            return false;
+        }
+
+        if (header & COMPRESSED_FLAG) {
+            readCompressedBody(pipeInfo, header, pending, timeoutMsecs);
+        } else {
+            msgLen = (int)header;
+            if (msgLen <= bufLen) {
+                if (msgLen > 0) {
+                    readRemainingBytes(pipeInfo, buffer, msgLen, timeoutMsecs);
+                }
+                return true;
+            }
+            pending.resize(msgLen);
+            readRemainingBytes(pipeInfo, &pending[0], msgLen, timeoutMsecs);
+        }
+        pipeInfo->setMessagePending(true);
+    }
+
+    msgLen = (int)pending.size();
+    if (msgLen > bufLen) {
+        setError(XPNP_ERROR_BUFFER_TOO_SMALL, "Buffer too small for message");
+        return false;
+    }
+    if (msgLen > 0) {
+        memcpy(buffer, &pending[0], msgLen);
+    }
+    pipeInfo->setMessagePending(false);
+    return true;
+}
+
+// Returns false, with the error recorded, as takeMessage does.
+static bool receiveMessage(PipeInfo* pipeInfo, char* buffer, int bufLen, int& msgLen, int timeoutMsecs) {
+    bool received = false;
+    {
+        ReadLock readLock(pipeInfo);
+        received = takeMessage(pipeInfo, buffer, bufLen, msgLen, timeoutMsecs);
+    }
+    if (received) {
+        pipeInfo->getStats().messagesRead.increment();
+    }
+
+    if (received && (pipeInfo->getOptions() & XPNP_OPTION_FLOW_CONTROL)) {
+        bool granted = false;
+        {
+            boost::mutex::scoped_lock lock(pipeInfo->getFlowMutex());
+            int consumed = pipeInfo->getConsumedMessages() + 1;
+            granted = consumed >= CREDIT_GRANT_BATCH;
+            if (granted) {
+                pipeInfo->setUnsentGrant(pipeInfo->getUnsentGrant() + consumed);
+                consumed = 0;
+            }
+            pipeInfo->setConsumedMessages(consumed);
+        }
+        if (granted) {
+            sendCreditGrants(pipeInfo);
+        }
+    }
+    return received;
+}
+
+static std::string makeHello(int options) {
+    int fields[3] = {(int)htonl(options), (int)htonl(PROTOCOL_VERSION), (int)htonl(PIPE_BUF_SIZE)};
+    std::string hello(HELLO_MAGIC, sizeof(HELLO_MAGIC));
+    hello.append((const char*)fields, sizeof(fields));
+    return hello;
+}
+
+static bool parseHello(const char* msg, int msgLen, Hello& hello) {
+    if (msgLen < HELLO_V1_SIZE || memcmp(msg, HELLO_MAGIC, sizeof(HELLO_MAGIC)) != 0) {
+        return false;
+    }
+    int fields[3] = {0, 1, 0};
+    int fieldCount = msgLen >= HELLO_V2_SIZE ? 3 : 1;
+    memcpy(fields, msg + sizeof(HELLO_MAGIC), fieldCount * sizeof(int));
+    for (int i = 0; i < fieldCount; i++) {
+        fields[i] = ntohl(fields[i]);
+    }
+    hello = Hello(fields[1], fields[0], fields[2]);
+    return hello.version > 0;
+}
+
+// Splits the first handshake message into the reply pipe name and, if the client sent a hello, its hello.
+static bool parseConnectRequest(const std::vector<char>& msg, std::string& replyPipeName, Hello& clientHello) {
+    std::vector<char>::const_iterator nameEnd = std::find(msg.begin(), msg.end(), '\0');
+    replyPipeName.assign(msg.begin(), nameEnd);
+    if (nameEnd == msg.end()) {
+        return false;
+    }
+    int helloLen = (int)(msg.end() - nameEnd - 1);
+    return parseHello(&(*(nameEnd + 1)), helloLen, clientHello);
+}
+
+// Returns the server's hello, with the options it agreed to, or an empty hello for a legacy server (which
+// disconnects without replying).
+static Hello readHelloReply(PipeInfo* listeningPipe) {
+    std::vector<char> reply;
+    try {
+        readMessage(listeningPipe, reply, HANDSHAKE_TIMEOUT_MSECS);
+    } catch (ErrorInfo& info) {
+        if (info.getErrorCode() == XPNP_ERROR_PIPE_CLOSED) {
+            return Hello();
+        }
+        throw;
+    }
+    Hello serverHello;
+    if (reply.empty() || !parseHello(&reply[0], (int)reply.size(), serverHello)) {
+        throw ErrorInfo("Invalid handshake reply from server", XPNP_ERROR_PROTOCOL);
+    }
+    return serverHello;
+}
+
+// What each end records about the other once the hellos are exchanged.
+static Hello agreeHello(const Hello& peerHello, int localOptions) {
+    int version = peerHello.version < PROTOCOL_VERSION ? peerHello.version : PROTOCOL_VERSION;
+    return Hello(version, peerHello.options & localOptions, peerHello.bufferSize);
+}
+
+// Pings travel as framed control frames, which a raw read would return mixed in with the data.
+static void checkRawReadAllowed(PipeInfo* pipeInfo) {
+    if (pipeInfo->getOptions() & XPNP_OPTION_HEARTBEAT) {
+        throw std::invalid_argument("Connection uses heartbeats, so must be read with XPNP_readMessage");
+    }
+}
+
+// Disconnecting a listening pipe discards data the client has not read, so after sending the hello reply the server
+// waits for the client to close its end, which it does once it has read the reply.
+static void waitForClientClose(PipeInfo* listeningPipe, int timeoutMsecs) {
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+
+    ScopedHandle evt = overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    evt.check("CreateEvent");
+
+    char unexpected = 0;
+    DWORD unused = 0;
+    BOOL result = ReadFile(listeningPipe->getPipeHandle(), &unexpected, 1, &unused, &overlapped);
+    if (!result && GetLastError() == ERROR_IO_PENDING) {
+        HANDLE handles[2] = {listeningPipe->getStoppedEvent(), evt};
+        DWORD waitResult = WaitForMultipleObjects(2, handles, FALSE, timeoutMsecs);
+        if (waitResult != WAIT_OBJECT_0 + 1) {
+            DWORD waitError = GetLastError();
+            CancelIo(listeningPipe->getPipeHandle());
+            GetOverlappedResult(listeningPipe->getPipeHandle(), &overlapped, &unused, TRUE);
+            if (waitResult == WAIT_TIMEOUT) {
+                listeningPipe->getStats().timeouts.increment();
+                throw ErrorInfo("Timed out waiting for client to read handshake reply", XPNP_ERROR_TIMEOUT);
+            } else if (waitResult == WAIT_FAILED) {
+                SetLastError(waitError);
+                throwWindowsError("WaitForMultipleObjects");
+            } else {
+                listeningPipe->getStats().interruptions.increment();
+                throw ErrorInfo("Interrupted while waiting for client to read handshake reply", XPNP_ERROR_INTERRUPTED);
+            }
+        }
+        result = GetOverlappedResult(listeningPipe->getPipeHandle(), &overlapped, &unused, TRUE);
+    }
+    if (result) {
+        throw ErrorInfo("Unexpected data from client after handshake", XPNP_ERROR_PROTOCOL);
+    }
+    if (!isPipeClosedError(GetLastError())) {
+        throwWindowsError("ReadFile");
+    }
+}
+
+// Gives a new connection its handle; on failure the connection is closed.
+static XPNP_PipeHandle addPipe(PipeInfo* pipeInfo) {
+    try {
+        return (XPNP_PipeHandle)GBL_pipes.add(pipeInfo);
+    } catch (...) {
+        delete pipeInfo;
+        throw;
+    }
+}
+
+HANDLE getNativePipeHandle(XPNP_PipeHandle handle) {
+    PipeRef pipeInfo(handle);
+    return pipeInfo->getPipeHandle();
+}
+
+PipeInfo* holdPipe(XPNP_PipeHandle handle) {
+    if (handle == 0) {
+        throw std::invalid_argument("Pipe handle is null");
+    }
+    PipeInfo* pipeInfo = GBL_pipes.acquire(handle);
+    if (pipeInfo == NULL) {
+        throw std::invalid_argument("Pipe handle is closed or invalid");
+    }
+    return pipeInfo;
+}
+
+void releasePipe(XPNP_PipeHandle handle) {
+    GBL_pipes.release(handle);
+}
+
+HANDLE getNativePipeHandle(PipeInfo* pipeInfo) {
+    return pipeInfo->getPipeHandle();
+}
+
+void setLookahead(PipeInfo* pipeInfo, char byte) {
+    pipeInfo->setLookahead(byte);
+    pipeInfo->noteDataReceived();
+}
+
+bool hasLookahead(PipeInfo* pipeInfo) {
+    return pipeInfo->hasLookahead();
+}
+
+// Exported function definitions
+
+void XPNP_getErrorMessage(char* buffer, int bufLen) {
+    ErrorSlot* slot = GBL_errorSlot.get();
+    const char* errorMsg = "";
+    char formatted[1024] = "";
+    if (slot == NULL) {
+        // No error recorded on this thread.
+    } else if (slot->hasMessage) {
+        errorMsg = slot->message.c_str();
+    } else {
+        formatError(*slot, formatted, sizeof(formatted));
+        errorMsg = formatted;
+    }
+    if (strcpy_s(buffer, bufLen, errorMsg) != 0) {
+        strcpy_s(buffer, bufLen, "Buffer too small");
+    }
+}
+
+int XPNP_getErrorCode() {
+    ErrorSlot* slot = GBL_errorSlot.get();
+    int errorCode = 0;
+    if (slot != NULL) {
+        errorCode = slot->errorCode;
+    }
+    return errorCode;
+}
+
+int XPNP_makePipeName(const char* baseName, int userLocal, char* pipeNameBuf, int bufLen) {
+    try {
+        std::string fullPipeName = makePipeName(baseName, userLocal != 0);
+        if (strcpy_s(pipeNameBuf, bufLen, fullPipeName.c_str()) != 0) {
+            throw ErrorInfo("Buffer too small", XPNP_ERROR_BUFFER_TOO_SMALL);
+        }
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+XPNP_PipeHandle XPNP_createPipe(const char* pipeName, int privatePipe) {
+    return XPNP_createPipeEx(pipeName, privatePipe, 0);
+}
+
+XPNP_PipeHandle XPNP_createPipeEx(const char* pipeName, int privatePipe, int options) {
+    HANDLE pipeHandle = INVALID_HANDLE_VALUE;
+    try {
+        pipeHandle = createPipe(pipeName, privatePipe != 0);
+        PipeInfo* pipeInfo = new PipeInfo(pipeName, privatePipe != 0, pipeHandle, Hello(0, options));
+        // The PipeInfo owns the handle now.
+        pipeHandle = INVALID_HANDLE_VALUE;
+        return addPipe(pipeInfo);
+    } catch (std::exception& e) {
+        recordError(e);
+        if (pipeHandle != INVALID_HANDLE_VALUE) {
+            CloseHandle(pipeHandle);
+        }
+        return NULL;
+    }
+}
+
+int XPNP_stopPipe(XPNP_PipeHandle pipe) {
+    try {
+        PipeRef pipeInfo(pipe);
+        pipeInfo->stop();
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_closePipe(XPNP_PipeHandle pipe) {
+    try {
+        PipeRef pipeInfo(pipe);
+        if (pipeInfo->getOptions() & XPNP_OPTION_HEARTBEAT) {
+            GBL_heartbeatMonitor.remove(pipeInfo.get());
+        }
+        // Calls still using the pipe keep it until they return; this wakes one blocked waiting on it.
+        pipeInfo->stop();
+        if (!GBL_pipes.close(pipe)) {
+            throw std::invalid_argument("Pipe is already closed");
+        }
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_getOpenPipeCount() {
+    return GBL_pipes.getLiveCount();
+}
+
+XPNP_PipeHandle XPNP_acceptConnection(XPNP_PipeHandle pipe, int timeoutMsecs) {
+    __int64 startTicks = startLatency();
+    HANDLE newPipeHandle = INVALID_HANDLE_VALUE;
+    PipeRef pipeInfo;
+    XPNP_PipeHandle newPipe = NULL;
+    bool connectAttempted = false;
+    bool errorOccurred = false;
+
+    try {
+        pipeInfo.acquire(pipe);
+        boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeoutMsecs);
+
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+
+        ScopedHandle evt = overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        evt.check("CreateEvent");
+        
+        BOOL result = ConnectNamedPipe(pipeInfo->getPipeHandle(), &overlapped);
+        connectAttempted = true;
+
+        if (!result && GetLastError() == ERROR_IO_PENDING) {
+            DWORD unused = 0;
+            HANDLE handles[2] = {pipeInfo->getStoppedEvent(), evt};
+            DWORD waitResult = WaitForMultipleObjects(2, handles, FALSE, timeoutMsecs);
+            if (waitResult == WAIT_FAILED || waitResult == WAIT_TIMEOUT || waitResult == WAIT_OBJECT_0) {
+                DWORD waitError = GetLastError();
+                CancelIo(pipeInfo->getPipeHandle());
+                GetOverlappedResult(pipeInfo->getPipeHandle(), &overlapped, &unused, TRUE);
+                if (waitResult == WAIT_TIMEOUT) {
+                    // Routine for servers that poll, so recorded without formatting a message or throwing.
+                    pipeInfo->getStats().timeouts.increment();
+                    setError(XPNP_ERROR_TIMEOUT, "Timed out waiting for client to connect");
+                    DisconnectNamedPipe(pipeInfo->getPipeHandle());
+                    return NULL;
+                } else if (waitResult == WAIT_FAILED) {
+                    SetLastError(waitError);
+                    throwWindowsError("WaitForMultipleObjects");
+                } else {
+                    pipeInfo->getStats().interruptions.increment();
+                    throw ErrorInfo("Interrupted while waiting for client to connect", XPNP_ERROR_INTERRUPTED);
+                }
+            }
+            result = GetOverlappedResult(pipeInfo->getPipeHandle(), &overlapped, &unused, TRUE);
+        }
+        if (!result && GetLastError() != ERROR_PIPE_CONNECTED) {
+            throwWindowsError("ConnectNamedPipe");
+        }
+
+        std::vector<char> readBuf;
+        readMessage(pipeInfo, readBuf, getRemainingMsecs(deadline, timeoutMsecs));
+
+        std::string newPipeName;
+        Hello clientHello;
+        bool helloReceived = parseConnectRequest(readBuf, newPipeName, clientHello);
+
+        newPipeHandle = CreateFile(toUtf16(newPipeName).c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+
+        if (newPipeHandle == INVALID_HANDLE_VALUE) {
+            throwWindowsError("CreateFile");
+        }
+
+        Hello agreed;
+        if (helloReceived) {
+            agreed = agreeHello(clientHello, pipeInfo->getOptions());
+
+            std::string reply = makeHello(agreed.options);
+            std::vector<char> frame;
+            if (!writeMessage(pipeInfo->getPipeHandle(), reply.data(), (int)reply.length(), frame,
+                    getRemainingMsecs(deadline, timeoutMsecs), &pipeInfo->getStats())) {
+                throwRecordedError();
+            }
+            waitForClientClose(pipeInfo, getRemainingMsecs(deadline, timeoutMsecs));
+        }
+
+        PipeInfo* newPipeInfo = new PipeInfo(newPipeName, pipeInfo->isPrivatePipe(), newPipeHandle, agreed);
+        newPipeHandle = INVALID_HANDLE_VALUE;
+        newPipe = addPipe(newPipeInfo);
+        if (agreed.options & XPNP_OPTION_HEARTBEAT) {
+            try {
+                GBL_heartbeatMonitor.add(newPipeInfo);
+            } catch (...) {
+                GBL_pipes.close(newPipe);
+                newPipe = NULL;
+                throw;
+            }
+        }
+    } catch (std::exception& e) {
+        recordError(e);
+        errorOccurred = true;
+    }
+    if (errorOccurred) {
+        if (newPipeHandle != INVALID_HANDLE_VALUE) {
+            CloseHandle(newPipeHandle);
+        }
+    }
+    if (connectAttempted) {
+        DisconnectNamedPipe(pipeInfo->getPipeHandle());
+    }
+    if (newPipe != NULL) {
+        recordLatency(startTicks, XPNP_LATENCY_ACCEPT, &pipeInfo->getStats());
+    }
+    return newPipe;
+}
+
+int XPNP_readPipe(XPNP_PipeHandle pipe, char* buffer, int bufLen, int timeoutMsecs) {
+    try {
+        if (bufLen <= 0) {
+            throw std::invalid_argument("bufLen <= 0");
+        }
+        PipeRef pipeInfo(pipe);
+        checkRawReadAllowed(pipeInfo);
+        int bytesRead = readPipe(pipeInfo, buffer, bufLen, timeoutMsecs);
+        return bytesRead == READ_FAILED ? -XPNP_getErrorCode() : bytesRead;
+    } catch (std::exception& e) {
+        return -recordError(e);
+    }
+}
+
+int XPNP_readBytes(XPNP_PipeHandle pipe, char* buffer, int bytesToRead, int timeoutMsecs) {
+    try {
+        if (bytesToRead <= 0) {
+            throw std::invalid_argument("bytesToRead <= 0");
+        }
+        PipeRef pipeInfo(pipe);
+        checkRawReadAllowed(pipeInfo);
+        return readBytes(pipeInfo, buffer, bytesToRead, timeoutMsecs) ? 1 : -XPNP_getErrorCode();
+    } catch (std::exception& e) {
+        return -recordError(e);
+    }
+}
+
+XPNP_PipeHandle XPNP_openPipe(const char* pipeName, int privatePipe) {
+    return XPNP_openPipeEx(pipeName, privatePipe, 0);
+}
+
+XPNP_PipeHandle XPNP_openPipeEx(const char* pipeName, int privatePipe, int options) {
+    __int64 startTicks = startLatency();
+    XPNP_PipeHandle newPipe = NULL;
+    HANDLE newPipeHandle = INVALID_HANDLE_VALUE;
+    try {
+        ScopedFileHandle listeningPipeHandle;
+
+        int tries = 0; 
+        DWORD createError = 0;
+
+        const int MAX_TRIES = 15;
+        std::wstring pipeNameUtf16 = toUtf16(pipeName);
+        do {
+            listeningPipeHandle = CreateFile(pipeNameUtf16.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+            tries++;
+            if (listeningPipeHandle == INVALID_HANDLE_VALUE && tries < MAX_TRIES) {
+                createError = GetLastError();
+                if (createError == ERROR_PIPE_BUSY) {
+                    Sleep(100);
+                }
+            }
+        } while (listeningPipeHandle == INVALID_HANDLE_VALUE && tries < MAX_TRIES && createError == ERROR_PIPE_BUSY);
+
+        listeningPipeHandle.check("CreateFile");
+
+        std::string newPipeName = makePipeName(createUuid(), false);
+
+        newPipeHandle = createPipe(newPipeName, privatePipe != 0);
+
+        std::string connectRequest = newPipeName;
+        connectRequest.push_back('\0');
+        connectRequest.append(makeHello(options));
+        std::vector<char> frame;
+        writeMessage(listeningPipeHandle, connectRequest.data(), (int)connectRequest.length(), frame);
+
+        Hello agreed;
+        {
+            // Closed as soon as the reply is read, since the server waits for that before it returns the connection.
+            PipeInfo listeningPipe(pipeName, privatePipe != 0, listeningPipeHandle.release());
+            agreed = agreeHello(readHelloReply(&listeningPipe), options);
+        }
+
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+
+        ScopedHandle evt = overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        evt.check("CreateEvent");
+
+        BOOL connectResult = ConnectNamedPipe(newPipeHandle, &overlapped);
+        if (!connectResult && GetLastError() == ERROR_IO_PENDING) {
+            DWORD unused = 0;
+            DWORD waitResult = WaitForSingleObject(overlapped.hEvent, HANDSHAKE_TIMEOUT_MSECS);
+            if (waitResult == WAIT_FAILED || waitResult == WAIT_TIMEOUT) {
+                std::string errorMsg = getWindowsErrorMessage("WaitForSingleObject");
+                CancelIo(newPipeHandle);
+                GetOverlappedResult(newPipeHandle, &overlapped, &unused, TRUE);
+                if (waitResult == WAIT_FAILED) {
+                    throw std::runtime_error(errorMsg);
+                } else {
+                    throw ErrorInfo("Timed out waiting for server to connect", XPNP_ERROR_TIMEOUT);
+                }
+            }
+            connectResult = GetOverlappedResult(newPipeHandle, &overlapped, &unused, TRUE);
+        }
+        if (!connectResult && GetLastError() != ERROR_PIPE_CONNECTED) {
+            throwWindowsError("ConnectNamedPipe");
+        }
+
+        PipeInfo* pipeInfo = new PipeInfo(newPipeName, privatePipe != 0, newPipeHandle, agreed);
+        newPipeHandle = INVALID_HANDLE_VALUE;
+        newPipe = addPipe(pipeInfo);
+        if (agreed.options & XPNP_OPTION_HEARTBEAT) {
+            try {
+                GBL_heartbeatMonitor.add(pipeInfo);
+            } catch (...) {
+                GBL_pipes.close(newPipe);
+                newPipe = NULL;
+                throw;
+            }
+        }
+        recordLatency(startTicks, XPNP_LATENCY_CONNECT, &pipeInfo->getStats());
+    } catch (std::exception& e) {
+        recordError(e);
+        if (newPipeHandle != INVALID_HANDLE_VALUE) {
+            CloseHandle(newPipeHandle);
+        }
+    }
+    return newPipe;
+}
+
+int XPNP_writePipe(XPNP_PipeHandle pipe, const char* data, int bytesToWrite) {
+    return XPNP_writePipeEx(pipe, data, bytesToWrite, -1);
+}
+
+int XPNP_writePipeEx(XPNP_PipeHandle pipe, const char* data, int bytesToWrite, int timeoutMsecs) {
+    try {
+        if (bytesToWrite <= 0) {
+            throw std::invalid_argument("bytesToWrite <= 0");
+        }
+        PipeRef pipeInfo(pipe);
+        if (!writeBytes(pipeInfo->getPipeHandle(), data, bytesToWrite, timeoutMsecs, &pipeInfo->getStats())) {
+            return -XPNP_getErrorCode();
+        }
+        pipeInfo->noteDataSent();
+        return 1;
+    } catch (std::exception& e) {
+        return -recordError(e);
+    }
+}
+
+int XPNP_readMessage(XPNP_PipeHandle pipe, char* buffer, int bufLen, int* msgLen, int timeoutMsecs) {
+    try {
+        if (bufLen < 0) {
+            throw std::invalid_argument("bufLen < 0");
+        }
+        if (msgLen == NULL) {
+            throw std::invalid_argument("msgLen is null");
+        }
+        PipeRef pipeInfo(pipe);
+        return receiveMessage(pipeInfo, buffer, bufLen, *msgLen, timeoutMsecs) ? 1 : -XPNP_getErrorCode();
+    } catch (std::exception& e) {
+        return -recordError(e);
+    }
+}
+
+int XPNP_writeMessage(XPNP_PipeHandle pipe, const char* msg, int msgLen) {
+    return XPNP_writeMessageEx(pipe, msg, msgLen, -1);
+}
+
+int XPNP_writeMessageEx(XPNP_PipeHandle pipe, const char* msg, int msgLen, int timeoutMsecs) {
+    try {
+        if (msgLen < 0) {
+            throw std::invalid_argument("msgLen < 0");
+        }
+        PipeRef pipeInfo(pipe);
+        return sendMessage(pipeInfo, msg, msgLen, timeoutMsecs) ? 1 : -XPNP_getErrorCode();
+    } catch (std::exception& e) {
+        return -recordError(e);
+    }
+}
+
+int XPNP_configureHeartbeat(int intervalMsecs, int maxMissed) {
+    try {
+        if (intervalMsecs <= 0) {
+            throw std::invalid_argument("intervalMsecs <= 0");
+        }
+        if (maxMissed <= 0) {
+            throw std::invalid_argument("maxMissed <= 0");
+        }
+        GBL_heartbeatMonitor.configure(intervalMsecs, maxMissed);
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_getConnectionInfo(XPNP_PipeHandle pipe, int* protocolVersion, int* options, int* peerBufferSize) {
+    try {
+        if (protocolVersion == NULL || options == NULL || peerBufferSize == NULL) {
+            throw std::invalid_argument("protocolVersion, options or peerBufferSize is null");
+        }
+        PipeRef pipeInfo(pipe);
+        *protocolVersion = pipeInfo->getProtocolVersion();
+        *options = pipeInfo->getOptions();
+        *peerBufferSize = pipeInfo->getPeerBufferSize();
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_getPipeStats(XPNP_PipeHandle pipe, XPNP_PipeStats* pipeStats) {
+    try {
+        if (pipeStats == NULL) {
+            throw std::invalid_argument("pipeStats is null");
+        }
+        PipeRef pipeInfo(pipe);
+        pipeInfo->getStats().copyTo(*pipeStats);
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_setLatencyHistograms(int enabled) {
+    InterlockedExchange(&GBL_latencyEnabled, enabled != 0 ? 1 : 0);
+    return 1;
+}
+
+int XPNP_getLatencyPercentiles(XPNP_PipeHandle pipe, int operation, const double* percentiles, int count,
+        long long* valuesMicros, long long* sampleCount, int reset) {
+    try {
+        if (operation < 0 || operation >= stats::LatencyHistograms::OPERATION_COUNT) {
+            throw std::invalid_argument("Unknown latency operation");
+        }
+        if (count < 0) {
+            throw std::invalid_argument("count < 0");
+        }
+        if (sampleCount == NULL || (count > 0 && (percentiles == NULL || valuesMicros == NULL))) {
+            throw std::invalid_argument("percentiles, valuesMicros or sampleCount is null");
+        }
+        for (int i = 0; i < count; i++) {
+            if (!(percentiles[i] >= 0 && percentiles[i] <= 100)) {
+                throw std::invalid_argument("Percentile not between 0 and 100");
+            }
+        }
+
+        std::vector<__int64> snapshot;
+        if (pipe == NULL) {
+            GBL_latencies.get(operation).takeSnapshot(snapshot, reset != 0);
+        } else {
+            PipeRef pipeInfo(pipe);
+            pipeInfo->getStats().takeLatencySnapshot(operation, snapshot, reset != 0);
+        }
+        __int64 totalCount = 0;
+        for (size_t i = 0; i < snapshot.size(); i++) {
+            totalCount += snapshot[i];
+        }
+        for (int i = 0; i < count; i++) {
+            valuesMicros[i] = stats::Histogram::getPercentile(snapshot, totalCount, percentiles[i]);
+        }
+        *sampleCount = totalCount;
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_getWriteCredit(XPNP_PipeHandle pipe, int* credit) {
+    try {
+        if (credit == NULL) {
+            throw std::invalid_argument("credit is null");
+        }
+        PipeRef pipeInfo(pipe);
+        if (pipeInfo->getOptions() & XPNP_OPTION_FLOW_CONTROL) {
+            boost::mutex::scoped_lock lock(pipeInfo->getFlowMutex());
+            *credit = pipeInfo->getWriteCredit();
+        } else {
+            *credit = -1;
+        }
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
@@ -0,0 +1,307 @@
+#include "stdafx.h"
+
+#include "XpNamedPipe.h"
+#include "util.hpp"
+#include "internal.hpp"
+using namespace util;
+
+// Publishes each message to many connections.  A message is framed once into a shared buffer, and each
+// subscriber's queue holds a reference to it.  One I/O thread starts the writes with WriteFileEx and
+// collects their completions in alertable waits, so a subscriber that stops reading only fills its own queue.
+
+// Type definitions
+
+typedef boost::shared_ptr<std::vector<char> > Frame;
+
+class Broadcast;
+
+struct Subscriber {
+    Subscriber(Broadcast* owner, XPNP_PipeHandle pipe) : owner(owner), pipe(pipe), pipeHandle(getNativePipeHandle(pipe)),
+            writing(false), cancelled(false), removed(false), failed(false) {
+        memset(&overlapped, 0, sizeof(overlapped));
+    }
+
+    Broadcast* owner;
+    XPNP_PipeHandle pipe;
+    HANDLE pipeHandle;
+    std::deque<Frame> queue;
+    OVERLAPPED overlapped;
+    bool writing;
+    bool cancelled;
+    bool removed;
+    bool failed;
+};
+
+class Broadcast {
+public:
+    Broadcast(int maxQueuedMessages, int overflowPolicy) : maxQueuedMessages(maxQueuedMessages),
+            overflowPolicy(overflowPolicy), closing(false) {
+        wakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        wakeEvent.check("CreateEvent");
+        ioThread = boost::thread(&Broadcast::ioLoop, this);
+    }
+
+    ~Broadcast() {
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            closing = true;
+        }
+        SetEvent(wakeEvent);
+        ioThread.join();
+    }
+
+    void subscribe(XPNP_PipeHandle pipe) {
+        boost::mutex::scoped_lock lock(mutex);
+        if (subscribers.find(pipe) != subscribers.end()) {
+            throw std::invalid_argument("Pipe is already subscribed");
+        }
+        subscribers[pipe] = new Subscriber(this, pipe);
+    }
+
+    // Waits until the I/O thread no longer uses the pipe, so that the caller can close it.
+    void unsubscribe(XPNP_PipeHandle pipe) {
+        boost::mutex::scoped_lock lock(mutex);
+        std::map<XPNP_PipeHandle, Subscriber*>::iterator it = subscribers.find(pipe);
+        if (it == subscribers.end()) {
+            throw std::invalid_argument("Pipe is not subscribed");
+        }
+        it->second->removed = true;
+        SetEvent(wakeEvent);
+        while (subscribers.find(pipe) != subscribers.end()) {
+            released.wait(lock);
+        }
+    }
+
+    void publish(const char* msg, int msgLen) {
+        Frame frame = boost::make_shared<std::vector<char> >(sizeof(int) + msgLen);
+        int msgLenNetwork = htonl(msgLen);
+        memcpy(&(*frame)[0], &msgLenNetwork, sizeof(msgLenNetwork));
+        if (msgLen > 0) {
+            memcpy(&(*frame)[sizeof(int)], msg, msgLen);
+        }
+
+        boost::mutex::scoped_lock lock(mutex);
+        for (std::map<XPNP_PipeHandle, Subscriber*>::iterator it = subscribers.begin(); it != subscribers.end(); ++it) {
+            Subscriber* subscriber = it->second;
+            if (subscriber->removed || subscriber->failed) {
+                continue;
+            }
+            if ((int)subscriber->queue.size() >= maxQueuedMessages) {
+                if (overflowPolicy == XPNP_BROADCAST_DISCONNECT) {
+                    subscriber->failed = true;
+                    continue;
+                }
+                // The frame at the front may be in the middle of being written.  If it is the only one queued,
+                // it is the new frame that is dropped.
+                size_t oldestUnsent = subscriber->writing ? 1 : 0;
+                if (oldestUnsent == subscriber->queue.size()) {
+                    continue;
+                }
+                subscriber->queue.erase(subscriber->queue.begin() + oldestUnsent);
+            }
+            subscriber->queue.push_back(frame);
+        }
+        SetEvent(wakeEvent);
+    }
+
+    XPNP_PipeHandle takeFailed() {
+        boost::mutex::scoped_lock lock(mutex);
+        if (failedPipes.empty()) {
+            return NULL;
+        }
+        XPNP_PipeHandle pipe = failedPipes.front();
+        failedPipes.pop_front();
+        return pipe;
+    }
+
+private:
+    static VOID CALLBACK writeCompleted(DWORD errorCode, DWORD bytesWritten, LPOVERLAPPED overlapped) {
+        Subscriber* subscriber = (Subscriber*)overlapped->hEvent;
+        boost::mutex::scoped_lock lock(subscriber->owner->mutex);
+        subscriber->writing = false;
+        if (errorCode != ERROR_SUCCESS || bytesWritten != subscriber->queue.front()->size()) {
+            subscriber->failed = true;
+        }
+        subscriber->queue.pop_front();
+    }
+
+    // Called on the I/O thread with the mutex held.
+    void startWrite(Subscriber* subscriber) {
+        const std::vector<char>& frame = *subscriber->queue.front();
+        memset(&subscriber->overlapped, 0, sizeof(subscriber->overlapped));
+        // WriteFileEx does not use hEvent, so it carries the subscriber to the completion routine.
+        subscriber->overlapped.hEvent = (HANDLE)subscriber;
+        if (WriteFileEx(subscriber->pipeHandle, &frame[0], (DWORD)frame.size(), &subscriber->overlapped, writeCompleted)) {
+            subscriber->writing = true;
+        } else {
+            subscriber->failed = true;
+        }
+    }
+
+    // Called on the I/O thread with the mutex held.
+    void serviceSubscribers() {
+        std::map<XPNP_PipeHandle, Subscriber*>::iterator it = subscribers.begin();
+        while (it != subscribers.end()) {
+            Subscriber* subscriber = it->second;
+            if (subscriber->removed || subscriber->failed) {
+                if (subscriber->writing) {
+                    // Only the thread that issued the write can cancel it.
+                    if (!subscriber->cancelled) {
+                        CancelIo(subscriber->pipeHandle);
+                        subscriber->cancelled = true;
+                    }
+                    ++it;
+                    continue;
+                }
+                if (!subscriber->removed) {
+                    failedPipes.push_back(subscriber->pipe);
+                }
+                delete subscriber;
+                subscribers.erase(it++);
+                released.notify_all();
+                continue;
+            }
+            if (!subscriber->writing && !subscriber->queue.empty()) {
+                startWrite(subscriber);
+            }
+            ++it;
+        }
+    }
+
+    void ioLoop() {
+        while (true) {
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                if (closing) {
+                    break;
+                }
+                serviceSubscribers();
+            }
+            // Completion routines run during this alertable wait.
+            WaitForSingleObjectEx(wakeEvent, INFINITE, TRUE);
+        }
+
+        bool writing = false;
+        do {
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                writing = false;
+                for (std::map<XPNP_PipeHandle, Subscriber*>::iterator it = subscribers.begin(); it != subscribers.end(); ++it) {
+                    Subscriber* subscriber = it->second;
+                    if (subscriber->writing) {
+                        if (!subscriber->cancelled) {
+                            CancelIo(subscriber->pipeHandle);
+                            subscriber->cancelled = true;
+                        }
+                        writing = true;
+                    }
+                }
+            }
+            if (writing) {
+                SleepEx(INFINITE, TRUE);
+            }
+        } while (writing);
+
+        boost::mutex::scoped_lock lock(mutex);
+        for (std::map<XPNP_PipeHandle, Subscriber*>::iterator it = subscribers.begin(); it != subscribers.end(); ++it) {
+            delete it->second;
+        }
+        subscribers.clear();
+        released.notify_all();
+    }
+
+    int maxQueuedMessages;
+    int overflowPolicy;
+
+    boost::mutex mutex;
+    boost::condition_variable released;
+    ScopedHandle wakeEvent;
+
+    std::map<XPNP_PipeHandle, Subscriber*> subscribers;
+    std::deque<XPNP_PipeHandle> failedPipes;
+    bool closing;
+
+    boost::thread ioThread;
+};
+
+// Local function definitions
+
+static Broadcast* getBroadcast(XPNP_BroadcastHandle handle) {
+    if (handle == 0) {
+        throw std::invalid_argument("Broadcast handle is null");
+    }
+    return (Broadcast*)handle;
+}
+
+// Exported function definitions
+
+XPNP_BroadcastHandle XPNP_createBroadcast(int maxQueuedMessages, int overflowPolicy) {
+    try {
+        if (maxQueuedMessages <= 0) {
+            throw std::invalid_argument("maxQueuedMessages <= 0");
+        }
+        if (overflowPolicy != XPNP_BROADCAST_DROP_OLDEST && overflowPolicy != XPNP_BROADCAST_DISCONNECT) {
+            throw std::invalid_argument("Unknown overflow policy");
+        }
+        return (XPNP_BroadcastHandle)new Broadcast(maxQueuedMessages, overflowPolicy);
+    } catch (std::exception& e) {
+        recordError(e);
+        return NULL;
+    }
+}
+
+int XPNP_closeBroadcast(XPNP_BroadcastHandle broadcast) {
+    try {
+        delete getBroadcast(broadcast);
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_broadcastSubscribe(XPNP_BroadcastHandle broadcast, XPNP_PipeHandle pipe) {
+    try {
+        getBroadcast(broadcast)->subscribe(pipe);
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_broadcastUnsubscribe(XPNP_BroadcastHandle broadcast, XPNP_PipeHandle pipe) {
+    try {
+        getBroadcast(broadcast)->unsubscribe(pipe);
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_broadcastPublish(XPNP_BroadcastHandle broadcast, const char* msg, int msgLen) {
+    try {
+        if (msgLen < 0) {
+            throw std::invalid_argument("msgLen < 0");
+        }
+        getBroadcast(broadcast)->publish(msg, msgLen);
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_broadcastTakeFailed(XPNP_BroadcastHandle broadcast, XPNP_PipeHandle* pipe) {
+    try {
+        if (pipe == NULL) {
+            throw std::invalid_argument("pipe is null");
+        }
+        *pipe = getBroadcast(broadcast)->takeFailed();
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
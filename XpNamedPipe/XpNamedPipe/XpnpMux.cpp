@@ -0,0 +1,362 @@
+#include "stdafx.h"
+
+#include "XpNamedPipe.h"
+#include "util.hpp"
+#include "internal.hpp"
+using namespace util;
+
+// Carries many logical streams over one connection.  Each frame is a framed message whose body starts
+// with the stream id (network order).  One reader thread sorts incoming frames into per-stream queues;
+// one writer thread sends queued frames, taking one frame from each stream with pending data in turn so
+// that a busy stream cannot starve the others.
+//
+// Closing is done in-band so that the pipe is left at a message boundary: each end sends one close frame
+// (a frame on CLOSE_STREAM_ID) after its last data frame, either when it is closed or in answer to the
+// peer's, and its reader stops once it has read the peer's.  Neither end then has anything left unread.
+
+const int STREAM_ID_SIZE = sizeof(unsigned int);
+
+const unsigned int CLOSE_STREAM_ID = 0xFFFFFFFF;
+
+// Maximum frames queued on a stream, in either direction, before XPNP_muxWrite or the reader blocks.
+const size_t MAX_QUEUED_FRAMES = 64;
+
+// Maximum streams with frames queued at once; beyond it, frames for other streams wait for one to drain.
+const size_t MAX_ACTIVE_STREAMS = 1024;
+
+// How long XPNP_closeMux waits for the peer's close frame.
+const int CLOSE_TIMEOUT_MSECS = 5000;
+
+const int INITIAL_READ_BUF_SIZE = 4 * 1024;
+
+// Type definitions
+
+class Mux {
+public:
+    Mux(XPNP_PipeHandle pipe) : pipe(pipe), closing(false), peerClosed(false), readFailed(false), readErrorCode(0),
+            writeFailed(false), writeErrorCode(0) {
+        readerThread = boost::thread(&Mux::readLoop, this);
+        writerThread = boost::thread(&Mux::writeLoop, this);
+    }
+
+    // Returns false if the peer did not answer the close frame in time, in which case the reader is stopped
+    // wherever it is and the pipe's data is left out of step.
+    bool close() {
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            closing = true;
+            sendable.notify_all();
+            sendSpace.notify_all();
+            received.notify_all();
+            receiveSpace.notify_all();
+        }
+        // The writer flushes what is already queued, then sends the close frame, before exiting.
+        writerThread.join();
+        // The peer will not answer a close frame that was not sent, though it may have sent its own already.
+        int waitMsecs = writeFailed ? 0 : CLOSE_TIMEOUT_MSECS;
+        if (readerThread.timed_join(boost::posix_time::milliseconds(waitMsecs))) {
+            return true;
+        }
+        XPNP_stopPipe(pipe);
+        readerThread.join();
+        // A connection that failed has already reported it.
+        return writeFailed;
+    }
+
+    void write(unsigned int streamId, const char* msg, int msgLen) {
+        std::vector<char> frame(STREAM_ID_SIZE + msgLen);
+        unsigned int streamIdNetwork = htonl(streamId);
+        memcpy(&frame[0], &streamIdNetwork, STREAM_ID_SIZE);
+        if (msgLen > 0) {
+            memcpy(&frame[STREAM_ID_SIZE], msg, msgLen);
+        }
+
+        boost::mutex::scoped_lock lock(mutex);
+        // The stream is looked up again after each wait, since the writer drops it once it is drained.
+        while (!hasSpace(streamId, false) && !writeFailed && !closing && !peerClosed) {
+            sendSpace.wait(lock);
+        }
+        if (writeFailed) {
+            throw ErrorInfo("Multiplexed connection failed: " + writeError, writeErrorCode);
+        }
+        if (closing) {
+            throw ErrorInfo("Multiplexed connection closed", XPNP_ERROR_INTERRUPTED);
+        }
+        if (peerClosed) {
+            throw ErrorInfo("Peer closed the multiplexed connection", XPNP_ERROR_PIPE_CLOSED);
+        }
+        Stream& stream = streams[streamId];
+        stream.outgoing.push_back(std::vector<char>());
+        stream.outgoing.back().swap(frame);
+        if (stream.outgoing.size() == 1) {
+            readyStreams.push_back(streamId);
+            sendable.notify_one();
+        }
+    }
+
+    // Returns false, with the error recorded, if it times out or if the message does not fit in buffer (leaving it
+    // queued and msgLen set to its size).
+    bool read(unsigned int streamId, char* buffer, int bufLen, int& msgLen, int timeoutMsecs) {
+        boost::mutex::scoped_lock lock(mutex);
+        boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeoutMsecs);
+        std::map<unsigned int, Stream>::iterator it;
+        while ((it = streams.find(streamId)) == streams.end() || it->second.incoming.empty()) {
+            if (readFailed) {
+                throw ErrorInfo("Multiplexed connection failed: " + readError, readErrorCode);
+            }
+            if (closing) {
+                throw ErrorInfo("Multiplexed connection closed", XPNP_ERROR_INTERRUPTED);
+            }
+            if (peerClosed) {
+                throw ErrorInfo("Peer closed the multiplexed connection", XPNP_ERROR_PIPE_CLOSED);
+            }
+            if (timeoutMsecs < 0) {
+                received.wait(lock);
+            } else if (!received.timed_wait(lock, deadline)) {
+                it = streams.find(streamId);
+                if (it == streams.end() || it->second.incoming.empty()) {
+                    setError(XPNP_ERROR_TIMEOUT, "Timed out while reading message");
+                    return false;
+                }
+            }
+        }
+
+        std::vector<char>& frame = it->second.incoming.front();
+        msgLen = (int)frame.size() - STREAM_ID_SIZE;
+        if (msgLen > bufLen) {
+            setError(XPNP_ERROR_BUFFER_TOO_SMALL, "Buffer too small for message");
+            return false;
+        }
+        if (msgLen > 0) {
+            memcpy(buffer, &frame[STREAM_ID_SIZE], msgLen);
+        }
+        it->second.incoming.pop_front();
+        dropIfIdle(it);
+        receiveSpace.notify_all();
+        return true;
+    }
+
+private:
+    struct Stream {
+        std::deque<std::vector<char> > incoming;
+        std::deque<std::vector<char> > outgoing;
+    };
+
+    // Whether one more frame may be queued on the stream in the given direction.
+    bool hasSpace(unsigned int streamId, bool incoming) {
+        std::map<unsigned int, Stream>::iterator it = streams.find(streamId);
+        if (it == streams.end()) {
+            return streams.size() < MAX_ACTIVE_STREAMS;
+        }
+        return (incoming ? it->second.incoming : it->second.outgoing).size() < MAX_QUEUED_FRAMES;
+    }
+
+    // Streams are kept only while they have frames queued, so that ids used once do not accumulate.
+    void dropIfIdle(std::map<unsigned int, Stream>::iterator it) {
+        if (it->second.incoming.empty() && it->second.outgoing.empty()) {
+            streams.erase(it);
+            sendSpace.notify_all();
+            receiveSpace.notify_all();
+        }
+    }
+
+    void readLoop() {
+        std::vector<char> buffer(INITIAL_READ_BUF_SIZE);
+        while (true) {
+            int msgLen = 0;
+            int result = XPNP_readMessage(pipe, &buffer[0], (int)buffer.size(), &msgLen, -1);
+            if (result == -XPNP_ERROR_BUFFER_TOO_SMALL) {
+                buffer.resize(msgLen);
+                result = XPNP_readMessage(pipe, &buffer[0], (int)buffer.size(), &msgLen, -1);
+            }
+
+            boost::mutex::scoped_lock lock(mutex);
+            if (result < 0 || msgLen < STREAM_ID_SIZE) {
+                char errorMsg[1024] = "Frame too short";
+                readErrorCode = XPNP_ERROR_PROTOCOL;
+                if (result < 0) {
+                    XPNP_getErrorMessage(errorMsg, sizeof(errorMsg));
+                    readErrorCode = -result;
+                }
+                readError = errorMsg;
+                readFailed = true;
+                received.notify_all();
+                return;
+            }
+
+            unsigned int streamIdNetwork = 0;
+            memcpy(&streamIdNetwork, &buffer[0], STREAM_ID_SIZE);
+            unsigned int streamId = ntohl(streamIdNetwork);
+            if (streamId == CLOSE_STREAM_ID) {
+                // Nothing more will arrive; the writer answers with this end's close frame once it has flushed.
+                peerClosed = true;
+                received.notify_all();
+                sendable.notify_all();
+                sendSpace.notify_all();
+                return;
+            }
+            // Frames that arrive once the mux is closing have no one to read them.
+            while (!hasSpace(streamId, true) && !closing) {
+                receiveSpace.wait(lock);
+            }
+            if (!closing) {
+                streams[streamId].incoming.push_back(std::vector<char>(buffer.begin(), buffer.begin() + msgLen));
+                received.notify_all();
+            }
+        }
+    }
+
+    void writeLoop() {
+        while (true) {
+            std::vector<char> frame;
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                while (readyStreams.empty() && !closing && !peerClosed) {
+                    sendable.wait(lock);
+                }
+                if (readyStreams.empty()) {
+                    break;
+                }
+                unsigned int streamId = readyStreams.front();
+                readyStreams.pop_front();
+
+                std::map<unsigned int, Stream>::iterator it = streams.find(streamId);
+                frame.swap(it->second.outgoing.front());
+                it->second.outgoing.pop_front();
+                if (!it->second.outgoing.empty()) {
+                    readyStreams.push_back(streamId);
+                } else {
+                    dropIfIdle(it);
+                }
+                sendSpace.notify_all();
+            }
+
+            if (!send(frame)) {
+                return;
+            }
+        }
+
+        std::vector<char> closeFrame(STREAM_ID_SIZE);
+        unsigned int streamIdNetwork = htonl(CLOSE_STREAM_ID);
+        memcpy(&closeFrame[0], &streamIdNetwork, STREAM_ID_SIZE);
+        send(closeFrame);
+    }
+
+    // Returns false, with the failure recorded and queued frames discarded, if the write fails.
+    bool send(std::vector<char>& frame) {
+        int result = XPNP_writeMessage(pipe, &frame[0], (int)frame.size());
+        if (result >= 0) {
+            return true;
+        }
+        char errorMsg[1024] = "";
+        XPNP_getErrorMessage(errorMsg, sizeof(errorMsg));
+
+        boost::mutex::scoped_lock lock(mutex);
+        writeError = errorMsg;
+        writeErrorCode = -result;
+        writeFailed = true;
+        std::map<unsigned int, Stream>::iterator it = streams.begin();
+        while (it != streams.end()) {
+            it->second.outgoing.clear();
+            dropIfIdle(it++);
+        }
+        readyStreams.clear();
+        sendSpace.notify_all();
+        return false;
+    }
+
+    XPNP_PipeHandle pipe;
+
+    boost::mutex mutex;
+    boost::condition_variable received;
+    boost::condition_variable receiveSpace;
+    boost::condition_variable sendable;
+    boost::condition_variable sendSpace;
+
+    std::map<unsigned int, Stream> streams;
+    std::deque<unsigned int> readyStreams;
+
+    bool closing;
+    bool peerClosed;
+    bool readFailed;
+    std::string readError;
+    int readErrorCode;
+    bool writeFailed;
+    std::string writeError;
+    int writeErrorCode;
+
+    boost::thread readerThread;
+    boost::thread writerThread;
+};
+
+// Local function definitions
+
+static Mux* getMux(XPNP_MuxHandle handle) {
+    if (handle == 0) {
+        throw std::invalid_argument("Mux handle is null");
+    }
+    return (Mux*)handle;
+}
+
+static void checkStreamId(unsigned int streamId) {
+    if (streamId == CLOSE_STREAM_ID) {
+        throw std::invalid_argument("Stream id 0xFFFFFFFF is reserved");
+    }
+}
+
+// Exported function definitions
+
+XPNP_MuxHandle XPNP_createMux(XPNP_PipeHandle pipe) {
+    try {
+        if (pipe == 0) {
+            throw std::invalid_argument("Pipe handle is null");
+        }
+        return (XPNP_MuxHandle)new Mux(pipe);
+    } catch (std::exception& e) {
+        recordError(e);
+        return NULL;
+    }
+}
+
+int XPNP_closeMux(XPNP_MuxHandle mux) {
+    try {
+        Mux* muxObj = getMux(mux);
+        bool clean = muxObj->close();
+        delete muxObj;
+        if (!clean) {
+            throw ErrorInfo("Timed out waiting for peer to close multiplexed connection", XPNP_ERROR_TIMEOUT);
+        }
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_muxWrite(XPNP_MuxHandle mux, unsigned int streamId, const char* msg, int msgLen) {
+    try {
+        if (msgLen < 0) {
+            throw std::invalid_argument("msgLen < 0");
+        }
+        checkStreamId(streamId);
+        getMux(mux)->write(streamId, msg, msgLen);
+        return 1;
+    } catch (std::exception& e) {
+        return -recordError(e);
+    }
+}
+
+int XPNP_muxRead(XPNP_MuxHandle mux, unsigned int streamId, char* buffer, int bufLen, int* msgLen, int timeoutMsecs) {
+    try {
+        if (bufLen < 0) {
+            throw std::invalid_argument("bufLen < 0");
+        }
+        if (msgLen == NULL) {
+            throw std::invalid_argument("msgLen is null");
+        }
+        checkStreamId(streamId);
+        return getMux(mux)->read(streamId, buffer, bufLen, *msgLen, timeoutMsecs) ? 1 : -XPNP_getErrorCode();
+    } catch (std::exception& e) {
+        return -recordError(e);
+    }
+}
@@ -0,0 +1,387 @@
+#include "stdafx.h"
+
+#include "XpNamedPipe.h"
+#include "util.hpp"
+#include "internal.hpp"
+using namespace util;
+
+// Request/response calls over one connection.  Each frame is a framed message whose body starts with a
+// frame type byte and a call id (network order).  Callers write their request and wait on their own
+// condition variable; one reader thread hands responses to the waiting call with the matching id and
+// queues requests for XPNP_rpcReadRequest.  Any number of calls may be outstanding, and responses may
+// arrive in any order.
+//
+// As with the mux, closing is done in-band so that the pipe is left at a message boundary: each end sends one
+// close frame after its last frame, either when it is closed or in answer to the peer's, and its reader stops
+// once it has read the peer's.
+
+const char FRAME_REQUEST = 1;
+const char FRAME_RESPONSE = 2;
+const char FRAME_CLOSE = 3;
+const int FRAME_HEADER_SIZE = 1 + sizeof(unsigned int);
+
+// How long XPNP_closeRpc waits to send its close frame and for the peer's.
+const int CLOSE_TIMEOUT_MSECS = 5000;
+
+// Maximum requests queued for XPNP_rpcReadRequest before the reader stops reading, and so stops delivering
+// responses too, until the server catches up.
+const size_t MAX_QUEUED_REQUESTS = 64;
+
+const int INITIAL_READ_BUF_SIZE = 4 * 1024;
+
+// Type definitions
+
+class Rpc {
+public:
+    Rpc(XPNP_PipeHandle pipe) : pipe(pipe), nextCallId(1), closing(false), closeSent(false), closeDelivered(false),
+            peerClosed(false), readFailed(false), readErrorCode(0) {
+        readerThread = boost::thread(&Rpc::readLoop, this);
+    }
+
+    // Returns false if the close frames could not be exchanged in time, in which case the reader is stopped
+    // wherever it is and the pipe's data is left out of step.
+    bool close() {
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            closing = true;
+            requestReceived.notify_all();
+            requestSpace.notify_all();
+        }
+        // The peer will not answer a close frame that was not sent, though it may have sent its own already.
+        int waitMsecs = sendClose(CLOSE_TIMEOUT_MSECS) ? CLOSE_TIMEOUT_MSECS : 0;
+        if (readerThread.timed_join(boost::posix_time::milliseconds(waitMsecs))) {
+            return true;
+        }
+        XPNP_stopPipe(pipe);
+        readerThread.join();
+        return false;
+    }
+
+    // Returns false, with the error recorded, if it times out or if the response did not fit in the buffer (with
+    // responseLen set to the response size; the response is discarded).
+    bool call(const char* request, int requestLen, char* response, int responseBufLen, int& responseLen,
+            int timeoutMsecs) {
+        boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeoutMsecs);
+        PendingCall pendingCall;
+        unsigned int callId = 0;
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            checkReadState();
+            callId = nextCallId++;
+            pendingCalls[callId] = &pendingCall;
+        }
+
+        bool sent = false;
+        try {
+            sent = sendFrame(FRAME_REQUEST, callId, request, requestLen, getRemainingMsecs(deadline, timeoutMsecs));
+        } catch (...) {
+            boost::mutex::scoped_lock lock(mutex);
+            pendingCalls.erase(callId);
+            throw;
+        }
+        if (!sent) {
+            boost::mutex::scoped_lock lock(mutex);
+            pendingCalls.erase(callId);
+            return false;
+        }
+
+        boost::mutex::scoped_lock lock(mutex);
+        while (!pendingCall.done && !readFailed && !closing && !peerClosed) {
+            if (timeoutMsecs < 0) {
+                pendingCall.completed.wait(lock);
+            } else if (!pendingCall.completed.timed_wait(lock, deadline)) {
+                break;
+            }
+        }
+        if (!pendingCall.done) {
+            // A response arriving after this is dropped by the reader.
+            pendingCalls.erase(callId);
+            checkReadState();
+            setError(XPNP_ERROR_TIMEOUT, "Timed out waiting for response");
+            return false;
+        }
+
+        responseLen = (int)pendingCall.response.size();
+        if (responseLen > responseBufLen) {
+            setError(XPNP_ERROR_BUFFER_TOO_SMALL, "Buffer too small for response");
+            return false;
+        }
+        if (responseLen > 0) {
+            memcpy(response, &pendingCall.response[0], responseLen);
+        }
+        return true;
+    }
+
+    // Returns false, with the error recorded, if it times out or if the request does not fit in buffer (leaving it
+    // queued and requestLen set to its size).
+    bool readRequest(unsigned int& callId, char* buffer, int bufLen, int& requestLen, int timeoutMsecs) {
+        boost::mutex::scoped_lock lock(mutex);
+        boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeoutMsecs);
+        while (requests.empty()) {
+            checkReadState();
+            if (timeoutMsecs < 0) {
+                requestReceived.wait(lock);
+            } else if (!requestReceived.timed_wait(lock, deadline)) {
+                if (requests.empty()) {
+                    setError(XPNP_ERROR_TIMEOUT, "Timed out while reading request");
+                    return false;
+                }
+            }
+        }
+
+        std::vector<char>& frame = requests.front();
+        memcpy(&callId, &frame[1], sizeof(callId));
+        callId = ntohl(callId);
+        requestLen = (int)frame.size() - FRAME_HEADER_SIZE;
+        if (requestLen > bufLen) {
+            setError(XPNP_ERROR_BUFFER_TOO_SMALL, "Buffer too small for request");
+            return false;
+        }
+        if (requestLen > 0) {
+            memcpy(buffer, &frame[FRAME_HEADER_SIZE], requestLen);
+        }
+        requests.pop_front();
+        requestSpace.notify_one();
+        return true;
+    }
+
+    void sendResponse(unsigned int callId, const char* response, int responseLen) {
+        sendFrame(FRAME_RESPONSE, callId, response, responseLen, -1);
+    }
+
+private:
+    struct PendingCall {
+        PendingCall() : done(false) {
+        }
+
+        bool done;
+        std::vector<char> response;
+        boost::condition_variable completed;
+    };
+
+    // Called with the mutex held.
+    void checkReadState() {
+        if (readFailed) {
+            throw ErrorInfo("RPC connection failed: " + readError, readErrorCode);
+        }
+        if (closing) {
+            throw ErrorInfo("RPC connection closed", XPNP_ERROR_INTERRUPTED);
+        }
+        if (peerClosed) {
+            throw ErrorInfo("Peer closed the RPC connection", XPNP_ERROR_PIPE_CLOSED);
+        }
+    }
+
+    // Frames are sent with sendMutex held, so that none can follow this end's close frame.  Returns false, with the
+    // error recorded, if the write times out; other failures are thrown.
+    bool sendFrame(char frameType, unsigned int callId, const char* payload, int payloadLen, int timeoutMsecs) {
+        boost::mutex::scoped_lock sendLock(sendMutex);
+        if (closeSent) {
+            boost::mutex::scoped_lock lock(mutex);
+            checkReadState();
+            throw ErrorInfo("RPC connection closed", XPNP_ERROR_INTERRUPTED);
+        }
+        int result = writeFrame(frameType, callId, payload, payloadLen, timeoutMsecs);
+        if (result == -XPNP_ERROR_TIMEOUT) {
+            return false;
+        }
+        if (result < 0) {
+            char errorMsg[1024] = "";
+            XPNP_getErrorMessage(errorMsg, sizeof(errorMsg));
+            throw ErrorInfo(errorMsg, -result);
+        }
+        return true;
+    }
+
+    // Sends this end's close frame unless it has been already; returns whether it was sent successfully.
+    bool sendClose(int timeoutMsecs) {
+        boost::mutex::scoped_lock sendLock(sendMutex);
+        if (!closeSent) {
+            closeSent = true;
+            closeDelivered = writeFrame(FRAME_CLOSE, 0, NULL, 0, timeoutMsecs) >= 0;
+        }
+        return closeDelivered;
+    }
+
+    // Called with sendMutex held; returns the result of XPNP_writeMessageEx.
+    int writeFrame(char frameType, unsigned int callId, const char* payload, int payloadLen, int timeoutMsecs) {
+        std::vector<char> frame(FRAME_HEADER_SIZE + payloadLen);
+        unsigned int callIdNetwork = htonl(callId);
+        frame[0] = frameType;
+        memcpy(&frame[1], &callIdNetwork, sizeof(callIdNetwork));
+        if (payloadLen > 0) {
+            memcpy(&frame[FRAME_HEADER_SIZE], payload, payloadLen);
+        }
+        return XPNP_writeMessageEx(pipe, &frame[0], (int)frame.size(), timeoutMsecs);
+    }
+
+    // Called with the mutex held.
+    void wakeAll() {
+        for (std::map<unsigned int, PendingCall*>::iterator it = pendingCalls.begin(); it != pendingCalls.end(); ++it) {
+            it->second->completed.notify_one();
+        }
+        requestReceived.notify_all();
+    }
+
+    void readLoop() {
+        std::vector<char> buffer(INITIAL_READ_BUF_SIZE);
+        while (true) {
+            int msgLen = 0;
+            int result = XPNP_readMessage(pipe, &buffer[0], (int)buffer.size(), &msgLen, -1);
+            if (result == -XPNP_ERROR_BUFFER_TOO_SMALL) {
+                buffer.resize(msgLen);
+                result = XPNP_readMessage(pipe, &buffer[0], (int)buffer.size(), &msgLen, -1);
+            }
+
+            boost::mutex::scoped_lock lock(mutex);
+            if (result < 0 || msgLen < FRAME_HEADER_SIZE ||
+                    (buffer[0] != FRAME_REQUEST && buffer[0] != FRAME_RESPONSE && buffer[0] != FRAME_CLOSE)) {
+                char errorMsg[1024] = "Invalid RPC frame";
+                readErrorCode = XPNP_ERROR_PROTOCOL;
+                if (result < 0) {
+                    XPNP_getErrorMessage(errorMsg, sizeof(errorMsg));
+                    readErrorCode = -result;
+                }
+                readError = errorMsg;
+                readFailed = true;
+                wakeAll();
+                return;
+            }
+
+            if (buffer[0] == FRAME_CLOSE) {
+                // Nothing more will arrive; answer with this end's close frame unless it was already sent.
+                peerClosed = true;
+                wakeAll();
+                lock.unlock();
+                sendClose(CLOSE_TIMEOUT_MSECS);
+                return;
+            }
+            if (buffer[0] == FRAME_REQUEST) {
+                // Requests that arrive once the connection is closing have no one to read them.
+                while (requests.size() >= MAX_QUEUED_REQUESTS && !closing) {
+                    requestSpace.wait(lock);
+                }
+                if (!closing) {
+                    requests.push_back(std::vector<char>(buffer.begin(), buffer.begin() + msgLen));
+                    requestReceived.notify_one();
+                }
+            } else {
+                unsigned int callId = 0;
+                memcpy(&callId, &buffer[1], sizeof(callId));
+                std::map<unsigned int, PendingCall*>::iterator it = pendingCalls.find(ntohl(callId));
+                if (it != pendingCalls.end()) {
+                    PendingCall* pendingCall = it->second;
+                    pendingCall->response.assign(buffer.begin() + FRAME_HEADER_SIZE, buffer.begin() + msgLen);
+                    pendingCall->done = true;
+                    pendingCall->completed.notify_one();
+                    pendingCalls.erase(it);
+                }
+            }
+        }
+    }
+
+    XPNP_PipeHandle pipe;
+
+    boost::mutex mutex;
+    boost::condition_variable requestReceived;
+    boost::condition_variable requestSpace;
+    boost::mutex sendMutex;
+
+    unsigned int nextCallId;
+    std::map<unsigned int, PendingCall*> pendingCalls;
+    std::deque<std::vector<char> > requests;
+
+    bool closing;
+    bool closeSent;
+    bool closeDelivered;
+    bool peerClosed;
+    bool readFailed;
+    std::string readError;
+    int readErrorCode;
+
+    boost::thread readerThread;
+};
+
+// Local function definitions
+
+static Rpc* getRpc(XPNP_RpcHandle handle) {
+    if (handle == 0) {
+        throw std::invalid_argument("RPC handle is null");
+    }
+    return (Rpc*)handle;
+}
+
+// Exported function definitions
+
+XPNP_RpcHandle XPNP_createRpc(XPNP_PipeHandle pipe) {
+    try {
+        if (pipe == 0) {
+            throw std::invalid_argument("Pipe handle is null");
+        }
+        return (XPNP_RpcHandle)new Rpc(pipe);
+    } catch (std::exception& e) {
+        recordError(e);
+        return NULL;
+    }
+}
+
+int XPNP_closeRpc(XPNP_RpcHandle rpc) {
+    try {
+        Rpc* rpcObj = getRpc(rpc);
+        bool clean = rpcObj->close();
+        delete rpcObj;
+        if (!clean) {
+            throw ErrorInfo("Timed out waiting for peer to close RPC connection", XPNP_ERROR_TIMEOUT);
+        }
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_rpcCall(XPNP_RpcHandle rpc, const char* request, int requestLen, char* response, int responseBufLen,
+        int* responseLen, int timeoutMsecs) {
+    try {
+        if (requestLen < 0) {
+            throw std::invalid_argument("requestLen < 0");
+        }
+        if (responseBufLen < 0) {
+            throw std::invalid_argument("responseBufLen < 0");
+        }
+        if (responseLen == NULL) {
+            throw std::invalid_argument("responseLen is null");
+        }
+        bool called = getRpc(rpc)->call(request, requestLen, response, responseBufLen, *responseLen, timeoutMsecs);
+        return called ? 1 : -XPNP_getErrorCode();
+    } catch (std::exception& e) {
+        return -recordError(e);
+    }
+}
+
+int XPNP_rpcReadRequest(XPNP_RpcHandle rpc, unsigned int* callId, char* buffer, int bufLen, int* requestLen,
+        int timeoutMsecs) {
+    try {
+        if (bufLen < 0) {
+            throw std::invalid_argument("bufLen < 0");
+        }
+        if (callId == NULL || requestLen == NULL) {
+            throw std::invalid_argument("callId or requestLen is null");
+        }
+        return getRpc(rpc)->readRequest(*callId, buffer, bufLen, *requestLen, timeoutMsecs) ? 1 : -XPNP_getErrorCode();
+    } catch (std::exception& e) {
+        return -recordError(e);
+    }
+}
+
+int XPNP_rpcSendResponse(XPNP_RpcHandle rpc, unsigned int callId, const char* response, int responseLen) {
+    try {
+        if (responseLen < 0) {
+            throw std::invalid_argument("responseLen < 0");
+        }
+        getRpc(rpc)->sendResponse(callId, response, responseLen);
+        return 1;
+    } catch (std::exception& e) {
+        return -recordError(e);
+    }
+}
@@ -0,0 +1,432 @@
+#include "stdafx.h"
+
+#include "XpNamedPipe.h"
+#include "util.hpp"
+#include "internal.hpp"
+using namespace util;
+
+// Waits on many pipes from one I/O thread.  For a pipe registered for reading, the thread starts a 1-byte
+// ReadFileEx and collects its completion in an alertable wait; the byte is handed to the pipe as its lookahead,
+// which the next read returns first.  For a listening pipe, it starts an overlapped ConnectNamedPipe and waits on
+// its event, so XPNP_acceptConnection later finds the client already connected.  Only the thread that started
+// an operation can cancel it, so that thread also handles unregistering.  Each registration holds a reference to
+// its pipe, so a pipe closed while registered keeps its Windows handle, and any probe on it stays valid, until it
+// is unregistered.  The I/O thread and completion routines never throw: a pipe that cannot be queued as ready is
+// queued on the next pass instead.
+
+// Type definitions
+
+class Selector;
+
+struct Registration {
+    Registration(Selector* owner, XPNP_PipeHandle pipe, int interest) : owner(owner), pipe(pipe),
+            pipeInfo(holdPipe(pipe)), pipeHandle(getNativePipeHandle(pipeInfo)), interest(interest), probeByte(0),
+            probing(false), cancelled(false), ready(false), removed(false) {
+        memset(&overlapped, 0, sizeof(overlapped));
+        if (interest == XPNP_SELECT_ACCEPT) {
+            connectEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+            try {
+                connectEvent.check("CreateEvent");
+            } catch (...) {
+                releasePipe(pipe);
+                throw;
+            }
+        }
+    }
+
+    // Only once no probe is pending, since releasing may close the pipe's handle.
+    ~Registration() {
+        releasePipe(pipe);
+    }
+
+    Selector* owner;
+    XPNP_PipeHandle pipe;
+    PipeInfo* pipeInfo;
+    HANDLE pipeHandle;
+    int interest;
+    OVERLAPPED overlapped;
+    ScopedHandle connectEvent;
+    char probeByte;
+    bool probing;
+    bool cancelled;
+    // Set once the pipe is found ready, and cleared by XPNP_selectorResume.
+    bool ready;
+    bool removed;
+};
+
+class Selector {
+public:
+    Selector() : accepting(0), woken(false), closing(false) {
+        wakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        wakeEvent.check("CreateEvent");
+        ioThread = boost::thread(&Selector::ioLoop, this);
+    }
+
+    ~Selector() {
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            closing = true;
+        }
+        SetEvent(wakeEvent);
+        ioThread.join();
+    }
+
+    void add(XPNP_PipeHandle pipe, int interest) {
+        boost::mutex::scoped_lock lock(mutex);
+        if (registrations.find(pipe) != registrations.end()) {
+            throw std::invalid_argument("Pipe is already registered");
+        }
+        // The I/O thread waits on each listening pipe's event, and on its own wake event.
+        if (interest == XPNP_SELECT_ACCEPT && accepting >= MAXIMUM_WAIT_OBJECTS - 1) {
+            throw std::invalid_argument("Too many listening pipes registered");
+        }
+        Registration* registration = new Registration(this, pipe, interest);
+        try {
+            registrations[pipe] = registration;
+        } catch (...) {
+            delete registration;
+            throw;
+        }
+        if (interest == XPNP_SELECT_ACCEPT) {
+            accepting++;
+        }
+        SetEvent(wakeEvent);
+    }
+
+    // Waits until the I/O thread no longer uses the pipe, so that the caller can close it.
+    void remove(XPNP_PipeHandle pipe) {
+        boost::mutex::scoped_lock lock(mutex);
+        Registration* registration = getRegistration(pipe);
+        registration->removed = true;
+        SetEvent(wakeEvent);
+        while (registrations.find(pipe) != registrations.end()) {
+            released.wait(lock);
+        }
+    }
+
+    void resume(XPNP_PipeHandle pipe) {
+        boost::mutex::scoped_lock lock(mutex);
+        Registration* registration = getRegistration(pipe);
+        if (registration->ready) {
+            registration->ready = false;
+            SetEvent(wakeEvent);
+        }
+    }
+
+    // Returns the number of ready pipes, or 0, with the error recorded, if it times out or is woken.
+    int select(XPNP_PipeHandle* ready, int maxReady, int timeoutMsecs) {
+        boost::mutex::scoped_lock lock(mutex);
+        boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeoutMsecs);
+        while (true) {
+            if (woken) {
+                woken = false;
+                setError(XPNP_ERROR_INTERRUPTED, "Selector woken up");
+                return 0;
+            }
+            int count = 0;
+            while (count < maxReady && !readyPipes.empty()) {
+                XPNP_PipeHandle pipe = readyPipes.front();
+                readyPipes.pop_front();
+                // Skip pipes unregistered since they were found ready.
+                if (registrations.find(pipe) != registrations.end()) {
+                    ready[count++] = pipe;
+                }
+            }
+            if (count > 0) {
+                return count;
+            }
+            if (timeoutMsecs < 0) {
+                readyChanged.wait(lock);
+            } else if (!readyChanged.timed_wait(lock, deadline) && readyPipes.empty() && !woken) {
+                setError(XPNP_ERROR_TIMEOUT, "Timed out waiting for a pipe to become ready");
+                return 0;
+            }
+        }
+    }
+
+    void wakeup() {
+        boost::mutex::scoped_lock lock(mutex);
+        woken = true;
+        readyChanged.notify_all();
+    }
+
+private:
+    // Called with the mutex held.
+    Registration* getRegistration(XPNP_PipeHandle pipe) {
+        std::map<XPNP_PipeHandle, Registration*>::iterator it = registrations.find(pipe);
+        if (it == registrations.end()) {
+            throw std::invalid_argument("Pipe is not registered");
+        }
+        return it->second;
+    }
+
+    // Called with the mutex held.  If the pipe cannot be queued, it is left not ready, so the I/O thread probes it
+    // again (finding the lookahead or the connected client) on its next pass.
+    void markReady(Registration* registration) {
+        try {
+            readyPipes.push_back(registration->pipe);
+        } catch (...) {
+            SetEvent(wakeEvent);
+            return;
+        }
+        registration->ready = true;
+        readyChanged.notify_one();
+    }
+
+    // A completion routine, run during the I/O thread's alertable wait, so nothing may be thrown out of it.
+    static VOID CALLBACK probeCompleted(DWORD errorCode, DWORD bytesRead, LPOVERLAPPED overlapped) {
+        Registration* registration = (Registration*)overlapped->hEvent;
+        try {
+            boost::mutex::scoped_lock lock(registration->owner->mutex);
+            registration->probing = false;
+            if (errorCode == ERROR_SUCCESS && bytesRead == 1) {
+                setLookahead(registration->pipeInfo, registration->probeByte);
+            } else if (registration->cancelled) {
+                return;
+            }
+            // A failed probe also makes the pipe ready, so that the caller's read reports the failure.
+            if (!registration->removed) {
+                registration->owner->markReady(registration);
+            }
+        } catch (...) {
+            // Only locking can fail here.  The probe is no longer pending, so the next pass starts another.
+            registration->probing = false;
+            SetEvent(registration->owner->wakeEvent);
+        }
+    }
+
+    // Called on the I/O thread with the mutex held.
+    void connectCompleted(Registration* registration) {
+        DWORD unused = 0;
+        GetOverlappedResult(registration->pipeHandle, &registration->overlapped, &unused, FALSE);
+        registration->probing = false;
+        if (!registration->removed) {
+            markReady(registration);
+        }
+    }
+
+    // Called on the I/O thread with the mutex held.
+    void startProbe(Registration* registration) {
+        memset(&registration->overlapped, 0, sizeof(registration->overlapped));
+        if (registration->interest == XPNP_SELECT_READ) {
+            if (hasLookahead(registration->pipeInfo)) {
+                markReady(registration);
+                return;
+            }
+            // ReadFileEx does not use hEvent, so it carries the registration to the completion routine.
+            registration->overlapped.hEvent = (HANDLE)registration;
+            if (ReadFileEx(registration->pipeHandle, &registration->probeByte, 1, &registration->overlapped,
+                    probeCompleted)) {
+                registration->probing = true;
+            } else {
+                markReady(registration);
+            }
+        } else {
+            ResetEvent(registration->connectEvent);
+            registration->overlapped.hEvent = registration->connectEvent;
+            if (!ConnectNamedPipe(registration->pipeHandle, &registration->overlapped) &&
+                    GetLastError() == ERROR_IO_PENDING) {
+                registration->probing = true;
+            } else {
+                // Already connected (or failed), which XPNP_acceptConnection will find out.
+                markReady(registration);
+            }
+        }
+        registration->cancelled = false;
+    }
+
+    // Called on the I/O thread with the mutex held.  Fills handles with the wake event followed by the events of
+    // pending connects, and waitingAccepts with their registrations.
+    void serviceRegistrations(std::vector<HANDLE>& handles, std::vector<Registration*>& waitingAccepts) {
+        handles.assign(1, (HANDLE)wakeEvent);
+        waitingAccepts.clear();
+        std::map<XPNP_PipeHandle, Registration*>::iterator it = registrations.begin();
+        while (it != registrations.end()) {
+            Registration* registration = it->second;
+            if (registration->removed) {
+                if (registration->probing) {
+                    if (!registration->cancelled) {
+                        CancelIo(registration->pipeHandle);
+                        registration->cancelled = true;
+                    }
+                } else {
+                    if (registration->interest == XPNP_SELECT_ACCEPT) {
+                        accepting--;
+                    }
+                    delete registration;
+                    registrations.erase(it++);
+                    released.notify_all();
+                    continue;
+                }
+            } else if (!registration->ready && !registration->probing) {
+                startProbe(registration);
+            }
+            if (registration->probing && registration->interest == XPNP_SELECT_ACCEPT) {
+                handles.push_back(registration->connectEvent);
+                waitingAccepts.push_back(registration);
+            }
+            ++it;
+        }
+    }
+
+    void ioLoop() {
+        std::vector<HANDLE> handles;
+        std::vector<Registration*> waitingAccepts;
+        handles.reserve(MAXIMUM_WAIT_OBJECTS);
+        waitingAccepts.reserve(MAXIMUM_WAIT_OBJECTS);
+        while (true) {
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                if (closing) {
+                    break;
+                }
+                serviceRegistrations(handles, waitingAccepts);
+            }
+            // Read probes complete during this alertable wait.
+            DWORD waitResult = WaitForMultipleObjectsEx((DWORD)handles.size(), &handles[0], FALSE, INFINITE, TRUE);
+            if (waitResult > WAIT_OBJECT_0 && waitResult < WAIT_OBJECT_0 + handles.size()) {
+                boost::mutex::scoped_lock lock(mutex);
+                connectCompleted(waitingAccepts[waitResult - WAIT_OBJECT_0 - 1]);
+            }
+        }
+
+        boost::mutex::scoped_lock lock(mutex);
+        bool probing = false;
+        do {
+            probing = false;
+            for (std::map<XPNP_PipeHandle, Registration*>::iterator it = registrations.begin(); it != registrations.end(); ++it) {
+                Registration* registration = it->second;
+                registration->removed = true;
+                if (!registration->probing) {
+                    continue;
+                }
+                if (!registration->cancelled) {
+                    CancelIo(registration->pipeHandle);
+                    registration->cancelled = true;
+                }
+                if (registration->interest == XPNP_SELECT_ACCEPT) {
+                    DWORD unused = 0;
+                    GetOverlappedResult(registration->pipeHandle, &registration->overlapped, &unused, TRUE);
+                    registration->probing = false;
+                } else {
+                    probing = true;
+                }
+            }
+            if (probing) {
+                lock.unlock();
+                SleepEx(INFINITE, TRUE);
+                lock.lock();
+            }
+        } while (probing);
+
+        for (std::map<XPNP_PipeHandle, Registration*>::iterator it = registrations.begin(); it != registrations.end(); ++it) {
+            delete it->second;
+        }
+        registrations.clear();
+        released.notify_all();
+    }
+
+    boost::mutex mutex;
+    boost::condition_variable readyChanged;
+    boost::condition_variable released;
+    ScopedHandle wakeEvent;
+
+    std::map<XPNP_PipeHandle, Registration*> registrations;
+    std::deque<XPNP_PipeHandle> readyPipes;
+    int accepting;
+    bool woken;
+    bool closing;
+
+    boost::thread ioThread;
+};
+
+// Local function definitions
+
+static Selector* getSelector(XPNP_SelectorHandle handle) {
+    if (handle == 0) {
+        throw std::invalid_argument("Selector handle is null");
+    }
+    return (Selector*)handle;
+}
+
+// Exported function definitions
+
+XPNP_SelectorHandle XPNP_createSelector() {
+    try {
+        return (XPNP_SelectorHandle)new Selector();
+    } catch (std::exception& e) {
+        recordError(e);
+        return NULL;
+    }
+}
+
+int XPNP_closeSelector(XPNP_SelectorHandle selector) {
+    try {
+        delete getSelector(selector);
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_selectorRegister(XPNP_SelectorHandle selector, XPNP_PipeHandle pipe, int interest) {
+    try {
+        if (pipe == 0) {
+            throw std::invalid_argument("Pipe handle is null");
+        }
+        if (interest != XPNP_SELECT_READ && interest != XPNP_SELECT_ACCEPT) {
+            throw std::invalid_argument("Unknown interest");
+        }
+        getSelector(selector)->add(pipe, interest);
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_selectorUnregister(XPNP_SelectorHandle selector, XPNP_PipeHandle pipe) {
+    try {
+        getSelector(selector)->remove(pipe);
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_selectorResume(XPNP_SelectorHandle selector, XPNP_PipeHandle pipe) {
+    try {
+        getSelector(selector)->resume(pipe);
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
+
+int XPNP_select(XPNP_SelectorHandle selector, XPNP_PipeHandle* ready, int maxReady, int timeoutMsecs) {
+    try {
+        if (ready == NULL) {
+            throw std::invalid_argument("ready is null");
+        }
+        if (maxReady <= 0) {
+            throw std::invalid_argument("maxReady <= 0");
+        }
+        int count = getSelector(selector)->select(ready, maxReady, timeoutMsecs);
+        return count > 0 ? count : -XPNP_getErrorCode();
+    } catch (std::exception& e) {
+        return -recordError(e);
+    }
+}
+
+int XPNP_selectorWakeup(XPNP_SelectorHandle selector) {
+    try {
+        getSelector(selector)->wakeup();
+        return 1;
+    } catch (std::exception& e) {
+        recordError(e);
+        return 0;
+    }
+}
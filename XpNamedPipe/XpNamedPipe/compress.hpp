@@ -0,0 +1,189 @@
+#pragma once
+
+#include <string.h>
+#include <stdexcept>
+
+// Fast block compression using the LZ4 block format (a token byte of literal/match lengths, literals,
+// a 2-byte little-endian offset, and 255-run length extensions).  Favours speed over ratio;
+// intended for framed messages, not for archival.
+
+namespace compress {
+    const int MIN_MATCH = 4;
+    const int LAST_LITERALS = 5;
+    const int MATCH_FIND_LIMIT = 12;
+    const int MAX_OFFSET = 65535;
+    const int HASH_BITS = 12;
+
+    inline unsigned int read32(const unsigned char* p) {
+        unsigned int value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    inline unsigned int hashSequence(unsigned int sequence) {
+        return (sequence * 2654435761U) >> (32 - HASH_BITS);
+    }
+
+    inline bool writeLength(unsigned char*& op, const unsigned char* oend, size_t length) {
+        while (length >= 255) {
+            if (op >= oend) {
+                return false;
+            }
+            *op++ = 255;
+            length -= 255;
+        }
+        if (op >= oend) {
+            return false;
+        }
+        *op++ = (unsigned char)length;
+        return true;
+    }
+
+    inline bool writeSequence(unsigned char*& op, const unsigned char* oend, const unsigned char* literals,
+            size_t literalLen, bool hasMatch, size_t offset, size_t matchLen) {
+        if (op >= oend) {
+            return false;
+        }
+        unsigned char* token = op++;
+        *token = (unsigned char)((literalLen < 15 ? literalLen : 15) << 4);
+        if (literalLen >= 15 && !writeLength(op, oend, literalLen - 15)) {
+            return false;
+        }
+        if ((size_t)(oend - op) < literalLen) {
+            return false;
+        }
+        memcpy(op, literals, literalLen);
+        op += literalLen;
+
+        if (hasMatch) {
+            if (oend - op < 2) {
+                return false;
+            }
+            *op++ = (unsigned char)(offset & 0xff);
+            *op++ = (unsigned char)(offset >> 8);
+
+            size_t extraLen = matchLen - MIN_MATCH;
+            *token |= (unsigned char)(extraLen < 15 ? extraLen : 15);
+            if (extraLen >= 15 && !writeLength(op, oend, extraLen - 15)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Returns the number of bytes written to dest, or 0 if the compressed form does not fit in destCapacity
+    // (callers pass srcLen - 1 or less to get "only if it shrinks" behaviour).
+    inline int compressBlock(const char* src, int srcLen, char* dest, int destCapacity) {
+        const unsigned char* base = (const unsigned char*)src;
+        const unsigned char* ip = base;
+        const unsigned char* anchor = base;
+        const unsigned char* iend = base + srcLen;
+        unsigned char* op = (unsigned char*)dest;
+        const unsigned char* oend = op + destCapacity;
+
+        if (srcLen > MATCH_FIND_LIMIT) {
+            int table[1 << HASH_BITS];
+            memset(table, 0, sizeof(table));
+
+            const unsigned char* matchFindLimit = iend - MATCH_FIND_LIMIT;
+            const unsigned char* matchLimit = iend - LAST_LITERALS;
+            while (ip < matchFindLimit) {
+                unsigned int sequence = read32(ip);
+                unsigned int hash = hashSequence(sequence);
+                const unsigned char* ref = base + table[hash];
+                table[hash] = (int)(ip - base);
+
+                if (ref < ip && ip - ref <= MAX_OFFSET && read32(ref) == sequence) {
+                    const unsigned char* matchEnd = ip + MIN_MATCH;
+                    const unsigned char* refEnd = ref + MIN_MATCH;
+                    while (matchEnd < matchLimit && *matchEnd == *refEnd) {
+                        matchEnd++;
+                        refEnd++;
+                    }
+                    if (!writeSequence(op, oend, anchor, ip - anchor, true, ip - ref, matchEnd - ip)) {
+                        return 0;
+                    }
+                    ip = matchEnd;
+                    anchor = ip;
+                } else {
+                    ip++;
+                }
+            }
+        }
+        if (!writeSequence(op, oend, anchor, iend - anchor, false, 0, 0)) {
+            return 0;
+        }
+        return (int)(op - (unsigned char*)dest);
+    }
+
+    inline size_t readLength(const unsigned char*& ip, const unsigned char* iend, size_t length) {
+        unsigned char b = 0;
+        do {
+            if (ip >= iend) {
+                throw std::runtime_error("Compressed message truncated");
+            }
+            b = *ip++;
+            length += b;
+        } while (b == 255);
+        return length;
+    }
+
+    // Decompresses exactly destLen bytes; throws if the input is malformed or does not expand to destLen.
+    inline void decompressBlock(const char* src, int srcLen, char* dest, int destLen) {
+        const unsigned char* ip = (const unsigned char*)src;
+        const unsigned char* iend = ip + srcLen;
+        unsigned char* base = (unsigned char*)dest;
+        unsigned char* op = base;
+        unsigned char* oend = base + destLen;
+
+        while (true) {
+            if (ip >= iend) {
+                throw std::runtime_error("Compressed message truncated");
+            }
+            unsigned char token = *ip++;
+            size_t literalLen = token >> 4;
+            if (literalLen == 15) {
+                literalLen = readLength(ip, iend, literalLen);
+            }
+            if ((size_t)(iend - ip) < literalLen || (size_t)(oend - op) < literalLen) {
+                throw std::runtime_error("Compressed message corrupt");
+            }
+            memcpy(op, ip, literalLen);
+            op += literalLen;
+            ip += literalLen;
+            if (ip == iend) {
+                break;
+            }
+
+            if (iend - ip < 2) {
+                throw std::runtime_error("Compressed message truncated");
+            }
+            size_t offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            if (offset == 0 || offset > (size_t)(op - base)) {
+                throw std::runtime_error("Compressed message corrupt");
+            }
+            size_t matchLen = token & 15;
+            if (matchLen == 15) {
+                matchLen = readLength(ip, iend, matchLen);
+            }
+            matchLen += MIN_MATCH;
+            if ((size_t)(oend - op) < matchLen) {
+                throw std::runtime_error("Compressed message corrupt");
+            }
+            const unsigned char* ref = op - offset;
+            if (offset >= matchLen) {
+                memcpy(op, ref, matchLen);
+                op += matchLen;
+            } else {
+                // Overlapping match (run-length style), copy forwards byte by byte.
+                for (size_t i = 0; i < matchLen; i++) {
+                    *op++ = *ref++;
+                }
+            }
+        }
+        if (op != oend) {
+            throw std::runtime_error("Compressed message has wrong length");
+        }
+    }
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN             
+#include <windows.h>
+
+#include <deque>
+#include <stdexcept>
+#include <boost/thread/mutex.hpp>
+
+// A table of objects addressed by handles that pack a slot index with the slot's generation, so that a handle to
+// a closed object is recognised as stale rather than followed.  Looking a handle up takes a reference without
+// locking.  Closing drops the table's own reference, and the object is deleted when the last reference is released,
+// so it may be closed while other threads are still using it.
+
+namespace handles {
+    const int INDEX_BITS = 16;
+    const unsigned int INDEX_MASK = (1 << INDEX_BITS) - 1;
+    const unsigned int MAX_GENERATION = 0xffff;
+    const unsigned int CHUNK_SIZE = 256;
+    const unsigned int MAX_CHUNKS = (INDEX_MASK + 1) / CHUNK_SIZE;
+
+    // A slot's state packs its generation (high 16 bits), a closed flag, and its reference count.
+    const LONG CLOSED_FLAG = 0x8000;
+    const LONG REF_MASK = 0x7fff;
+
+    inline unsigned int getGeneration(LONG state) {
+        return ((unsigned int)state >> INDEX_BITS) & MAX_GENERATION;
+    }
+
+    template <class T>
+    class HandleTable {
+    public:
+        HandleTable() : slotCount(0), liveCount(0) {
+            memset((void*)chunks, 0, sizeof(chunks));
+        }
+
+        // Objects still open are not deleted; the table lasts as long as the process.
+        ~HandleTable() {
+            for (unsigned int i = 0; i < MAX_CHUNKS; i++) {
+                delete [] chunks[i];
+            }
+        }
+
+        // Takes ownership of object, holding one reference to it until close.
+        void* add(T* object) {
+            boost::mutex::scoped_lock lock(mutex);
+            unsigned int index = 0;
+            if (!freeSlots.empty()) {
+                index = freeSlots.front();
+                freeSlots.pop_front();
+            } else {
+                if (slotCount > INDEX_MASK) {
+                    throw std::runtime_error("Too many open handles");
+                }
+                index = slotCount++;
+                if (chunks[index / CHUNK_SIZE] == NULL) {
+                    Slot* chunk = new Slot[CHUNK_SIZE];
+                    for (unsigned int i = 0; i < CHUNK_SIZE; i++) {
+                        chunk[i].state = 1 << INDEX_BITS;
+                        chunk[i].object = NULL;
+                    }
+                    InterlockedExchangePointer((PVOID*)&chunks[index / CHUNK_SIZE], chunk);
+                }
+            }
+            Slot* slot = getSlot(index);
+            slot->object = object;
+            unsigned int generation = getGeneration(slot->state);
+            InterlockedExchange(&slot->state, (LONG)(generation << INDEX_BITS) | 1);
+            InterlockedIncrement(&liveCount);
+            return (void*)(ULONG_PTR)((generation << INDEX_BITS) | index);
+        }
+
+        // Returns the object with a reference taken, or NULL if the handle is stale, closed or was never issued.
+        T* acquire(void* handle) {
+            unsigned int value = (unsigned int)(ULONG_PTR)handle;
+            Slot* slot = getSlot(value & INDEX_MASK);
+            if (slot == NULL) {
+                return NULL;
+            }
+            while (true) {
+                LONG state = slot->state;
+                if (getGeneration(state) != value >> INDEX_BITS || (state & CLOSED_FLAG) || (state & REF_MASK) == 0) {
+                    return NULL;
+                }
+                if ((state & REF_MASK) == REF_MASK) {
+                    throw std::runtime_error("Too many references to handle");
+                }
+                if (InterlockedCompareExchange(&slot->state, state + 1, state) == state) {
+                    return slot->object;
+                }
+            }
+        }
+
+        // Releases a reference taken by acquire.
+        void release(void* handle) {
+            unsigned int index = (unsigned int)(ULONG_PTR)handle & INDEX_MASK;
+            Slot* slot = getSlot(index);
+            if ((InterlockedDecrement(&slot->state) & REF_MASK) == 0) {
+                destroy(index, slot);
+            }
+        }
+
+        // Returns false if the handle is stale or already closed.
+        bool close(void* handle) {
+            unsigned int value = (unsigned int)(ULONG_PTR)handle;
+            Slot* slot = getSlot(value & INDEX_MASK);
+            if (slot == NULL) {
+                return false;
+            }
+            while (true) {
+                LONG state = slot->state;
+                if (getGeneration(state) != value >> INDEX_BITS || (state & CLOSED_FLAG) || (state & REF_MASK) == 0) {
+                    return false;
+                }
+                if (InterlockedCompareExchange(&slot->state, state | CLOSED_FLAG, state) == state) {
+                    break;
+                }
+            }
+            release(handle);
+            return true;
+        }
+
+        // Objects added and not yet deleted, including closed ones still in use.
+        int getLiveCount() {
+            return liveCount;
+        }
+
+    private:
+        struct Slot {
+            volatile LONG state;
+            T* object;
+        };
+
+        Slot* getSlot(unsigned int index) {
+            Slot* chunk = chunks[index / CHUNK_SIZE];
+            return chunk == NULL ? NULL : &chunk[index % CHUNK_SIZE];
+        }
+
+        void destroy(unsigned int index, Slot* slot) {
+            delete slot->object;
+            slot->object = NULL;
+            InterlockedDecrement(&liveCount);
+
+            // Generation 0 is never used, so that no handle is 0.
+            unsigned int generation = getGeneration(slot->state) + 1;
+            if (generation > MAX_GENERATION) {
+                generation = 1;
+            }
+            InterlockedExchange(&slot->state, (LONG)(generation << INDEX_BITS));
+
+            // Reusing the least recently freed slot first makes a stale handle take longest to match again.
+            boost::mutex::scoped_lock lock(mutex);
+            freeSlots.push_back(index);
+        }
+
+        boost::mutex mutex;
+        Slot* volatile chunks[MAX_CHUNKS];
+        unsigned int slotCount;
+        std::deque<unsigned int> freeSlots;
+        volatile LONG liveCount;
+    };
+}
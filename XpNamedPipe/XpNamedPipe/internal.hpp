@@ -0,0 +1,37 @@
+#pragma once
+
+#include "util.hpp"
+#include "XpNamedPipe.h"
+
+// Declarations shared by the library's source files; not part of the public API.
+
+// Records a routine error without allocating: context must be a string literal, and the message is only put
+// together if XPNP_getErrorMessage asks for it.
+void setError(int errorCode, const char* context, DWORD windowsError = 0);
+
+// Records a caught exception with its XPNP_ERROR_* code (that of an ErrorInfo, XPNP_ERROR_INVALID_ARGUMENT for
+// std::invalid_argument, otherwise XPNP_ERROR_SYSTEM), and returns the code.
+int recordError(const std::exception& e);
+
+// The time left before deadline, to pass on as a timeout: timeoutMsecs itself if it is negative (no deadline),
+// otherwise at least 0.
+int getRemainingMsecs(const boost::system_time& deadline, int timeoutMsecs);
+
+// The Windows handle underlying a connection, for layers that issue their own overlapped I/O.
+HANDLE getNativePipeHandle(XPNP_PipeHandle pipe);
+
+class PipeInfo;
+
+// A reference to a pipe for a layer that goes on using it between calls, such as a selector.  Like the reference a
+// call takes, it keeps the pipe and its Windows handle open, even if the pipe is closed meanwhile, until released.
+// holdPipe throws if the pipe is already closed; the calls taking the held PipeInfo do not throw.
+PipeInfo* holdPipe(XPNP_PipeHandle pipe);
+
+void releasePipe(XPNP_PipeHandle pipe);
+
+HANDLE getNativePipeHandle(PipeInfo* pipeInfo);
+
+// A byte read ahead by a selector to learn that a pipe has data.  Reads return it before anything still in the pipe.
+void setLookahead(PipeInfo* pipeInfo, char byte);
+
+bool hasLookahead(PipeInfo* pipeInfo);
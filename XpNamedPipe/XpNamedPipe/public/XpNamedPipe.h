@@ -1,37 +1,261 @@
-#pragma once
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-const int XPNP_ERROR_TIMEOUT = 1;
-
-struct XPNP_Pipe {};
-
-typedef XPNP_Pipe* XPNP_PipeHandle;
-
-void XPNP_getErrorMessage(char* buffer, int bufLen);
-
-int XPNP_getErrorCode();
-
-int XPNP_makePipeName(const char* baseName, int userLocal, char* pipeNameBuf, int bufLen);
- 
-XPNP_PipeHandle XPNP_createPipe(const char* pipeName, int privatePipe);
-
-int XPNP_stopPipe(XPNP_PipeHandle pipeHandle);
-
-int XPNP_closePipe(XPNP_PipeHandle pipeHandle);
-
-XPNP_PipeHandle XPNP_acceptConnection(XPNP_PipeHandle pipeHandle, int timeoutMsecs);
-
-int XPNP_readPipe(XPNP_PipeHandle pipeHandle, char* buffer, int bufLen, int timeoutMsecs);
-
-int XPNP_readBytes(XPNP_PipeHandle pipeHandle, char* buffer, int bytesToRead, int timeoutMsecs);
-
-XPNP_PipeHandle XPNP_openPipe(const char* pipeName, int privatePipe);
-
-int XPNP_writePipe(XPNP_PipeHandle pipeHandle, const char* pipeMsg, int bytesToWrite);
-
-#ifdef __cplusplus
-}
-#endif
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Error codes, as reported by XPNP_getErrorCode.  The I/O calls (XPNP_readPipe, XPNP_readBytes, XPNP_writePipe,
+// XPNP_readMessage, XPNP_writeMessage and their Ex forms, XPNP_muxWrite, XPNP_muxRead, XPNP_rpcCall,
+// XPNP_rpcReadRequest and XPNP_rpcSendResponse) return the code negated when they fail, so a caller can branch on
+// it without another call; XPNP_getErrorMessage still has the details.
+const int XPNP_ERROR_TIMEOUT = 1;
+const int XPNP_ERROR_BUFFER_TOO_SMALL = 2;
+const int XPNP_ERROR_PIPE_CLOSED = 3;
+const int XPNP_ERROR_PEER_DEAD = 4;
+// XPNP_stopPipe was called, or the mux or RPC layer being waited on was closed.
+const int XPNP_ERROR_INTERRUPTED = 5;
+const int XPNP_ERROR_INVALID_ARGUMENT = 6;
+// The peer sent data this end cannot make sense of, or a read gave up partway through a message.
+const int XPNP_ERROR_PROTOCOL = 7;
+// Any other failure, usually a Windows error.
+const int XPNP_ERROR_SYSTEM = 8;
+
+// Connection options.  The options in effect on a connection are those requested by both the
+// listening pipe (XPNP_createPipeEx) and the client (XPNP_openPipeEx); peers built before an option
+// existed simply never agree to it.  XPNP_getConnectionInfo reports what was agreed.
+const int XPNP_OPTION_COMPRESSION = 0x1;
+const int XPNP_OPTION_FLOW_CONTROL = 0x2;
+const int XPNP_OPTION_HEARTBEAT = 0x4;
+
+struct XPNP_Pipe {};
+
+typedef XPNP_Pipe* XPNP_PipeHandle;
+
+struct XPNP_Mux {};
+
+typedef XPNP_Mux* XPNP_MuxHandle;
+
+struct XPNP_Rpc {};
+
+typedef XPNP_Rpc* XPNP_RpcHandle;
+
+struct XPNP_Broadcast {};
+
+typedef XPNP_Broadcast* XPNP_BroadcastHandle;
+
+struct XPNP_Selector {};
+
+typedef XPNP_Selector* XPNP_SelectorHandle;
+
+// What a pipe is registered with a selector for: data to read, or a client to accept on a listening pipe.
+const int XPNP_SELECT_READ = 1;
+const int XPNP_SELECT_ACCEPT = 2;
+
+// What XPNP_broadcastPublish does when a subscriber already has maxQueuedMessages waiting.
+const int XPNP_BROADCAST_DROP_OLDEST = 0;
+const int XPNP_BROADCAST_DISCONNECT = 1;
+
+void XPNP_getErrorMessage(char* buffer, int bufLen);
+
+int XPNP_getErrorCode();
+
+int XPNP_makePipeName(const char* baseName, int userLocal, char* pipeNameBuf, int bufLen);
+ 
+XPNP_PipeHandle XPNP_createPipe(const char* pipeName, int privatePipe);
+
+XPNP_PipeHandle XPNP_createPipeEx(const char* pipeName, int privatePipe, int options);
+
+int XPNP_stopPipe(XPNP_PipeHandle pipeHandle);
+
+// Closing a pipe while other calls are using it is safe: they keep it open until they return, one of them blocked
+// on it is woken as by XPNP_stopPipe, and later calls with the handle fail with XPNP_ERROR_INVALID_ARGUMENT.
+int XPNP_closePipe(XPNP_PipeHandle pipeHandle);
+
+// The number of pipes created, opened or accepted and not yet released: a closed pipe counts until the calls
+// still using it return.
+int XPNP_getOpenPipeCount();
+
+// timeoutMsecs bounds the whole handshake, not just the wait for a client: a client that connects but does not finish
+// it in the time left fails the call with XPNP_ERROR_TIMEOUT.
+XPNP_PipeHandle XPNP_acceptConnection(XPNP_PipeHandle pipeHandle, int timeoutMsecs);
+
+// Returns the number of bytes read, or a negated error code.  Not available on connections with heartbeats.
+int XPNP_readPipe(XPNP_PipeHandle pipeHandle, char* buffer, int bufLen, int timeoutMsecs);
+
+// Returns 1 once all bytesToRead bytes have been read, or a negated error code.
+int XPNP_readBytes(XPNP_PipeHandle pipeHandle, char* buffer, int bytesToRead, int timeoutMsecs);
+
+XPNP_PipeHandle XPNP_openPipe(const char* pipeName, int privatePipe);
+
+XPNP_PipeHandle XPNP_openPipeEx(const char* pipeName, int privatePipe, int options);
+
+// Returns 1, or a negated error code.
+int XPNP_writePipe(XPNP_PipeHandle pipeHandle, const char* pipeMsg, int bytesToWrite);
+
+// Reports what was agreed with the peer when the connection was made: the protocol version (0 for a peer
+// that predates version negotiation), the options in effect, and the peer's pipe buffer size (0 if unknown).
+int XPNP_getConnectionInfo(XPNP_PipeHandle pipeHandle, int* protocolVersion, int* options, int* peerBufferSize);
+
+// Counts kept for each connection since it was created.  readCalls and writeCalls count ReadFile and WriteFile
+// calls, so a framed message may take several; partialReads counts reads that returned less than was asked for.
+// The wait times cover reads and writes that had to wait for the peer.  timeouts and interruptions count calls
+// that failed with XPNP_ERROR_TIMEOUT and XPNP_ERROR_INTERRUPTED.  Framed message counts include compressed
+// messages but not flow control or heartbeat frames.  I/O done by a mux, broadcast or selector on the pipe's
+// native handle is not counted.  A listening pipe counts its handshake traffic and accept timeouts.
+struct XPNP_PipeStats {
+    long long bytesRead;
+    long long bytesWritten;
+    long long messagesRead;
+    long long messagesWritten;
+    long long readCalls;
+    long long writeCalls;
+    long long readWaitMicros;
+    long long writeWaitMicros;
+    long long timeouts;
+    long long interruptions;
+    long long partialReads;
+};
+
+int XPNP_getPipeStats(XPNP_PipeHandle pipeHandle, XPNP_PipeStats* pipeStats);
+
+// Operations timed by the latency histograms: XPNP_acceptConnection (kept on the listening pipe), XPNP_openPipe
+// and XPNP_openPipeEx (kept on the new connection), and each ReadFile and WriteFile a connection makes, including
+// the time spent waiting for the peer.  Only calls that succeed are timed.
+const int XPNP_LATENCY_ACCEPT = 0;
+const int XPNP_LATENCY_CONNECT = 1;
+const int XPNP_LATENCY_READ = 2;
+const int XPNP_LATENCY_WRITE = 3;
+
+// Turns latency timing on or off for the whole process; it is off to begin with.  While on, each timed call is
+// recorded both in the pipe's histogram and in a process-wide one.  Histograms count values in log-scaled buckets,
+// so reported latencies are at most 1/16 above the true ones.
+int XPNP_setLatencyHistograms(int enabled);
+
+// Snapshots the histogram for operation, on pipeHandle or, if it is NULL, for the whole process, and sets
+// valuesMicros[i] to the latency at percentiles[i] (0 to 100) and *sampleCount to the number of calls recorded.
+// With reset set, the histogram is cleared as it is read, so each call is counted in exactly one such snapshot.
+int XPNP_getLatencyPercentiles(XPNP_PipeHandle pipeHandle, int operation, const double* percentiles, int count,
+        long long* valuesMicros, long long* sampleCount, int reset);
+
+// As XPNP_writePipe, but fails with XPNP_ERROR_TIMEOUT if the peer has not taken the data within timeoutMsecs.
+// Part of the data may have been written by then.
+int XPNP_writePipeEx(XPNP_PipeHandle pipeHandle, const char* pipeMsg, int bytesToWrite, int timeoutMsecs);
+
+// Framed messages (4-byte network order length followed by the body), compatible with the framing
+// used by the Java binding.  If the message does not fit in bufLen, XPNP_readMessage fails with
+// XPNP_ERROR_BUFFER_TOO_SMALL and sets *msgLen to the required size; the message is kept, so the
+// call can be retried with a larger buffer.  Both return 1, or a negated error code.
+// XPNP_readMessage fails with XPNP_ERROR_TIMEOUT (or XPNP_ERROR_INTERRUPTED) only if nothing of the next message
+// had been read, so it can simply be called again.  If the time runs out or the pipe is stopped partway through a
+// message, the part already read is lost and the call fails with XPNP_ERROR_PROTOCOL; the connection is then out of
+// step and should be closed.  XPNP_readBytes behaves the same way for the bytes it was asked for.
+int XPNP_readMessage(XPNP_PipeHandle pipeHandle, char* buffer, int bufLen, int* msgLen, int timeoutMsecs);
+
+int XPNP_writeMessage(XPNP_PipeHandle pipeHandle, const char* msg, int msgLen);
+
+// With XPNP_OPTION_FLOW_CONTROL, each end may have a limited number of messages outstanding; the receiver
+// grants more as its caller reads them, so a slow reader makes writers wait instead of filling memory.
+// XPNP_writeMessageEx fails with XPNP_ERROR_TIMEOUT if credit is not granted, or the message is not taken,
+// within timeoutMsecs.  Nothing has been sent if the wait for credit timed out; a message that timed out
+// while being written leaves the connection unusable.  XPNP_getWriteCredit sets *credit to the number of
+// messages that can be written without waiting, or -1 if the connection does not use flow control.  Flow
+// control only covers framed messages, so such connections should not also use XPNP_writePipe or a broadcast.
+int XPNP_writeMessageEx(XPNP_PipeHandle pipeHandle, const char* msg, int msgLen, int timeoutMsecs);
+
+int XPNP_getWriteCredit(XPNP_PipeHandle pipeHandle, int* credit);
+
+// With XPNP_OPTION_HEARTBEAT, each end sends a small ping every intervalMsecs in which it sent nothing else.  If
+// nothing arrives from the peer for maxMissed intervals in a row (and nothing is waiting to be read), the peer
+// is taken to be dead: blocked and later reads fail with XPNP_ERROR_PEER_DEAD.  One thread serves all such
+// connections.  The settings are process-wide (default 1000 ms and 3), take effect from the next interval, and
+// should match at both ends.  Pings travel as framed messages, so such connections must be read with
+// XPNP_readMessage: XPNP_readPipe and XPNP_readBytes fail on them with XPNP_ERROR_INVALID_ARGUMENT.
+int XPNP_configureHeartbeat(int intervalMsecs, int maxMissed);
+
+// Carries independent message streams, each delivered in order, over one connection.  The mux takes over
+// all reads and writes on the pipe until XPNP_closeMux, which sends any queued messages but does not close
+// the pipe.  Streams need no setup; a stream exists once either end uses its id, except 0xFFFFFFFF, which is
+// reserved.  At most 64 messages are queued on a stream in each direction: beyond that XPNP_muxWrite blocks,
+// and so does delivery of incoming messages on every stream until the full stream is read.
+// Closing either end's mux closes both: the ends exchange close messages, after which reads at the other end
+// fail with XPNP_ERROR_PIPE_CLOSED once its queues are read, and once both have closed their mux the pipe may
+// be used directly again.  If the peer does not answer within 5 s, XPNP_closeMux fails with XPNP_ERROR_TIMEOUT
+// and the pipe can no longer be used.  No other calls on the mux may be in progress when it is closed.
+XPNP_MuxHandle XPNP_createMux(XPNP_PipeHandle pipeHandle);
+
+int XPNP_closeMux(XPNP_MuxHandle muxHandle);
+
+int XPNP_muxWrite(XPNP_MuxHandle muxHandle, unsigned int streamId, const char* msg, int msgLen);
+
+int XPNP_muxRead(XPNP_MuxHandle muxHandle, unsigned int streamId, char* buffer, int bufLen, int* msgLen, int timeoutMsecs);
+
+// Request/response calls over one connection.  Any number of threads may have calls outstanding, and the
+// serving end may answer requests in any order; responses are matched to calls by id.  Either end may both
+// make and serve calls.  The RPC layer takes over all reads and writes on the pipe until XPNP_closeRpc, which
+// does not close the pipe and must not be called while other calls on it are in progress.  Closing either end
+// closes both, as for a mux: calls and XPNP_rpcReadRequest at the other end then fail with
+// XPNP_ERROR_PIPE_CLOSED, and once both have closed the pipe may be used directly again.  If the peer does not
+// answer within 5 s, XPNP_closeRpc fails with XPNP_ERROR_TIMEOUT and the pipe can no longer be used.
+// XPNP_rpcCall's timeout covers sending the request as well as waiting for the response.  At most 64 requests are
+// queued for XPNP_rpcReadRequest; beyond that, delivery of requests and responses waits until the queue is read.
+// If a response does not fit in the caller's buffer, XPNP_rpcCall fails with XPNP_ERROR_BUFFER_TOO_SMALL,
+// sets *responseLen to the required size and discards the response.
+XPNP_RpcHandle XPNP_createRpc(XPNP_PipeHandle pipeHandle);
+
+int XPNP_closeRpc(XPNP_RpcHandle rpcHandle);
+
+int XPNP_rpcCall(XPNP_RpcHandle rpcHandle, const char* request, int requestLen, char* response, int responseBufLen, 
+        int* responseLen, int timeoutMsecs);
+
+int XPNP_rpcReadRequest(XPNP_RpcHandle rpcHandle, unsigned int* callId, char* buffer, int bufLen, int* requestLen, 
+        int timeoutMsecs);
+
+int XPNP_rpcSendResponse(XPNP_RpcHandle rpcHandle, unsigned int callId, const char* response, int responseLen);
+
+// Sends each published message, as a framed message, to every subscribed connection without waiting for
+// any of them.  Each subscriber has its own queue of at most maxQueuedMessages; when it is full the oldest
+// unsent message is dropped (the new one, if the only one queued is being written) or, with
+// XPNP_BROADCAST_DISCONNECT, the subscriber is dropped.  Subscribers whose writes fail or overflow are
+// unsubscribed and can be collected with XPNP_broadcastTakeFailed, which sets *pipeHandle to NULL when there
+// are none; closing them is left to the caller.  While subscribed, a pipe must not be written to by other means.
+// XPNP_broadcastUnsubscribe waits for any write in progress to finish or be cancelled, after which the pipe may
+// be closed.
+XPNP_BroadcastHandle XPNP_createBroadcast(int maxQueuedMessages, int overflowPolicy);
+
+int XPNP_closeBroadcast(XPNP_BroadcastHandle broadcastHandle);
+
+int XPNP_broadcastSubscribe(XPNP_BroadcastHandle broadcastHandle, XPNP_PipeHandle pipeHandle);
+
+int XPNP_broadcastUnsubscribe(XPNP_BroadcastHandle broadcastHandle, XPNP_PipeHandle pipeHandle);
+
+int XPNP_broadcastPublish(XPNP_BroadcastHandle broadcastHandle, const char* msg, int msgLen);
+
+int XPNP_broadcastTakeFailed(XPNP_BroadcastHandle broadcastHandle, XPNP_PipeHandle* pipeHandle);
+
+// Waits on many pipes at once.  One I/O thread per selector watches every registered pipe, so a few threads can
+// serve many connections.  XPNP_select fills ready with up to maxReady pipes that have data to read (or a client to
+// accept) and returns how many, or a negated error code: XPNP_ERROR_TIMEOUT if none became ready within
+// timeoutMsecs, or XPNP_ERROR_INTERRUPTED after XPNP_selectorWakeup.  Each ready pipe is reported once and then left
+// alone until XPNP_selectorResume, so the thread that got it can read it (or accept on it) without interference;
+// between registering and being reported ready, a pipe must not be read.  Readiness can come from a flow control or
+// heartbeat control frame alone, so reads after it should use a short timeout.  XPNP_selectorUnregister waits for
+// the I/O thread to let go of the pipe.  A registered pipe may also be closed: the selector keeps its Windows handle
+// open until it is unregistered (or the selector is closed), and a read after it is reported ready fails with
+// XPNP_ERROR_INVALID_ARGUMENT.  No other calls on the selector may be in progress when it is closed.
+XPNP_SelectorHandle XPNP_createSelector();
+
+int XPNP_closeSelector(XPNP_SelectorHandle selectorHandle);
+
+int XPNP_selectorRegister(XPNP_SelectorHandle selectorHandle, XPNP_PipeHandle pipeHandle, int interest);
+
+int XPNP_selectorUnregister(XPNP_SelectorHandle selectorHandle, XPNP_PipeHandle pipeHandle);
+
+int XPNP_selectorResume(XPNP_SelectorHandle selectorHandle, XPNP_PipeHandle pipeHandle);
+
+int XPNP_select(XPNP_SelectorHandle selectorHandle, XPNP_PipeHandle* ready, int maxReady, int timeoutMsecs);
+
+int XPNP_selectorWakeup(XPNP_SelectorHandle selectorHandle);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,237 @@
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <intrin.h>
+#include <vector>
+
+#include "XpNamedPipe.h"
+
+#pragma intrinsic(_InterlockedCompareExchange64, _BitScanReverse)
+
+// Counters kept on each pipe for XPNP_getPipeStats, and the latency histograms behind XPNP_getLatencyPercentiles.
+// They are updated without locks, at the cost of an interlocked instruction or two per read or write call, which
+// is small next to the system call being counted.
+
+namespace stats {
+    // A 64-bit count that any thread may add to.  InterlockedExchangeAdd64 is not available to x86 builds targeting
+    // XP, so this uses the compare-exchange intrinsic (cmpxchg8b), which is.
+    class Counter {
+    public:
+        Counter() : value(0) {
+        }
+
+        void add(__int64 amount) {
+            __int64 current = value;
+            while (true) {
+                __int64 previous = _InterlockedCompareExchange64(&value, current + amount, current);
+                if (previous == current) {
+                    break;
+                }
+                current = previous;
+            }
+        }
+
+        void increment() {
+            add(1);
+        }
+
+        // A plain 64-bit read could tear on x86.
+        __int64 get() {
+            return _InterlockedCompareExchange64(&value, 0, 0);
+        }
+
+        // Zeroes the count and returns what it was, without losing any concurrent add.
+        __int64 getAndReset() {
+            __int64 current = value;
+            while (true) {
+                __int64 previous = _InterlockedCompareExchange64(&value, 0, current);
+                if (previous == current) {
+                    return current;
+                }
+                current = previous;
+            }
+        }
+
+    private:
+        volatile __int64 value;
+    };
+
+    inline __int64 getTicks() {
+        LARGE_INTEGER ticks;
+        QueryPerformanceCounter(&ticks);
+        return ticks.QuadPart;
+    }
+
+    inline __int64 ticksToMicros(__int64 ticks) {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        return ticks * 1000000 / frequency.QuadPart;
+    }
+
+    // Adds the microseconds between its construction and destruction to a counter, if there is one.
+    class WaitTimer {
+    public:
+        WaitTimer(Counter* counter) : counter(counter), start(counter != NULL ? getTicks() : 0) {
+        }
+
+        ~WaitTimer() {
+            if (counter != NULL) {
+                counter->add(ticksToMicros(getTicks() - start));
+            }
+        }
+
+    private:
+        Counter* counter;
+        __int64 start;
+    };
+
+    // Latencies in microseconds, counted in log-linear buckets as in an HDR histogram: values below
+    // 2 * SUB_BUCKET_HALF each have a bucket, and every power of two above that is split into SUB_BUCKET_HALF
+    // buckets, so a bucket's values are within 1 / SUB_BUCKET_HALF of each other.  Values of 2^MAX_VALUE_BITS
+    // microseconds (about 19 hours) and more share the last bucket.  Recording is one interlocked increment of a
+    // 64-bit Counter, so that a busy pipe's counts do not wrap.
+    class Histogram {
+    public:
+        static const int SUB_BUCKET_BITS = 4;
+        static const int SUB_BUCKET_HALF = 1 << SUB_BUCKET_BITS;
+        static const int MAX_VALUE_BITS = 36;
+        static const int BUCKET_COUNT = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKET_HALF;
+
+        void record(__int64 micros) {
+            counts[getBucket(micros)].increment();
+        }
+
+        // Copies the counts into snapshot, zeroing them if reset is set; each value recorded is then in exactly
+        // one reset snapshot.
+        void takeSnapshot(std::vector<__int64>& snapshot, bool reset) {
+            snapshot.resize(BUCKET_COUNT);
+            for (int i = 0; i < BUCKET_COUNT; i++) {
+                snapshot[i] = reset ? counts[i].getAndReset() : counts[i].get();
+            }
+        }
+
+        static int getBucket(__int64 micros) {
+            if (micros < 2 * SUB_BUCKET_HALF) {
+                return micros < 0 ? 0 : (int)micros;
+            }
+            if (micros >= ((__int64)1 << MAX_VALUE_BITS)) {
+                return BUCKET_COUNT - 1;
+            }
+            unsigned long topBit = 0;
+            if (micros >> 32) {
+                _BitScanReverse(&topBit, (unsigned long)(micros >> 32));
+                topBit += 32;
+            } else {
+                _BitScanReverse(&topBit, (unsigned long)micros);
+            }
+            int shift = (int)topBit - SUB_BUCKET_BITS;
+            return shift * SUB_BUCKET_HALF + (int)(micros >> shift);
+        }
+
+        // The largest value counted in a bucket, which is what percentiles report.
+        static __int64 getHighestValue(int bucket) {
+            if (bucket < 2 * SUB_BUCKET_HALF) {
+                return bucket;
+            }
+            int shift = bucket / SUB_BUCKET_HALF - 1;
+            __int64 lowest = (__int64)(bucket % SUB_BUCKET_HALF + SUB_BUCKET_HALF) << shift;
+            return lowest + ((__int64)1 << shift) - 1;
+        }
+
+        // The value below which percentile percent of the values in snapshot fall, or 0 if it is empty.
+        static __int64 getPercentile(const std::vector<__int64>& snapshot, __int64 totalCount, double percentile) {
+            if (totalCount == 0) {
+                return 0;
+            }
+            __int64 rank = (__int64)(percentile / 100 * totalCount + 0.5);
+            if (rank < 1) {
+                rank = 1;
+            }
+            __int64 seen = 0;
+            for (int i = 0; i < (int)snapshot.size(); i++) {
+                seen += snapshot[i];
+                if (seen >= rank) {
+                    return getHighestValue(i);
+                }
+            }
+            return getHighestValue((int)snapshot.size() - 1);
+        }
+
+    private:
+        Counter counts[BUCKET_COUNT];
+    };
+
+    // One histogram for each XPNP_LATENCY_* operation.
+    class LatencyHistograms {
+    public:
+        static const int OPERATION_COUNT = 4;
+
+        Histogram& get(int operation) {
+            return histograms[operation];
+        }
+
+    private:
+        Histogram histograms[OPERATION_COUNT];
+    };
+
+    struct PipeStats {
+        PipeStats() : latencies(NULL) {
+        }
+
+        ~PipeStats() {
+            delete latencies;
+        }
+
+        // Most pipes are never timed, so their histograms are only made once something is recorded.
+        Histogram& getLatencyHistogram(int operation) {
+            if (latencies == NULL) {
+                LatencyHistograms* created = new LatencyHistograms();
+                if (InterlockedCompareExchangePointer((PVOID volatile*)&latencies, created, NULL) != NULL) {
+                    delete created;
+                }
+            }
+            return latencies->get(operation);
+        }
+
+        void takeLatencySnapshot(int operation, std::vector<__int64>& snapshot, bool reset) {
+            if (latencies != NULL) {
+                latencies->get(operation).takeSnapshot(snapshot, reset);
+            } else {
+                snapshot.assign(Histogram::BUCKET_COUNT, 0);
+            }
+        }
+
+        Counter bytesRead;
+        Counter bytesWritten;
+        Counter messagesRead;
+        Counter messagesWritten;
+        Counter readCalls;
+        Counter writeCalls;
+        Counter readWaitMicros;
+        Counter writeWaitMicros;
+        Counter timeouts;
+        Counter interruptions;
+        Counter partialReads;
+
+        void copyTo(XPNP_PipeStats& snapshot) {
+            snapshot.bytesRead = bytesRead.get();
+            snapshot.bytesWritten = bytesWritten.get();
+            snapshot.messagesRead = messagesRead.get();
+            snapshot.messagesWritten = messagesWritten.get();
+            snapshot.readCalls = readCalls.get();
+            snapshot.writeCalls = writeCalls.get();
+            snapshot.readWaitMicros = readWaitMicros.get();
+            snapshot.writeWaitMicros = writeWaitMicros.get();
+            snapshot.timeouts = timeouts.get();
+            snapshot.interruptions = interruptions.get();
+            snapshot.partialReads = partialReads.get();
+        }
+
+    private:
+        PipeStats(const PipeStats&);
+        PipeStats& operator=(const PipeStats&);
+
+        LatencyHistograms* volatile latencies;
+    };
+}
@@ -1,11 +1,11 @@
-#pragma once
-
-// Including SDKDDKVer.h defines the highest available Windows platform.
-
-// If you wish to build your application for a previous Windows platform, include WinSDKVer.h and
-// set the _WIN32_WINNT macro to the platform you wish to support before including SDKDDKVer.h.
-#include <winsdkver.h>
-
-#define _WIN32_WINNT _WIN32_WINNT_WINXP
- 
-#include <SDKDDKVer.h>
+#pragma once
+
+// Including SDKDDKVer.h defines the highest available Windows platform.
+
+// If you wish to build your application for a previous Windows platform, include WinSDKVer.h and
+// set the _WIN32_WINNT macro to the platform you wish to support before including SDKDDKVer.h.
+#include <winsdkver.h>
+
+#define _WIN32_WINNT _WIN32_WINNT_WINXP
+ 
+#include <SDKDDKVer.h>
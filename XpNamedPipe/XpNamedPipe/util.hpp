@@ -1,174 +1,329 @@
-#pragma once
-
-#define WIN32_LEAN_AND_MEAN             
-#include <windows.h>
-
-#include <stdexcept>
-#include <string>
-#include <sstream>
-
-namespace util {
-    class ErrorInfo : public std::runtime_error {
-    public: 
-        inline ErrorInfo(const std::string& errorMsg, int errorCode) : std::runtime_error(errorMsg) { 
-            this->errorCode = errorCode;
-        }
-
-        inline int getErrorCode() {
-            return this->errorCode;
-        }
-
-    private:
-        std::string errorMessage;
-        int errorCode;
-    };
-
-    inline std::string getWindowsErrorMessage(const std::string& prepend, const std::string& funcName) {
-        DWORD error = GetLastError();
-
-        std::stringstream msg;
-        if (!prepend.empty()) {
-            msg << prepend << ": ";
-        }
-
-        char buffer[1024] = "";
-
-        if (FormatMessageA(
-                FORMAT_MESSAGE_FROM_SYSTEM |
-                FORMAT_MESSAGE_IGNORE_INSERTS,
-                NULL,
-                error,
-                0,
-                buffer, sizeof(buffer), NULL) == 0) {
-            msg << "Failed to retrieve Windows error message";
-        } else {
-            msg << funcName << " failed with " << error << ": " << buffer;
-        }
-        return msg.str();
-    }
-
-    inline std::string getWindowsErrorMessage(const std::string& funcName) {
-        return getWindowsErrorMessage(std::string(), funcName);
-    }
-
-    inline void throwWindowsError(const std::string& prepend, const std::string& funcName) {
-        throw std::runtime_error(getWindowsErrorMessage(prepend, funcName));
-    }
-
-    inline void throwWindowsError(const std::string& funcName) {
-        throwWindowsError(std::string(), funcName);
-    }
-
-    inline void checkWindowsResult(BOOL result, const std::string& prepend, const std::string& funcName) {
-        if (!result) {
-            throwWindowsError(prepend, funcName);
-        }
-    }
-
-    inline void checkWindowsResult(BOOL result, const std::string& funcName) {
-        checkWindowsResult(result, std::string(), funcName);
-    }
-
-    template <HANDLE INVALID_HANDLE> class ScopedHandleT
-    {
-    public:
-        ScopedHandleT() {
-            this->handle = INVALID_HANDLE;
-        }
-
-        ScopedHandleT(HANDLE handle) {
-            this->handle = handle;
-        }
-
-        ScopedHandleT& operator = (HANDLE otherHandle) {
-            if (this->handle != INVALID_HANDLE) {
-                CloseHandle(this->handle);
-            }
-            this->handle = otherHandle;
-            return *this;
-        }
-
-        virtual ~ScopedHandleT() {
-            if (handle != INVALID_HANDLE) {
-                CloseHandle(handle);
-            }
-        }
-
-        operator HANDLE () const {
-            return handle;
-        }
-
-        void check(const std::string& prepend, const std::string& funcName) {
-            if (handle == INVALID_HANDLE) {
-                throwWindowsError(prepend, funcName);
-            }
-        }
-
-        void check(const std::string& funcName) {
-            check(std::string(), funcName);
-        }
-
-    private:
-        HANDLE handle;
-    };
-
-    typedef ScopedHandleT<NULL> ScopedHandle;
-    typedef ScopedHandleT<INVALID_HANDLE_VALUE> ScopedFileHandle;
-
-    inline char* newUtf8(const wchar_t* utf16) {
-        char* result = NULL;
-        try {
-            int utf8BufLen = WideCharToMultiByte(CP_UTF8, 0, utf16, -1, NULL, 0, NULL, NULL);
-            if (utf8BufLen == 0) {
-                throwWindowsError("Error converting string to UTF-8: ", "WideCharToMultiByte");
-            }
-            result = new char[utf8BufLen];
-            int conversionResult = WideCharToMultiByte(CP_UTF8, 0, utf16, -1, result, utf8BufLen, NULL, NULL);
-            if (conversionResult == 0) {
-                throwWindowsError("Error converting string to UTF-8: ", "WideCharToMultiByte");
-            }
-        } catch (...) {
-            if (result != NULL) {
-                delete [] result;
-            }
-            throw;
-        }
-        return result;
-    }
-
-    inline wchar_t* newUtf16(const char* utf8) {
-        wchar_t* result = NULL;
-        try {
-            int utf16BufLen = MultiByteToWideChar(CP_UTF8, 0, utf8, -1, NULL, 0);
-            if (utf16BufLen == 0) {
-                throwWindowsError("Error converting string to UTF-16: ", "MultiByteToWideChar");
-            }
-            result = new wchar_t[utf16BufLen];
-            int conversionResult = MultiByteToWideChar(CP_UTF8, 0, utf8, -1, result, utf16BufLen);
-            if (conversionResult == 0) {
-                throwWindowsError("Error converting string to UTF-16: ", "MultiByteToWideChar");
-            }
-        } catch (...) {
-            if (result != NULL) {
-                delete [] result;
-            }
-            throw;
-        }
-        return result;
-    }
-
-    inline std::string toUtf8(const std::wstring& utf16) {
-        char* utf8 = newUtf8(utf16.c_str());
-        std::string result = utf8;
-        delete [] utf8;
-        return result;
-    }
-
-    inline std::wstring toUtf16(const std::string& utf8) {
-        wchar_t* utf16 = newUtf16(utf8.c_str());
-        std::wstring result = utf16;
-        delete [] utf16;
-        return result;
-    }
-
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN             
+#include <windows.h>
+
+#include <string.h>
+#include <stdexcept>
+#include <string>
+#include <sstream>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define UTIL_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace util {
+    class ErrorInfo : public std::runtime_error {
+    public: 
+        inline ErrorInfo(const std::string& errorMsg, int errorCode) : std::runtime_error(errorMsg) { 
+            this->errorCode = errorCode;
+        }
+
+        inline int getErrorCode() const {
+            return this->errorCode;
+        }
+
+    private:
+        std::string errorMessage;
+        int errorCode;
+    };
+
+    inline std::string getWindowsErrorMessage(const std::string& prepend, const std::string& funcName) {
+        DWORD error = GetLastError();
+
+        std::stringstream msg;
+        if (!prepend.empty()) {
+            msg << prepend << ": ";
+        }
+
+        char buffer[1024] = "";
+
+        if (FormatMessageA(
+                FORMAT_MESSAGE_FROM_SYSTEM |
+                FORMAT_MESSAGE_IGNORE_INSERTS,
+                NULL,
+                error,
+                0,
+                buffer, sizeof(buffer), NULL) == 0) {
+            msg << "Failed to retrieve Windows error message";
+        } else {
+            msg << funcName << " failed with " << error << ": " << buffer;
+        }
+        return msg.str();
+    }
+
+    inline std::string getWindowsErrorMessage(const std::string& funcName) {
+        return getWindowsErrorMessage(std::string(), funcName);
+    }
+
+    inline void throwWindowsError(const std::string& prepend, const std::string& funcName) {
+        throw std::runtime_error(getWindowsErrorMessage(prepend, funcName));
+    }
+
+    inline void throwWindowsError(const std::string& funcName) {
+        throwWindowsError(std::string(), funcName);
+    }
+
+    inline void checkWindowsResult(BOOL result, const std::string& prepend, const std::string& funcName) {
+        if (!result) {
+            throwWindowsError(prepend, funcName);
+        }
+    }
+
+    inline void checkWindowsResult(BOOL result, const std::string& funcName) {
+        checkWindowsResult(result, std::string(), funcName);
+    }
+
+    template <HANDLE INVALID_HANDLE> class ScopedHandleT
+    {
+    public:
+        ScopedHandleT() {
+            this->handle = INVALID_HANDLE;
+        }
+
+        ScopedHandleT(HANDLE handle) {
+            this->handle = handle;
+        }
+
+        ScopedHandleT& operator = (HANDLE otherHandle) {
+            if (this->handle != INVALID_HANDLE) {
+                CloseHandle(this->handle);
+            }
+            this->handle = otherHandle;
+            return *this;
+        }
+
+        virtual ~ScopedHandleT() {
+            if (handle != INVALID_HANDLE) {
+                CloseHandle(handle);
+            }
+        }
+
+        operator HANDLE () const {
+            return handle;
+        }
+
+        HANDLE release() {
+            HANDLE result = handle;
+            handle = INVALID_HANDLE;
+            return result;
+        }
+
+        void check(const std::string& prepend, const std::string& funcName) {
+            if (handle == INVALID_HANDLE) {
+                throwWindowsError(prepend, funcName);
+            }
+        }
+
+        void check(const std::string& funcName) {
+            check(std::string(), funcName);
+        }
+
+    private:
+        HANDLE handle;
+    };
+
+    typedef ScopedHandleT<NULL> ScopedHandle;
+    typedef ScopedHandleT<INVALID_HANDLE_VALUE> ScopedFileHandle;
+
+    // UTF-8 <-> UTF-16 conversion, done here rather than with WideCharToMultiByte/MultiByteToWideChar, which need a
+    // sizing pass and a temporary buffer.  Runs of ASCII, the common case for pipe names and error messages, are
+    // copied 16 characters at a time (with SSE2 where the compiler targets it); anything else is converted one code
+    // point at a time.  As with the Windows functions, unpaired surrogates and malformed UTF-8 become U+FFFD, one per
+    // maximal invalid subsequence.
+    namespace utf {
+        const unsigned int REPLACEMENT_CHAR = 0xfffd;
+
+        // Most UTF-8 bytes one wchar_t can need: a 16-bit unit needs at most 3 (a surrogate pair needs 4 for two units).
+        const size_t MAX_UTF8_PER_WCHAR = sizeof(wchar_t) == 2 ? 3 : 4;
+
+        // Narrows the leading ASCII characters of src into dest, returning how many there were.
+        inline size_t narrowAscii(const wchar_t* src, size_t length, char* dest) {
+            size_t i = 0;
+#ifdef UTIL_USE_SSE2
+            if (sizeof(wchar_t) == 2) {
+                const __m128i nonAsciiBits = _mm_set1_epi16((short)0xff80);
+                for (; i + 16 <= length; i += 16) {
+                    __m128i low = _mm_loadu_si128((const __m128i*)(src + i));
+                    __m128i high = _mm_loadu_si128((const __m128i*)(src + i + 8));
+                    __m128i nonAscii = _mm_and_si128(_mm_or_si128(low, high), nonAsciiBits);
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi16(nonAscii, _mm_setzero_si128())) != 0xffff) {
+                        break;
+                    }
+                    _mm_storeu_si128((__m128i*)(dest + i), _mm_packus_epi16(low, high));
+                }
+            }
+#endif
+            while (i < length && (unsigned int)src[i] < 0x80) {
+                dest[i] = (char)src[i];
+                i++;
+            }
+            return i;
+        }
+
+        // Widens the leading ASCII characters of src into dest, returning how many there were.
+        inline size_t widenAscii(const char* src, size_t length, wchar_t* dest) {
+            size_t i = 0;
+#ifdef UTIL_USE_SSE2
+            if (sizeof(wchar_t) == 2) {
+                for (; i + 16 <= length; i += 16) {
+                    __m128i bytes = _mm_loadu_si128((const __m128i*)(src + i));
+                    if (_mm_movemask_epi8(bytes) != 0) {
+                        break;
+                    }
+                    _mm_storeu_si128((__m128i*)(dest + i), _mm_unpacklo_epi8(bytes, _mm_setzero_si128()));
+                    _mm_storeu_si128((__m128i*)(dest + i + 8), _mm_unpackhi_epi8(bytes, _mm_setzero_si128()));
+                }
+            }
+#endif
+            while (i < length && (unsigned char)src[i] < 0x80) {
+                dest[i] = (wchar_t)src[i];
+                i++;
+            }
+            return i;
+        }
+
+        // dest needs room for length * MAX_UTF8_PER_WCHAR bytes.  Returns the number of bytes written.
+        inline size_t encodeUtf8(const wchar_t* src, size_t length, char* dest) {
+            char* out = dest;
+            size_t i = 0;
+            while (true) {
+                size_t asciiLen = narrowAscii(src + i, length - i, out);
+                i += asciiLen;
+                out += asciiLen;
+                if (i == length) {
+                    break;
+                }
+
+                unsigned int codePoint = (unsigned int)src[i++];
+                if (sizeof(wchar_t) == 2 && codePoint >= 0xd800 && codePoint <= 0xdbff && i < length &&
+                        (unsigned int)src[i] >= 0xdc00 && (unsigned int)src[i] <= 0xdfff) {
+                    codePoint = 0x10000 + ((codePoint - 0xd800) << 10) + ((unsigned int)src[i++] - 0xdc00);
+                } else if ((codePoint >= 0xd800 && codePoint <= 0xdfff) || codePoint > 0x10ffff) {
+                    codePoint = REPLACEMENT_CHAR;
+                }
+
+                if (codePoint < 0x800) {
+                    *out++ = (char)(0xc0 | (codePoint >> 6));
+                } else {
+                    if (codePoint < 0x10000) {
+                        *out++ = (char)(0xe0 | (codePoint >> 12));
+                    } else {
+                        *out++ = (char)(0xf0 | (codePoint >> 18));
+                        *out++ = (char)(0x80 | ((codePoint >> 12) & 0x3f));
+                    }
+                    *out++ = (char)(0x80 | ((codePoint >> 6) & 0x3f));
+                }
+                *out++ = (char)(0x80 | (codePoint & 0x3f));
+            }
+            return out - dest;
+        }
+
+        // dest needs room for length wchar_ts.  Returns the number written.
+        inline size_t decodeUtf8(const char* src, size_t length, wchar_t* dest) {
+            const unsigned char* bytes = (const unsigned char*)src;
+            wchar_t* out = dest;
+            size_t i = 0;
+            while (true) {
+                size_t asciiLen = widenAscii(src + i, length - i, out);
+                i += asciiLen;
+                out += asciiLen;
+                if (i == length) {
+                    break;
+                }
+
+                // Valid second-byte ranges follow table 3-7 of the Unicode standard, which rules out overlong
+                // forms, surrogates and code points above U+10FFFF.
+                unsigned int lead = bytes[i++];
+                unsigned int codePoint = 0;
+                size_t trailLen = 0;
+                unsigned int lower = 0x80;
+                unsigned int upper = 0xbf;
+                if (lead >= 0xc2 && lead <= 0xdf) {
+                    trailLen = 1;
+                    codePoint = lead & 0x1f;
+                } else if (lead >= 0xe0 && lead <= 0xef) {
+                    trailLen = 2;
+                    codePoint = lead & 0x0f;
+                    lower = lead == 0xe0 ? 0xa0 : 0x80;
+                    upper = lead == 0xed ? 0x9f : 0xbf;
+                } else if (lead >= 0xf0 && lead <= 0xf4) {
+                    trailLen = 3;
+                    codePoint = lead & 0x07;
+                    lower = lead == 0xf0 ? 0x90 : 0x80;
+                    upper = lead == 0xf4 ? 0x8f : 0xbf;
+                }
+
+                size_t trailRead = 0;
+                while (trailRead < trailLen && i < length && bytes[i] >= lower && bytes[i] <= upper) {
+                    codePoint = (codePoint << 6) | (bytes[i++] & 0x3f);
+                    trailRead++;
+                    lower = 0x80;
+                    upper = 0xbf;
+                }
+                if (trailLen == 0 || trailRead < trailLen) {
+                    // The byte that broke the sequence, if any, starts the next one.
+                    *out++ = (wchar_t)REPLACEMENT_CHAR;
+                } else if (sizeof(wchar_t) == 2 && codePoint >= 0x10000) {
+                    *out++ = (wchar_t)(0xd800 + ((codePoint - 0x10000) >> 10));
+                    *out++ = (wchar_t)(0xdc00 + ((codePoint - 0x10000) & 0x3ff));
+                } else {
+                    *out++ = (wchar_t)codePoint;
+                }
+            }
+            return out - dest;
+        }
+    }
+
+    // Like the null-terminated strings these once went through, the conversions stop at the first null character.
+    inline std::string toUtf8(const std::wstring& utf16) {
+        size_t length = utf16.find(L'\0');
+        if (length == std::wstring::npos) {
+            length = utf16.size();
+        }
+        std::string result;
+        if (length > 0) {
+            result.resize(length);
+            size_t asciiLen = utf::narrowAscii(utf16.data(), length, &result[0]);
+            if (asciiLen < length) {
+                result.resize(asciiLen + (length - asciiLen) * utf::MAX_UTF8_PER_WCHAR);
+                result.resize(asciiLen + utf::encodeUtf8(utf16.data() + asciiLen, length - asciiLen, &result[asciiLen]));
+            }
+        }
+        return result;
+    }
+
+    inline std::wstring toUtf16(const std::string& utf8) {
+        size_t length = utf8.find('\0');
+        if (length == std::string::npos) {
+            length = utf8.size();
+        }
+        std::wstring result;
+        if (length > 0) {
+            // A UTF-8 string never has fewer bytes than its UTF-16 form has units.
+            result.resize(length);
+            size_t asciiLen = utf::widenAscii(utf8.data(), length, &result[0]);
+            if (asciiLen < length) {
+                result.resize(asciiLen + utf::decodeUtf8(utf8.data() + asciiLen, length - asciiLen, &result[asciiLen]));
+            }
+        }
+        return result;
+    }
+
+    // Null-terminated copies, to be freed with delete [].
+    inline char* newUtf8(const wchar_t* utf16) {
+        std::string utf8 = toUtf8(utf16);
+        char* result = new char[utf8.size() + 1];
+        memcpy(result, utf8.c_str(), utf8.size() + 1);
+        return result;
+    }
+
+    inline wchar_t* newUtf16(const char* utf8) {
+        std::wstring utf16 = toUtf16(utf8);
+        wchar_t* result = new wchar_t[utf16.size() + 1];
+        memcpy(result, utf16.c_str(), (utf16.size() + 1) * sizeof(wchar_t));
+        return result;
+    }
+
 }
\ No newline at end of file
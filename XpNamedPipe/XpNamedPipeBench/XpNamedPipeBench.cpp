@@ -0,0 +1,917 @@
+// XpNamedPipeBench.cpp : Benchmarks for the XPNP C API.  Each scenario runs over real named pipes on this
+// machine, with the server side on threads of the same process:
+//
+//   connect      connections opened and accepted per second, and the latency of XPNP_openPipe
+//   latency      ping-pong round trips of framed messages, p50/p99/p999 per message size
+//   throughput   one-way framed message throughput from 64 bytes to 16 MB, with and without compression
+//   concurrency  ping-pong throughput and latency with 1 to maxThreads client threads, one connection each
+//   scaling      memory, handles, connect and accept latency, and idle-load echo latency as connections accumulate,
+//                up to maxConnections, served by one accepting thread and one selector; then the same server taking
+//                bursts of connections from 1 to maxThreads client threads at once
+//   utf          util's UTF-8/UTF-16 conversions timed against the Windows API (XpNamedPipeTest checks them)
+//
+// With no scenario named, all but scaling and utf run.  --json prints the results as one JSON document on stdout,
+// for comparing runs, instead of a line per result.
+//
+// Usage: XpNamedPipeBench [--json] [--threads maxThreads] [--connections maxConnections] [scenario ...]
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/barrier.hpp>
+
+#include "XpNamedPipe.h"
+#include "../XpNamedPipe/util.hpp"
+#include "../XpNamedPipeTest/utftest.hpp"
+
+const char* PIPE_BASE_NAME = "xpnpbench";
+const int ACCEPT_TIMEOUT_MSECS = 10000;
+
+const int CONNECT_COUNT = 2000;
+
+// Message counts are scaled so that each run moves about this much data, within the limits below.
+const double LATENCY_BYTES_PER_SIZE = 64.0 * 1024 * 1024;
+const int MIN_ROUND_TRIPS = 200;
+const int MAX_ROUND_TRIPS = 20000;
+const double THROUGHPUT_BYTES_PER_SIZE = 256.0 * 1024 * 1024;
+const int MIN_MESSAGES = 16;
+const int MAX_MESSAGES = 200000;
+
+const int CONCURRENCY_MESSAGE_SIZE = 1024;
+const int CONCURRENCY_ROUND_TRIPS = 2000;
+const int DEFAULT_MAX_THREADS = 64;
+
+// The scaling scenario reports every maxConnections / SCALING_STEPS connections.
+const int DEFAULT_MAX_CONNECTIONS = 10000;
+const int SCALING_STEPS = 10;
+const int SCALING_ECHO_SIZE = 64;
+const int SCALING_ECHO_ROUND_TRIPS = 1000;
+const int SCALING_BURST_CONNECTIONS_PER_THREAD = 16;
+const int SELECT_TIMEOUT_MSECS = 100;
+// Reads after a selector reports a pipe ready use this timeout, since a control frame alone can make it ready.
+const int READY_READ_TIMEOUT_MSECS = 10;
+const int MAX_READY_PIPES = 64;
+
+const int UTF_ITERATIONS = 200000;
+
+// Type definitions
+
+// One line of output: what was measured, and the numbers, in the order they were added.
+struct Result {
+    Result(const std::string& scenario, const std::string& label) : scenario(scenario), label(label) {
+    }
+
+    Result& add(const char* name, double value) {
+        values.push_back(std::make_pair(std::string(name), value));
+        return *this;
+    }
+
+    std::string scenario;
+    std::string label;
+    std::vector<std::pair<std::string, double> > values;
+};
+
+struct Options {
+    Options() : maxThreads(DEFAULT_MAX_THREADS), maxConnections(DEFAULT_MAX_CONNECTIONS) {
+    }
+
+    int maxThreads;
+    int maxConnections;
+};
+
+struct ProcessUsage {
+    ProcessUsage() : workingSetBytes(0), privateBytes(0), handles(0) {
+    }
+
+    double workingSetBytes;
+    double privateBytes;
+    double handles;
+};
+
+struct ConcurrencyClient {
+    ConcurrencyClient() : ok(false) {
+    }
+
+    std::vector<double> latencies;
+    bool ok;
+};
+
+struct BurstClient {
+    BurstClient() : ok(false) {
+    }
+
+    std::vector<XPNP_PipeHandle> pipes;
+    std::vector<double> latencies;
+    bool ok;
+};
+
+// Globals
+static std::vector<Result> GBL_results;
+static bool GBL_jsonOutput = false;
+
+// Keeps timed work from being optimized away.
+static volatile size_t GBL_sink = 0;
+
+// Local function definitions
+
+static std::string getErrorMessage() {
+    char buffer[1024] = "";
+    XPNP_getErrorMessage(buffer, sizeof(buffer));
+    return buffer;
+}
+
+static double getSeconds() {
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+static void report(const Result& result) {
+    GBL_results.push_back(result);
+    if (GBL_jsonOutput) {
+        return;
+    }
+    printf("%-12s %-14s", result.scenario.c_str(), result.label.c_str());
+    for (size_t i = 0; i < result.values.size(); i++) {
+        printf(" %s=%.6g", result.values[i].first.c_str(), result.values[i].second);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static void printJsonString(const std::string& value) {
+    putchar('"');
+    for (size_t i = 0; i < value.size(); i++) {
+        unsigned char c = (unsigned char)value[i];
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static void printJson() {
+    printf("{\"benchmark\":\"XpNamedPipeBench\",\"results\":[");
+    for (size_t i = 0; i < GBL_results.size(); i++) {
+        const Result& result = GBL_results[i];
+        printf(i == 0 ? "\n  {\"scenario\":" : ",\n  {\"scenario\":");
+        printJsonString(result.scenario);
+        printf(",\"label\":");
+        printJsonString(result.label);
+        for (size_t j = 0; j < result.values.size(); j++) {
+            printf(",");
+            printJsonString(result.values[j].first);
+            printf(":%.15g", result.values[j].second);
+        }
+        printf("}");
+    }
+    printf("\n]}\n");
+}
+
+static std::string formatSize(int size) {
+    char buffer[32] = "";
+    if (size >= 1024 * 1024 && size % (1024 * 1024) == 0) {
+        _snprintf_s(buffer, sizeof(buffer), _TRUNCATE, "%dM", size / (1024 * 1024));
+    } else if (size >= 1024 && size % 1024 == 0) {
+        _snprintf_s(buffer, sizeof(buffer), _TRUNCATE, "%dK", size / 1024);
+    } else {
+        _snprintf_s(buffer, sizeof(buffer), _TRUNCATE, "%d", size);
+    }
+    return buffer;
+}
+
+static int scaleCount(double totalBytes, int messageSize, int minCount, int maxCount) {
+    double count = totalBytes / messageSize;
+    return count < minCount ? minCount : (count > maxCount ? maxCount : (int)count);
+}
+
+// Sorts latencies (in seconds) and adds their mean, percentiles and maximum in microseconds, with names starting
+// with prefix if there is one.
+static void addLatencies(Result& result, const std::string& prefix, std::vector<double>& latencies) {
+    if (latencies.empty()) {
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    double sum = 0;
+    for (size_t i = 0; i < latencies.size(); i++) {
+        sum += latencies[i];
+    }
+    const double PERCENTILES[] = { 0.5, 0.99, 0.999 };
+    const char* NAMES[] = { "meanUsecs", "p50Usecs", "p99Usecs", "p999Usecs", "maxUsecs" };
+    double values[] = { sum / latencies.size(), 0, 0, 0, latencies.back() };
+    for (int i = 0; i < 3; i++) {
+        size_t index = (size_t)(PERCENTILES[i] * latencies.size());
+        values[i + 1] = latencies[index < latencies.size() ? index : latencies.size() - 1];
+    }
+    for (int i = 0; i < 5; i++) {
+        std::string name = NAMES[i];
+        if (!prefix.empty()) {
+            name = prefix + (char)toupper(name[0]) + name.substr(1);
+        }
+        result.add(name.c_str(), values[i] * 1e6);
+    }
+}
+
+static void addLatencies(Result& result, std::vector<double>& latencies) {
+    addLatencies(result, std::string(), latencies);
+}
+
+static XPNP_PipeHandle createListeningPipe(int options, std::string& pipeName) {
+    char pipeNameBuf[256] = "";
+    if (!XPNP_makePipeName(PIPE_BASE_NAME, 1, pipeNameBuf, sizeof(pipeNameBuf))) {
+        fprintf(stderr, "Failed to make pipe name: %s\n", getErrorMessage().c_str());
+        return NULL;
+    }
+    pipeName = pipeNameBuf;
+    XPNP_PipeHandle listeningPipe = XPNP_createPipeEx(pipeNameBuf, 1, options);
+    if (listeningPipe == NULL) {
+        fprintf(stderr, "Failed to create pipe: %s\n", getErrorMessage().c_str());
+    }
+    return listeningPipe;
+}
+
+// Log-like JSON records: highly compressible, but not a single repeated byte.
+static std::vector<char> makePayload(int size) {
+    std::string payload;
+    int record = 0;
+    while ((int)payload.size() < size) {
+        char line[256];
+        _snprintf_s(line, sizeof(line), _TRUNCATE,
+                "{\"seq\":%d,\"level\":\"INFO\",\"logger\":\"xpnp.bench\",\"msg\":\"request %d completed in %d ms\"}\n",
+                record, record * 7, record % 113);
+        payload.append(line);
+        record++;
+    }
+    return std::vector<char>(payload.begin(), payload.begin() + size);
+}
+
+// Sends every message back until the client closes the connection.
+static void echoLoop(XPNP_PipeHandle pipe) {
+    std::vector<char> buffer(4 * 1024);
+    while (true) {
+        int msgLen = 0;
+        int result = XPNP_readMessage(pipe, &buffer[0], (int)buffer.size(), &msgLen, -1);
+        if (result == -XPNP_ERROR_BUFFER_TOO_SMALL) {
+            buffer.resize(msgLen);
+            result = XPNP_readMessage(pipe, &buffer[0], (int)buffer.size(), &msgLen, -1);
+        }
+        if (result < 0 || XPNP_writeMessage(pipe, &buffer[0], msgLen) < 0) {
+            break;
+        }
+    }
+    XPNP_closePipe(pipe);
+}
+
+// Accepts clientCount connections and echoes on each, returning once all of them are closed.
+static void runEchoServer(XPNP_PipeHandle listeningPipe, int clientCount, bool* ok) {
+    *ok = true;
+    boost::thread_group echoThreads;
+    for (int i = 0; i < clientCount; i++) {
+        XPNP_PipeHandle pipe = XPNP_acceptConnection(listeningPipe, ACCEPT_TIMEOUT_MSECS);
+        if (pipe == NULL) {
+            fprintf(stderr, "Server failed to accept connection: %s\n", getErrorMessage().c_str());
+            *ok = false;
+            break;
+        }
+        echoThreads.add_thread(new boost::thread(echoLoop, pipe));
+    }
+    echoThreads.join_all();
+}
+
+// Runs roundTrips ping-pongs, adding the time of each to latencies.
+static bool pingPong(XPNP_PipeHandle pipe, int messageSize, int roundTrips, std::vector<double>& latencies) {
+    std::vector<char> payload = makePayload(messageSize);
+    std::vector<char> buffer(messageSize);
+    latencies.reserve(latencies.size() + roundTrips);
+    for (int i = 0; i < roundTrips; i++) {
+        int msgLen = 0;
+        double start = getSeconds();
+        if (XPNP_writeMessage(pipe, &payload[0], messageSize) < 0 ||
+                XPNP_readMessage(pipe, &buffer[0], messageSize, &msgLen, -1) < 0) {
+            fprintf(stderr, "Ping-pong failed: %s\n", getErrorMessage().c_str());
+            return false;
+        }
+        latencies.push_back(getSeconds() - start);
+    }
+    return true;
+}
+
+static void acceptAndClose(XPNP_PipeHandle listeningPipe, int count, bool* ok) {
+    *ok = false;
+    for (int i = 0; i < count; i++) {
+        XPNP_PipeHandle pipe = XPNP_acceptConnection(listeningPipe, ACCEPT_TIMEOUT_MSECS);
+        if (pipe == NULL) {
+            fprintf(stderr, "Server failed to accept connection: %s\n", getErrorMessage().c_str());
+            return;
+        }
+        XPNP_closePipe(pipe);
+    }
+    *ok = true;
+}
+
+static bool runConnect(int count) {
+    std::string pipeName;
+    XPNP_PipeHandle listeningPipe = createListeningPipe(0, pipeName);
+    if (listeningPipe == NULL) {
+        return false;
+    }
+
+    bool serverOk = false;
+    boost::thread server(acceptAndClose, listeningPipe, count, &serverOk);
+
+    std::vector<double> latencies;
+    latencies.reserve(count);
+    bool clientOk = true;
+    double start = getSeconds();
+    for (int i = 0; i < count; i++) {
+        double openStart = getSeconds();
+        XPNP_PipeHandle pipe = XPNP_openPipe(pipeName.c_str(), 1);
+        if (pipe == NULL) {
+            fprintf(stderr, "Failed to open pipe: %s\n", getErrorMessage().c_str());
+            clientOk = false;
+            break;
+        }
+        latencies.push_back(getSeconds() - openStart);
+        XPNP_closePipe(pipe);
+    }
+    double elapsed = getSeconds() - start;
+    if (!clientOk) {
+        XPNP_stopPipe(listeningPipe);
+    }
+    server.join();
+    XPNP_closePipe(listeningPipe);
+
+    if (clientOk && serverOk) {
+        Result result("connect", "open+close");
+        result.add("connections", count).add("seconds", elapsed).add("connectionsPerSec", count / elapsed);
+        addLatencies(result, latencies);
+        report(result);
+    }
+    return clientOk && serverOk;
+}
+
+static bool runLatency(int messageSize) {
+    std::string pipeName;
+    XPNP_PipeHandle listeningPipe = createListeningPipe(0, pipeName);
+    if (listeningPipe == NULL) {
+        return false;
+    }
+
+    bool serverOk = false;
+    boost::thread server(runEchoServer, listeningPipe, 1, &serverOk);
+
+    bool clientOk = false;
+    int roundTrips = scaleCount(LATENCY_BYTES_PER_SIZE, messageSize, MIN_ROUND_TRIPS, MAX_ROUND_TRIPS);
+    std::vector<double> latencies;
+    XPNP_PipeHandle pipe = XPNP_openPipe(pipeName.c_str(), 1);
+    if (pipe == NULL) {
+        fprintf(stderr, "Failed to open pipe: %s\n", getErrorMessage().c_str());
+        XPNP_stopPipe(listeningPipe);
+    } else {
+        // A few untimed round trips first, so that buffers and the echo thread are warmed up.
+        std::vector<double> warmup;
+        clientOk = pingPong(pipe, messageSize, 10, warmup) && pingPong(pipe, messageSize, roundTrips, latencies);
+        XPNP_closePipe(pipe);
+    }
+    server.join();
+    XPNP_closePipe(listeningPipe);
+
+    if (clientOk && serverOk) {
+        Result result("latency", formatSize(messageSize));
+        result.add("messageSize", messageSize).add("roundTrips", roundTrips);
+        addLatencies(result, latencies);
+        report(result);
+    }
+    return clientOk && serverOk;
+}
+
+static void readAndAck(XPNP_PipeHandle listeningPipe, int messageSize, int messageCount, bool* ok) {
+    *ok = false;
+    XPNP_PipeHandle pipe = XPNP_acceptConnection(listeningPipe, ACCEPT_TIMEOUT_MSECS);
+    if (pipe == NULL) {
+        fprintf(stderr, "Server failed to accept connection: %s\n", getErrorMessage().c_str());
+        return;
+    }
+    std::vector<char> buffer(messageSize);
+    int msgLen = 0;
+    for (int i = 0; i < messageCount; i++) {
+        if (XPNP_readMessage(pipe, &buffer[0], messageSize, &msgLen, -1) < 0) {
+            fprintf(stderr, "Server failed to read message: %s\n", getErrorMessage().c_str());
+            XPNP_closePipe(pipe);
+            return;
+        }
+    }
+    char ack = 1;
+    *ok = XPNP_writeMessage(pipe, &ack, sizeof(ack)) > 0;
+    XPNP_closePipe(pipe);
+}
+
+static bool runThroughput(const char* label, int options, int messageSize) {
+    std::string pipeName;
+    XPNP_PipeHandle listeningPipe = createListeningPipe(options, pipeName);
+    if (listeningPipe == NULL) {
+        return false;
+    }
+
+    int messageCount = scaleCount(THROUGHPUT_BYTES_PER_SIZE, messageSize, MIN_MESSAGES, MAX_MESSAGES);
+    bool serverOk = false;
+    boost::thread server(readAndAck, listeningPipe, messageSize, messageCount, &serverOk);
+
+    bool clientOk = false;
+    XPNP_PipeHandle pipe = XPNP_openPipeEx(pipeName.c_str(), 1, options);
+    if (pipe == NULL) {
+        fprintf(stderr, "Failed to open pipe: %s\n", getErrorMessage().c_str());
+        XPNP_stopPipe(listeningPipe);
+    } else {
+        std::vector<char> payload = makePayload(messageSize);
+        double start = getSeconds();
+        bool writeOk = true;
+        for (int i = 0; i < messageCount && writeOk; i++) {
+            writeOk = XPNP_writeMessage(pipe, &payload[0], messageSize) > 0;
+        }
+        char ack = 0;
+        int ackLen = 0;
+        if (!writeOk || XPNP_readMessage(pipe, &ack, sizeof(ack), &ackLen, -1) < 0) {
+            fprintf(stderr, "Client failed: %s\n", getErrorMessage().c_str());
+        } else {
+            double elapsed = getSeconds() - start;
+            double megabytes = (double)messageSize * messageCount / (1024 * 1024);
+            Result result("throughput", std::string(label) + " " + formatSize(messageSize));
+            result.add("messageSize", messageSize).add("messages", messageCount).add("seconds", elapsed)
+                    .add("mbPerSec", megabytes / elapsed).add("messagesPerSec", messageCount / elapsed);
+            report(result);
+            clientOk = true;
+        }
+        XPNP_closePipe(pipe);
+    }
+    server.join();
+    XPNP_closePipe(listeningPipe);
+    return clientOk && serverOk;
+}
+
+static void runConcurrencyClient(const std::string& pipeName, boost::barrier* start, ConcurrencyClient* client) {
+    XPNP_PipeHandle pipe = XPNP_openPipe(pipeName.c_str(), 1);
+    if (pipe == NULL) {
+        fprintf(stderr, "Failed to open pipe: %s\n", getErrorMessage().c_str());
+    }
+    // Every client waits here, even one that failed, so that the others are not left waiting for it.
+    start->wait();
+    if (pipe != NULL) {
+        client->ok = pingPong(pipe, CONCURRENCY_MESSAGE_SIZE, CONCURRENCY_ROUND_TRIPS, client->latencies);
+        XPNP_closePipe(pipe);
+    }
+}
+
+static bool runConcurrency(int threadCount) {
+    std::string pipeName;
+    XPNP_PipeHandle listeningPipe = createListeningPipe(0, pipeName);
+    if (listeningPipe == NULL) {
+        return false;
+    }
+
+    bool serverOk = false;
+    boost::thread server(runEchoServer, listeningPipe, threadCount, &serverOk);
+
+    boost::barrier start(threadCount + 1);
+    std::vector<ConcurrencyClient> clients(threadCount);
+    boost::thread_group clientThreads;
+    for (int i = 0; i < threadCount; i++) {
+        clientThreads.add_thread(new boost::thread(runConcurrencyClient, pipeName, &start, &clients[i]));
+    }
+    start.wait();
+    double startSeconds = getSeconds();
+    clientThreads.join_all();
+    double elapsed = getSeconds() - startSeconds;
+
+    bool clientsOk = true;
+    std::vector<double> latencies;
+    for (int i = 0; i < threadCount; i++) {
+        clientsOk = clientsOk && clients[i].ok;
+        latencies.insert(latencies.end(), clients[i].latencies.begin(), clients[i].latencies.end());
+    }
+    if (!clientsOk) {
+        XPNP_stopPipe(listeningPipe);
+    }
+    server.join();
+    XPNP_closePipe(listeningPipe);
+
+    if (clientsOk && serverOk) {
+        char label[32] = "";
+        _snprintf_s(label, sizeof(label), _TRUNCATE, "%d threads", threadCount);
+        double roundTrips = (double)threadCount * CONCURRENCY_ROUND_TRIPS;
+        Result result("concurrency", label);
+        result.add("threads", threadCount).add("messageSize", CONCURRENCY_MESSAGE_SIZE).add("roundTrips", roundTrips)
+                .add("seconds", elapsed).add("roundTripsPerSec", roundTrips / elapsed);
+        addLatencies(result, latencies);
+        report(result);
+    }
+    return clientsOk && serverOk;
+}
+
+// Serves the scaling scenario: one thread accepts connections and registers them with a selector, and another
+// echoes every message the selector reports.
+class ScalingServer {
+public:
+    ScalingServer(XPNP_SelectorHandle selector, XPNP_PipeHandle listeningPipe, int connectionCount) :
+            selector(selector), listeningPipe(listeningPipe), connectionCount(connectionCount), stopping(0),
+            acceptOk(false) {
+        acceptThread = boost::thread(&ScalingServer::acceptLoop, this);
+        echoThread = boost::thread(&ScalingServer::echoLoop, this);
+    }
+
+    // Returns whether every connection was accepted.  The clients must have connected or the listening pipe been
+    // stopped, or this waits for the accept to time out.
+    bool stop() {
+        acceptThread.join();
+        InterlockedExchange(&stopping, 1);
+        XPNP_selectorWakeup(selector);
+        echoThread.join();
+        for (size_t i = 0; i < pipes.size(); i++) {
+            XPNP_selectorUnregister(selector, pipes[i]);
+            XPNP_closePipe(pipes[i]);
+        }
+        return acceptOk;
+    }
+
+private:
+    void acceptLoop() {
+        for (int i = 0; i < connectionCount; i++) {
+            XPNP_PipeHandle pipe = XPNP_acceptConnection(listeningPipe, ACCEPT_TIMEOUT_MSECS);
+            if (pipe == NULL) {
+                fprintf(stderr, "Server failed to accept connection: %s\n", getErrorMessage().c_str());
+                return;
+            }
+            pipes.push_back(pipe);
+            if (!XPNP_selectorRegister(selector, pipe, XPNP_SELECT_READ)) {
+                fprintf(stderr, "Server failed to register connection: %s\n", getErrorMessage().c_str());
+                return;
+            }
+        }
+        acceptOk = true;
+    }
+
+    void echoLoop() {
+        std::vector<XPNP_PipeHandle> ready(MAX_READY_PIPES);
+        std::vector<char> buffer(4 * 1024);
+        while (stopping == 0) {
+            int readyCount = XPNP_select(selector, &ready[0], MAX_READY_PIPES, SELECT_TIMEOUT_MSECS);
+            for (int i = 0; i < readyCount; i++) {
+                // A pipe whose client has gone is left suspended until stop() unregisters it.
+                if (echo(ready[i], buffer)) {
+                    XPNP_selectorResume(selector, ready[i]);
+                }
+            }
+        }
+    }
+
+    static bool echo(XPNP_PipeHandle pipe, std::vector<char>& buffer) {
+        int msgLen = 0;
+        int result = XPNP_readMessage(pipe, &buffer[0], (int)buffer.size(), &msgLen, READY_READ_TIMEOUT_MSECS);
+        if (result == -XPNP_ERROR_BUFFER_TOO_SMALL) {
+            buffer.resize(msgLen);
+            result = XPNP_readMessage(pipe, &buffer[0], (int)buffer.size(), &msgLen, READY_READ_TIMEOUT_MSECS);
+        }
+        // Only a read that took nothing, as when a control frame alone made the pipe ready, may wait again; one
+        // that stopped partway through a message fails with XPNP_ERROR_PROTOCOL and leaves the pipe suspended.
+        if (result == -XPNP_ERROR_TIMEOUT) {
+            return true;
+        }
+        return result >= 0 && XPNP_writeMessage(pipe, &buffer[0], msgLen) > 0;
+    }
+
+    XPNP_SelectorHandle selector;
+    XPNP_PipeHandle listeningPipe;
+    int connectionCount;
+    volatile LONG stopping;
+    bool acceptOk;
+    std::vector<XPNP_PipeHandle> pipes;
+
+    boost::thread acceptThread;
+    boost::thread echoThread;
+};
+
+static ProcessUsage getProcessUsage() {
+    ProcessUsage usage;
+    PROCESS_MEMORY_COUNTERS counters;
+    memset(&counters, 0, sizeof(counters));
+    counters.cb = sizeof(counters);
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        usage.workingSetBytes = (double)counters.WorkingSetSize;
+        usage.privateBytes = (double)counters.PagefileUsage;
+    }
+    DWORD handleCount = 0;
+    if (GetProcessHandleCount(GetCurrentProcess(), &handleCount)) {
+        usage.handles = handleCount;
+    }
+    return usage;
+}
+
+// Adds the server's XPNP_acceptConnection latencies since the last call, from the listening pipe's histogram.
+// While clients are waiting these are the cost of the handshake; while they connect one at a time they also
+// include the wait for the next one.
+static void addAcceptLatencies(Result& result, XPNP_PipeHandle listeningPipe) {
+    const double PERCENTILES[] = { 50, 99, 99.9, 100 };
+    const char* NAMES[] = { "acceptP50Usecs", "acceptP99Usecs", "acceptP999Usecs", "acceptMaxUsecs" };
+    const int COUNT = sizeof(PERCENTILES) / sizeof(PERCENTILES[0]);
+    long long values[COUNT] = { 0 };
+    long long sampleCount = 0;
+    if (!XPNP_getLatencyPercentiles(listeningPipe, XPNP_LATENCY_ACCEPT, PERCENTILES, COUNT, values, &sampleCount, 1)) {
+        fprintf(stderr, "Failed to get accept latencies: %s\n", getErrorMessage().c_str());
+        return;
+    }
+    result.add("accepts", (double)sampleCount);
+    for (int i = 0; i < COUNT; i++) {
+        result.add(NAMES[i], (double)values[i]);
+    }
+}
+
+// Both ends of every connection are in this process, so the per-connection figures cover a client pipe and a
+// server pipe.
+static void reportScaling(int connections, const ProcessUsage& baseline, XPNP_PipeHandle listeningPipe,
+        std::vector<double>& connectLatencies, std::vector<double>& echoLatencies) {
+    ProcessUsage usage = getProcessUsage();
+    char label[32] = "";
+    _snprintf_s(label, sizeof(label), _TRUNCATE, "%d connections", connections);
+    Result result("scaling", label);
+    result.add("connections", connections).add("openPipes", XPNP_getOpenPipeCount())
+            .add("workingSetMb", usage.workingSetBytes / (1024 * 1024))
+            .add("privateMb", usage.privateBytes / (1024 * 1024))
+            .add("privateBytesPerConnection", (usage.privateBytes - baseline.privateBytes) / connections)
+            .add("handles", usage.handles)
+            .add("handlesPerConnection", (usage.handles - baseline.handles) / connections);
+    addLatencies(result, "connect", connectLatencies);
+    addAcceptLatencies(result, listeningPipe);
+    addLatencies(result, "echo", echoLatencies);
+    report(result);
+}
+
+static bool runScaling(int maxConnections) {
+    std::string pipeName;
+    XPNP_PipeHandle listeningPipe = createListeningPipe(0, pipeName);
+    if (listeningPipe == NULL) {
+        return false;
+    }
+    XPNP_SelectorHandle selector = XPNP_createSelector();
+    if (selector == NULL) {
+        fprintf(stderr, "Failed to create selector: %s\n", getErrorMessage().c_str());
+        XPNP_closePipe(listeningPipe);
+        return false;
+    }
+
+    ProcessUsage baseline = getProcessUsage();
+    ScalingServer server(selector, listeningPipe, maxConnections);
+
+    // Connect latencies are reported for the connections made since the previous report; the echo latency is
+    // measured on the newest connection while all the others sit idle.
+    int step = maxConnections / SCALING_STEPS;
+    bool clientOk = true;
+    std::vector<XPNP_PipeHandle> clientPipes;
+    std::vector<double> connectLatencies;
+    clientPipes.reserve(maxConnections);
+    while ((int)clientPipes.size() < maxConnections) {
+        double start = getSeconds();
+        XPNP_PipeHandle pipe = XPNP_openPipe(pipeName.c_str(), 1);
+        if (pipe == NULL) {
+            fprintf(stderr, "Failed to open connection %d: %s\n", (int)clientPipes.size() + 1,
+                    getErrorMessage().c_str());
+            clientOk = false;
+            break;
+        }
+        connectLatencies.push_back(getSeconds() - start);
+        clientPipes.push_back(pipe);
+
+        int connections = (int)clientPipes.size();
+        if (connections % step == 0 || connections == maxConnections) {
+            std::vector<double> echoLatencies;
+            if (!pingPong(pipe, SCALING_ECHO_SIZE, SCALING_ECHO_ROUND_TRIPS, echoLatencies)) {
+                clientOk = false;
+                break;
+            }
+            reportScaling(connections, baseline, listeningPipe, connectLatencies, echoLatencies);
+            connectLatencies.clear();
+        }
+    }
+
+    if (!clientOk) {
+        XPNP_stopPipe(listeningPipe);
+    }
+    for (size_t i = 0; i < clientPipes.size(); i++) {
+        XPNP_closePipe(clientPipes[i]);
+    }
+    bool serverOk = server.stop();
+    XPNP_closeSelector(selector);
+    XPNP_closePipe(listeningPipe);
+    return clientOk && serverOk;
+}
+
+static void runBurstClient(const std::string& pipeName, int connectionCount, boost::barrier* start,
+        BurstClient* client) {
+    start->wait();
+    for (int i = 0; i < connectionCount; i++) {
+        double openStart = getSeconds();
+        XPNP_PipeHandle pipe = XPNP_openPipe(pipeName.c_str(), 1);
+        if (pipe == NULL) {
+            fprintf(stderr, "Failed to open pipe: %s\n", getErrorMessage().c_str());
+            return;
+        }
+        client->latencies.push_back(getSeconds() - openStart);
+        client->pipes.push_back(pipe);
+    }
+    client->ok = true;
+}
+
+// Releases threadCount clients at once, each opening SCALING_BURST_CONNECTIONS_PER_THREAD connections in turn, at
+// the scaling scenario's server: one accepting thread, so the clients queue for it and retry while it is busy.
+static bool runScalingBurst(int threadCount) {
+    std::string pipeName;
+    XPNP_PipeHandle listeningPipe = createListeningPipe(0, pipeName);
+    if (listeningPipe == NULL) {
+        return false;
+    }
+    XPNP_SelectorHandle selector = XPNP_createSelector();
+    if (selector == NULL) {
+        fprintf(stderr, "Failed to create selector: %s\n", getErrorMessage().c_str());
+        XPNP_closePipe(listeningPipe);
+        return false;
+    }
+
+    int connectionCount = threadCount * SCALING_BURST_CONNECTIONS_PER_THREAD;
+    ScalingServer server(selector, listeningPipe, connectionCount);
+
+    boost::barrier start(threadCount + 1);
+    std::vector<BurstClient> clients(threadCount);
+    boost::thread_group clientThreads;
+    for (int i = 0; i < threadCount; i++) {
+        clientThreads.add_thread(new boost::thread(runBurstClient, pipeName, SCALING_BURST_CONNECTIONS_PER_THREAD,
+                &start, &clients[i]));
+    }
+    start.wait();
+    double startSeconds = getSeconds();
+    clientThreads.join_all();
+    double elapsed = getSeconds() - startSeconds;
+
+    bool clientsOk = true;
+    std::vector<double> latencies;
+    for (int i = 0; i < threadCount; i++) {
+        clientsOk = clientsOk && clients[i].ok;
+        latencies.insert(latencies.end(), clients[i].latencies.begin(), clients[i].latencies.end());
+    }
+    if (!clientsOk) {
+        XPNP_stopPipe(listeningPipe);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        for (size_t j = 0; j < clients[i].pipes.size(); j++) {
+            XPNP_closePipe(clients[i].pipes[j]);
+        }
+    }
+    bool serverOk = server.stop();
+
+    if (clientsOk && serverOk) {
+        char label[32] = "";
+        _snprintf_s(label, sizeof(label), _TRUNCATE, "burst %d threads", threadCount);
+        Result result("scaling", label);
+        result.add("threads", threadCount).add("connections", connectionCount).add("seconds", elapsed)
+                .add("connectionsPerSec", connectionCount / elapsed);
+        addLatencies(result, "connect", latencies);
+        addAcceptLatencies(result, listeningPipe);
+        report(result);
+    }
+    XPNP_closeSelector(selector);
+    XPNP_closePipe(listeningPipe);
+    return clientsOk && serverOk;
+}
+
+static void timeUtf(const char* label, const std::wstring& utf16, int iterations) {
+    std::string utf8 = utftest::windowsToUtf8(utf16);
+    size_t total = 0;
+
+    double start = getSeconds();
+    for (int i = 0; i < iterations; i++) {
+        total += utftest::windowsToUtf8(utf16).size() + utftest::windowsToUtf16(utf8).size();
+    }
+    double windowsElapsed = getSeconds() - start;
+
+    start = getSeconds();
+    for (int i = 0; i < iterations; i++) {
+        total += util::toUtf8(utf16).size() + util::toUtf16(utf8).size();
+    }
+    double utilElapsed = getSeconds() - start;
+
+    GBL_sink = total;
+    double nsecsPerCall = 1e9 / (2.0 * iterations);
+    Result result("utf", label);
+    result.add("chars", (double)utf16.size()).add("windowsNsecs", windowsElapsed * nsecsPerCall)
+            .add("utilNsecs", utilElapsed * nsecsPerCall).add("speedup", windowsElapsed / utilElapsed);
+    report(result);
+}
+
+static void runUtf(int iterations) {
+    const unsigned int MIXED[] = { 'P', 'i', 'p', 'e', ' ', 0xe9, 0x4e2d, 0x6587, ' ', 0x1f600, '!' };
+    std::wstring pipeName = L"\\\\.\\pipe\\S-1-5-21-3623811015-3361044348-30300820-1013\\historyminer";
+    std::wstring message = L"Failed to read message: ReadFile failed with 109: The pipe has been ended.";
+    std::wstring mixed;
+    for (int i = 0; i < 8; i++) {
+        mixed += utftest::fromCodePoints(MIXED, sizeof(MIXED) / sizeof(MIXED[0]));
+    }
+    std::wstring longAscii;
+    while (longAscii.size() < 4096) {
+        longAscii += message;
+    }
+
+    timeUtf("pipe name", pipeName, iterations);
+    timeUtf("message", message, iterations);
+    timeUtf("mixed", mixed, iterations);
+    timeUtf("long ascii", longAscii, iterations / 10);
+}
+
+static bool runScenario(const std::string& scenario, const Options& options) {
+    const int LATENCY_SIZES[] = { 64, 1024, 16 * 1024, 256 * 1024, 1024 * 1024 };
+    const int THROUGHPUT_SIZES[] = { 64, 1024, 16 * 1024, 256 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024 };
+
+    bool ok = true;
+    if (scenario == "connect") {
+        ok = runConnect(CONNECT_COUNT);
+    } else if (scenario == "latency") {
+        for (int i = 0; i < (int)(sizeof(LATENCY_SIZES) / sizeof(LATENCY_SIZES[0])); i++) {
+            ok = runLatency(LATENCY_SIZES[i]) && ok;
+        }
+    } else if (scenario == "throughput") {
+        for (int i = 0; i < (int)(sizeof(THROUGHPUT_SIZES) / sizeof(THROUGHPUT_SIZES[0])); i++) {
+            ok = runThroughput("raw", 0, THROUGHPUT_SIZES[i]) && ok;
+            ok = runThroughput("compressed", XPNP_OPTION_COMPRESSION, THROUGHPUT_SIZES[i]) && ok;
+        }
+    } else if (scenario == "concurrency") {
+        for (int threadCount = 1; threadCount <= options.maxThreads; threadCount *= 2) {
+            ok = runConcurrency(threadCount) && ok;
+        }
+    } else if (scenario == "scaling") {
+        // The accept latencies come from the library's histograms.
+        XPNP_setLatencyHistograms(1);
+        ok = runScaling(options.maxConnections);
+        for (int threadCount = 1; threadCount <= options.maxThreads; threadCount *= 2) {
+            ok = runScalingBurst(threadCount) && ok;
+        }
+        XPNP_setLatencyHistograms(0);
+    } else if (scenario == "utf") {
+        runUtf(UTF_ITERATIONS);
+    } else {
+        fprintf(stderr, "Unknown scenario %s\n", scenario.c_str());
+        ok = false;
+    }
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> scenarios;
+    Options options;
+    bool usageError = false;
+    for (int i = 1; i < argc && !usageError; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            GBL_jsonOutput = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.maxThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            options.maxConnections = atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            usageError = true;
+        } else {
+            scenarios.push_back(argv[i]);
+        }
+    }
+    if (usageError || options.maxThreads <= 0 || options.maxConnections < SCALING_STEPS) {
+        fprintf(stderr, "Usage: XpNamedPipeBench [--json] [--threads maxThreads] [--connections maxConnections] "
+                "[connect|latency|throughput|concurrency|scaling|utf ...]\n");
+        return 2;
+    }
+    if (scenarios.empty()) {
+        scenarios.push_back("connect");
+        scenarios.push_back("latency");
+        scenarios.push_back("throughput");
+        scenarios.push_back("concurrency");
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < scenarios.size(); i++) {
+        ok = runScenario(scenarios[i], options) && ok;
+    }
+    if (GBL_jsonOutput) {
+        printJson();
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,223 @@
+// XpNamedPipeTest.cpp : Checks of the library that are awkward to make from Java.  Prints each failure and exits
+// with status 1 if there were any.
+//
+//   utf         util's UTF-8/UTF-16 conversions give the same results as the Windows API, for malformed input too
+//   broadcast   a full queue whose only message is being written drops the new message, over a real pipe
+//
+// Usage: XpNamedPipeTest
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <boost/thread/thread.hpp>
+
+#include "XpNamedPipe.h"
+#include "../XpNamedPipe/util.hpp"
+#include "utftest.hpp"
+
+const char* PIPE_BASE_NAME = "xpnptest";
+const int ACCEPT_TIMEOUT_MSECS = 10000;
+
+// Large enough that a write of it stays in progress while the peer does not read.
+const int STALLED_MESSAGE_SIZE = 1024 * 1024;
+const int STALL_MSECS = 200;
+const int DROPPED_READ_TIMEOUT_MSECS = 500;
+
+// Local function definitions
+
+static bool checkUtf(const char* label, const std::wstring& utf16) {
+    std::string utf8 = utftest::windowsToUtf8(utf16);
+    bool ok = true;
+    if (util::toUtf8(utf16) != utf8) {
+        fprintf(stderr, "FAIL utf %s: toUtf8 differs from WideCharToMultiByte\n", label);
+        ok = false;
+    }
+    if (util::toUtf16(utf8) != utftest::windowsToUtf16(utf8)) {
+        fprintf(stderr, "FAIL utf %s: toUtf16 differs from MultiByteToWideChar\n", label);
+        ok = false;
+    }
+    return ok;
+}
+
+// For UTF-8 that WideCharToMultiByte would never produce.
+static bool checkUtf8(const char* label, const std::string& utf8) {
+    if (util::toUtf16(utf8) != utftest::windowsToUtf16(utf8)) {
+        fprintf(stderr, "FAIL utf %s: toUtf16 differs from MultiByteToWideChar\n", label);
+        return false;
+    }
+    return true;
+}
+
+// Each malformed input is tried alone, where a truncated sequence is cut short by the end of the string, and
+// between ASCII, where it is cut short by the next character and the fast paths hand over to it and back.
+static bool checkMalformed(const char* label, const std::wstring& utf16) {
+    char fullLabel[64];
+    _snprintf_s(fullLabel, sizeof(fullLabel), _TRUNCATE, "%s in ascii", label);
+    bool ok = checkUtf(label, utf16);
+    return checkUtf(fullLabel, L"abc" + utf16 + L"def") && ok;
+}
+
+static bool checkMalformed(const char* label, const std::string& utf8) {
+    char fullLabel[64];
+    _snprintf_s(fullLabel, sizeof(fullLabel), _TRUNCATE, "%s in ascii", label);
+    bool ok = checkUtf8(label, utf8);
+    return checkUtf8(fullLabel, "abc" + utf8 + "def") && ok;
+}
+
+static bool testUtf() {
+    const unsigned int MIXED[] = { 'P', 'i', 'p', 'e', ' ', 0xe9, 0x4e2d, 0x6587, ' ', 0x1f600, '!' };
+    // The first and last code points of each UTF-8 length.
+    const unsigned int BOUNDARIES[] = { 0x01, 0x7f, 0x80, 0x7ff, 0x800, 0xd7ff, 0xe000, 0xfffd, 0x10000, 0x10ffff };
+    std::wstring pipeName = L"\\\\.\\pipe\\S-1-5-21-3623811015-3361044348-30300820-1013\\historyminer";
+    std::wstring message = L"Failed to read message: ReadFile failed with 109: The pipe has been ended.";
+    std::wstring mixed;
+    for (int i = 0; i < 8; i++) {
+        mixed += utftest::fromCodePoints(MIXED, sizeof(MIXED) / sizeof(MIXED[0]));
+    }
+    std::wstring longAscii;
+    while (longAscii.size() < 4096) {
+        longAscii += message;
+    }
+
+    bool ok = checkUtf("empty", std::wstring());
+    ok = checkUtf("pipe name", pipeName) && ok;
+    ok = checkUtf("message", message) && ok;
+    ok = checkUtf("mixed", mixed) && ok;
+    ok = checkUtf("boundaries", utftest::fromCodePoints(BOUNDARIES, sizeof(BOUNDARIES) / sizeof(BOUNDARIES[0]))) && ok;
+    ok = checkUtf("long ascii", longAscii) && ok;
+    ok = checkUtf("ascii+mixed", longAscii + mixed + longAscii) && ok;
+    // The ASCII fast paths work in blocks of 16, so non-ASCII text is tried at each offset within one.
+    for (int offset = 0; offset <= 32; offset++) {
+        char label[32];
+        _snprintf_s(label, sizeof(label), _TRUNCATE, "offset %d", offset);
+        ok = checkUtf(label, std::wstring(offset, L'a') + mixed) && ok;
+    }
+
+    // Malformed UTF-16, which both sides turn into U+FFFD.
+    ok = checkMalformed("lone high surrogate", std::wstring(1, (wchar_t)0xd83d)) && ok;
+    ok = checkMalformed("lone low surrogate", std::wstring(1, (wchar_t)0xde00)) && ok;
+    std::wstring reversedPair;
+    reversedPair += (wchar_t)0xde00;
+    reversedPair += (wchar_t)0xd83d;
+    ok = checkMalformed("reversed surrogate pair", reversedPair) && ok;
+    ok = checkUtf("embedded nul", std::wstring(L"before") + L'\0' + L"after") && ok;
+
+    // Malformed UTF-8, which both sides turn into U+FFFD, one per maximal invalid subsequence.
+    ok = checkMalformed("overlong 2-byte nul", std::string("\xc0\x80")) && ok;
+    ok = checkMalformed("overlong 3-byte nul", std::string("\xe0\x80\x80")) && ok;
+    ok = checkMalformed("overlong 4-byte", std::string("\xf0\x80\x80\xaf")) && ok;
+    ok = checkMalformed("encoded surrogate", std::string("\xed\xa0\x80")) && ok;
+    ok = checkMalformed("above U+10FFFF", std::string("\xf4\x90\x80\x80")) && ok;
+    ok = checkMalformed("lone continuation", std::string("\x80")) && ok;
+    ok = checkMalformed("invalid lead", std::string("\xff")) && ok;
+    ok = checkMalformed("truncated 2-byte", std::string("\xc3")) && ok;
+    ok = checkMalformed("truncated 3-byte", std::string("\xe4\xb8")) && ok;
+    ok = checkMalformed("truncated 4-byte", std::string("\xf0\x9f\x98")) && ok;
+    ok = checkUtf8("embedded nul", std::string("before\0after", 12)) && ok;
+    return ok;
+}
+
+static std::string getErrorMessage() {
+    char buffer[1024] = "";
+    XPNP_getErrorMessage(buffer, sizeof(buffer));
+    return buffer;
+}
+
+static void acceptOne(XPNP_PipeHandle listeningPipe, XPNP_PipeHandle* pipe) {
+    *pipe = XPNP_acceptConnection(listeningPipe, ACCEPT_TIMEOUT_MSECS);
+}
+
+// Sets server and client to the two ends of a new connection.
+static bool connect(XPNP_PipeHandle& server, XPNP_PipeHandle& client) {
+    char pipeName[256] = "";
+    if (!XPNP_makePipeName(PIPE_BASE_NAME, 1, pipeName, sizeof(pipeName))) {
+        fprintf(stderr, "Failed to make pipe name: %s\n", getErrorMessage().c_str());
+        return false;
+    }
+    XPNP_PipeHandle listeningPipe = XPNP_createPipe(pipeName, 1);
+    if (listeningPipe == NULL) {
+        fprintf(stderr, "Failed to create pipe: %s\n", getErrorMessage().c_str());
+        return false;
+    }
+    server = NULL;
+    boost::thread acceptor(acceptOne, listeningPipe, &server);
+    client = XPNP_openPipe(pipeName, 1);
+    if (client == NULL) {
+        fprintf(stderr, "Failed to open pipe: %s\n", getErrorMessage().c_str());
+    }
+    acceptor.join();
+    XPNP_closePipe(listeningPipe);
+    if (server == NULL || client == NULL) {
+        if (server != NULL) {
+            XPNP_closePipe(server);
+        }
+        if (client != NULL) {
+            XPNP_closePipe(client);
+        }
+        return false;
+    }
+    return true;
+}
+
+// Publishes twice to a subscriber that has room for one message and is not reading, so that the second publish
+// finds the queue full with the first message still being written.
+static bool testBroadcast() {
+    XPNP_PipeHandle server = NULL;
+    XPNP_PipeHandle client = NULL;
+    if (!connect(server, client)) {
+        fprintf(stderr, "FAIL broadcast: could not connect\n");
+        return false;
+    }
+    XPNP_BroadcastHandle broadcast = XPNP_createBroadcast(1, XPNP_BROADCAST_DROP_OLDEST);
+    if (broadcast == NULL || !XPNP_broadcastSubscribe(broadcast, server)) {
+        fprintf(stderr, "FAIL broadcast: could not subscribe: %s\n", getErrorMessage().c_str());
+        if (broadcast != NULL) {
+            XPNP_closeBroadcast(broadcast);
+        }
+        XPNP_closePipe(server);
+        XPNP_closePipe(client);
+        return false;
+    }
+
+    bool ok = true;
+    std::vector<char> first(STALLED_MESSAGE_SIZE, 'a');
+    char second = 'b';
+    XPNP_broadcastPublish(broadcast, &first[0], (int)first.size());
+    Sleep(STALL_MSECS);
+    XPNP_broadcastPublish(broadcast, &second, sizeof(second));
+
+    std::vector<char> buffer(STALLED_MESSAGE_SIZE);
+    int msgLen = 0;
+    if (XPNP_readMessage(client, &buffer[0], (int)buffer.size(), &msgLen, ACCEPT_TIMEOUT_MSECS) < 0) {
+        fprintf(stderr, "FAIL broadcast: reading the first message: %s\n", getErrorMessage().c_str());
+        ok = false;
+    } else if (msgLen != (int)first.size() || buffer != first) {
+        fprintf(stderr, "FAIL broadcast: the message being written was changed or replaced\n");
+        ok = false;
+    } else if (XPNP_readMessage(client, &buffer[0], (int)buffer.size(), &msgLen, DROPPED_READ_TIMEOUT_MSECS) !=
+            -XPNP_ERROR_TIMEOUT) {
+        fprintf(stderr, "FAIL broadcast: the message published into a full queue was not dropped\n");
+        ok = false;
+    }
+    XPNP_PipeHandle failed = NULL;
+    if (!XPNP_broadcastTakeFailed(broadcast, &failed) || failed != NULL) {
+        fprintf(stderr, "FAIL broadcast: the subscriber was dropped\n");
+        ok = false;
+    }
+
+    XPNP_broadcastUnsubscribe(broadcast, server);
+    XPNP_closeBroadcast(broadcast);
+    XPNP_closePipe(server);
+    XPNP_closePipe(client);
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    bool ok = testUtf();
+    ok = testBroadcast() && ok;
+    printf(ok ? "All tests passed\n" : "Tests failed\n");
+    return ok ? 0 : 1;
+}
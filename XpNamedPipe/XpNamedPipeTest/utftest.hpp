@@ -0,0 +1,41 @@
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#include <string>
+#include <vector>
+
+// Helpers shared by XpNamedPipeTest, which checks util's UTF-8/UTF-16 conversions against the Windows API, and
+// XpNamedPipeBench, which times them against it.
+
+namespace utftest {
+    // The conversions as util did them before it had its own: a sizing pass, a temporary buffer and a copy.  Like
+    // util's, they stop at the first null character.
+    inline std::string windowsToUtf8(const std::wstring& utf16) {
+        int utf8BufLen = WideCharToMultiByte(CP_UTF8, 0, utf16.c_str(), -1, NULL, 0, NULL, NULL);
+        std::vector<char> utf8(utf8BufLen);
+        WideCharToMultiByte(CP_UTF8, 0, utf16.c_str(), -1, &utf8[0], utf8BufLen, NULL, NULL);
+        return &utf8[0];
+    }
+
+    inline std::wstring windowsToUtf16(const std::string& utf8) {
+        int utf16BufLen = MultiByteToWideChar(CP_UTF8, 0, utf8.c_str(), -1, NULL, 0);
+        std::vector<wchar_t> utf16(utf16BufLen);
+        MultiByteToWideChar(CP_UTF8, 0, utf8.c_str(), -1, &utf16[0], utf16BufLen);
+        return &utf16[0];
+    }
+
+    inline std::wstring fromCodePoints(const unsigned int* codePoints, int count) {
+        std::wstring result;
+        for (int i = 0; i < count; i++) {
+            if (codePoints[i] >= 0x10000) {
+                result += (wchar_t)(0xd800 + ((codePoints[i] - 0x10000) >> 10));
+                result += (wchar_t)(0xdc00 + ((codePoints[i] - 0x10000) & 0x3ff));
+            } else {
+                result += (wchar_t)codePoints[i];
+            }
+        }
+        return result;
+    }
+}
@@ -1,22 +1,21 @@
-package xpnp;
-
-import java.io.IOException;
-
-public class TimeoutException extends IOException {
-
-    public TimeoutException() {
-    }
-
-    public TimeoutException(String arg0) {
-        super(arg0);
-    }
-
-    public TimeoutException(Throwable arg0) {
-        super(arg0);
-    }
-
-    public TimeoutException(String arg0, Throwable arg1) {
-        super(arg0, arg1);
-    }
-
-}
+package xpnp;
+
+public class TimeoutException extends XpnpException {
+
+    public TimeoutException() {
+        super(null, ERROR_TIMEOUT);
+    }
+
+    public TimeoutException(String arg0) {
+        super(arg0, ERROR_TIMEOUT);
+    }
+
+    public TimeoutException(Throwable arg0) {
+        super(arg0 == null ? null : arg0.toString(), ERROR_TIMEOUT, arg0);
+    }
+
+    public TimeoutException(String arg0, Throwable arg1) {
+        super(arg0, ERROR_TIMEOUT, arg1);
+    }
+
+}
@@ -1,163 +1,414 @@
-package xpnp;
-
-import java.io.IOException;
-import java.nio.ByteBuffer;
-
-public class XpNamedPipe {
-    private final static int ERROR_CODE_TIMEOUT = 1;
-
-    private long namedPipeHandle = 0;
-    
-    static {
-        try {
-            System.loadLibrary("XpNamedPipeJni");
-        } catch (Throwable t) {
-            System.loadLibrary("XpNamedPipeJni_64");
-        }
-    }
-    
-    public static XpNamedPipe createNamedPipe(String shortName, boolean privatePipe) throws IOException {
-        String pipeName = makePipeName(shortName, privatePipe);
-        if (pipeName == null) {
-            throw new IOException("Failed to make pipe name: " + getErrorMessage());
-        }
-        long pipeHandle = createPipe(pipeName, privatePipe);
-        if (pipeHandle == 0) {
-            throw new IOException("Failed to create named pipe: " + getErrorMessage());
-        }
-        return new XpNamedPipe(pipeHandle);
-    }
-    
-    public static XpNamedPipe openNamedPipe(String shortName, boolean privatePipe) throws IOException {
-        String pipeName = makePipeName(shortName, privatePipe);
-        if (pipeName == null) {
-            throw new IOException("Failed to make pipe name: " + getErrorMessage());
-        }
-        long pipeHandle = openPipe(pipeName, privatePipe);
-        if (pipeHandle == 0) {
-            throw new IOException("Failed to open named pipe: " + getErrorMessage());
-        }
-        return new XpNamedPipe(pipeHandle);
-    }
-    
-    public static void startProcess(String commandLine, String workingDirectory) throws IOException {
-        if (!createProcess(commandLine, workingDirectory)) {
-            throw new IOException("Failed to start process: " + getErrorMessage());
-        }
-    }
-    
-    public void stop() throws IOException {
-        if (!stopPipe(namedPipeHandle)) {
-            throw new IOException("Failed to stop pipe: " + getErrorMessage());
-        }
-    }
-    
-    public synchronized void close() {
-        if (namedPipeHandle != 0) {
-            closePipe(namedPipeHandle);
-            namedPipeHandle = 0;
-        }
-    }
-    
-    public XpNamedPipe acceptConnection() throws IOException {
-        return acceptConnection(-1);
-    }
-    
-    public XpNamedPipe acceptConnection(int timeoutMsecs) throws TimeoutException, IOException {
-        long pipeHandle = acceptConnection(namedPipeHandle, timeoutMsecs);
-        if (pipeHandle == 0) {
-            if (getErrorCode() == ERROR_CODE_TIMEOUT) {
-                throw new TimeoutException("Timeout waiting for client to connect: " + getErrorMessage());
-            }
-            throw new IOException("Failed to accept connection: " + getErrorMessage());
-        }
-        return new XpNamedPipe(pipeHandle);
-    }
-    
-    public int read(byte[] buffer) throws TimeoutException, IOException  {
-        return read(buffer, -1);
-    }
-    
-    public int read(byte[] buffer, int timeoutMsecs) throws TimeoutException, IOException  {
-        int bytesRead = readPipe(namedPipeHandle, buffer, timeoutMsecs);
-        if (bytesRead == 0) {
-            if (getErrorCode() == ERROR_CODE_TIMEOUT) {
-                throw new TimeoutException("Timeout waiting for data: " + getErrorMessage());
-            }
-            throw new IOException("Failed to read pipe: " + getErrorMessage());
-        }
-        return bytesRead;
-    }
-   
-    public void readBytes(byte[] buffer, int bytesToRead) throws TimeoutException, IOException  {
-        readBytes(buffer, bytesToRead, -1);
-    }
-    
-    public void readBytes(byte[] buffer, int bytesToRead, int timeoutMsecs) throws TimeoutException, IOException  {
-        if (!readBytes(namedPipeHandle, buffer, bytesToRead, timeoutMsecs)) {
-            if (getErrorCode() == ERROR_CODE_TIMEOUT) {
-                throw new TimeoutException("Timeout waiting for data: " + getErrorMessage());
-            }
-            throw new IOException("Failed to read bytes: " + getErrorMessage());
-        }
-    }
-    
-    public byte[] readMessage() throws TimeoutException, IOException  {
-        return readMessage(-1);
-    }
-    
-    public byte[] readMessage(int timeoutMsecs) throws TimeoutException, IOException  {
-        ByteBuffer lengthBuffer = ByteBuffer.allocate(4);
-        readBytes(lengthBuffer.array(), 4, timeoutMsecs);
-        int length = lengthBuffer.getInt();
-        byte[] buffer = new byte[length];
-        readBytes(buffer, length, timeoutMsecs);
-        return buffer;
-    }
-    
-    public void writeMessage(byte[] buffer) throws IOException {
-        ByteBuffer lengthBuffer = ByteBuffer.allocate(4);
-        lengthBuffer.putInt(buffer.length);
-        write(lengthBuffer.array());
-        write(buffer);
-    }
-    
-    public void write(byte[] buffer) throws IOException {
-        if (!writePipe(namedPipeHandle, buffer)) {
-            throw new IOException("Failed to write to pipe: " + getErrorMessage());
-        }
-    }
-    private XpNamedPipe(long pipeHandle) {
-        this.namedPipeHandle = pipeHandle;
-    }
-    
-    @Override 
-    protected void finalize() {
-        close();
-    }
-    
-    private static native String makePipeName(String shortName, boolean userLocal);
-
-    private static native String getErrorMessage();
-    
-    private static native int getErrorCode();
-    
-    private static native long createPipe(String fullName, boolean privatePipe);
-    
-    private static native boolean stopPipe(long pipeHandle);
-
-    private static native boolean closePipe(long pipeHandle);
-    
-    private static native long acceptConnection(long pipeHandle, int timeoutMsecs);
-    
-    private static native int readPipe(long pipeHandle, byte[] buffer, int timeoutMsecs);
-    
-    private static native boolean readBytes(long pipeHandle, byte[] buffer, int bytesToRead, int timeoutMsecs);
-
-    private static native long openPipe(String fullName, boolean privatePipe);
-
-    private static native boolean writePipe(long pipeHandle, byte[] pipeMsg);
-    
-    private static native boolean createProcess(String commandLine, String workingDirectory);
-    
-}
+package xpnp;
+
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.ReadOnlyBufferException;
+import java.nio.charset.StandardCharsets;
+import java.util.concurrent.CompletableFuture;
+import java.util.concurrent.ConcurrentHashMap;
+
+// Close a pipe when done with it.  One that becomes unreachable while still open is closed by XpnpCleaner, but only
+// once the garbage collector gets to it.
+public class XpNamedPipe implements AutoCloseable {
+    // Full pipe names resolved by the native code, as UTF-8, keyed by short name.  A process only ever uses a few
+    // names, so the caches are simply emptied if they grow past MAX_CACHED_NAMES.
+    private static final int MAX_CACHED_NAMES = 256;
+    private static final ConcurrentHashMap<String, byte[]> userLocalNames = new ConcurrentHashMap<>();
+    private static final ConcurrentHashMap<String, byte[]> globalNames = new ConcurrentHashMap<>();
+
+    private volatile long namedPipeHandle = 0;
+    private final XpnpCleaner.Cleanable cleanable;
+    
+    static {
+        try {
+            System.loadLibrary("XpNamedPipeJni");
+        } catch (Throwable t) {
+            System.loadLibrary("XpNamedPipeJni_64");
+        }
+    }
+    
+    public static XpNamedPipe createNamedPipe(String shortName, boolean privatePipe) throws IOException {
+        return new XpNamedPipe(createPipe(getPipeName(shortName, privatePipe), privatePipe));
+    }
+    
+    public static XpNamedPipe openNamedPipe(String shortName, boolean privatePipe) throws IOException {
+        return new XpNamedPipe(openPipe(getPipeName(shortName, privatePipe), privatePipe));
+    }
+    
+    public static void startProcess(String commandLine, String workingDirectory) throws IOException {
+        createProcess(commandLine, workingDirectory);
+    }
+    
+    public void stop() throws IOException {
+        stopPipe(namedPipeHandle);
+    }
+    
+    // Calls still in progress on the pipe are safe: the native side keeps the pipe until they return.  Pending async
+    // calls fail with an XpnpException.
+    @Override
+    public void close() {
+        namedPipeHandle = 0;
+        cleanable.clean();
+    }
+    
+    // The number of pipes open in this process (including listening pipes), counting any closed pipe that a call 
+    // in progress is still using.
+    public static int getOpenPipeCount() {
+        return openPipeCount();
+    }
+    
+    // Counts kept by the native library since the pipe was created.
+    public XpnpPipeStats getStats() throws IOException {
+        return new XpnpPipeStats(pipeStats(namedPipeHandle));
+    }
+    
+    // Latency histograms are off until turned on here; see XpnpLatencies for the operations timed.
+    public static void setLatencyHistograms(boolean enabled) {
+        enableLatencyHistograms(enabled);
+    }
+    
+    // Latencies of operation on this pipe at each of percentiles (0 to 100).  With reset, the histogram is 
+    // cleared as it is read.
+    public XpnpLatencies getLatencies(int operation, double[] percentiles, boolean reset) throws IOException {
+        return getLatencies(namedPipeHandle, operation, percentiles, reset);
+    }
+    
+    // As getLatencies, for all pipes in the process.
+    public static XpnpLatencies getProcessLatencies(int operation, double[] percentiles, boolean reset) 
+            throws IOException {
+        return getLatencies(0, operation, percentiles, reset);
+    }
+    
+    public XpNamedPipe acceptConnection() throws IOException {
+        return acceptConnection(-1);
+    }
+    
+    public XpNamedPipe acceptConnection(int timeoutMsecs) throws TimeoutException, IOException {
+        return new XpNamedPipe(acceptConnection(namedPipeHandle, timeoutMsecs));
+    }
+    
+    public int read(byte[] buffer) throws TimeoutException, IOException  {
+        return read(buffer, -1);
+    }
+    
+    public int read(byte[] buffer, int timeoutMsecs) throws TimeoutException, IOException  {
+        return read(buffer, 0, buffer.length, timeoutMsecs);
+    }
+    
+    public int read(byte[] buffer, int offset, int length) throws TimeoutException, IOException  {
+        return read(buffer, offset, length, -1);
+    }
+    
+    // Reads up to length bytes into buffer at offset; only the bytes received are copied into the array.
+    public int read(byte[] buffer, int offset, int length, int timeoutMsecs) throws TimeoutException, IOException  {
+        checkRegion(buffer, offset, length);
+        if (length == 0) {
+            return 0;
+        }
+        return readRegion(namedPipeHandle, buffer, offset, length, timeoutMsecs);
+    }
+   
+    public int read(ByteBuffer buffer) throws TimeoutException, IOException  {
+        return read(buffer, -1);
+    }
+    
+    // Reads into the buffer's remaining space and advances its position.  Direct buffers are read into in
+    // place; for heap buffers only the bytes received are copied into the backing array.
+    public int read(ByteBuffer buffer, int timeoutMsecs) throws TimeoutException, IOException  {
+        if (buffer.isReadOnly()) {
+            throw new ReadOnlyBufferException();
+        }
+        int position = buffer.position();
+        int length = buffer.remaining();
+        if (length == 0) {
+            return 0;
+        }
+        int bytesRead;
+        if (buffer.isDirect()) {
+            bytesRead = readDirect(namedPipeHandle, buffer, position, length, timeoutMsecs);
+        } else {
+            bytesRead = readRegion(namedPipeHandle, buffer.array(), buffer.arrayOffset() + position, length, timeoutMsecs);
+        }
+        buffer.position(position + bytesRead);
+        return bytesRead;
+    }
+   
+    public void readBytes(byte[] buffer, int bytesToRead) throws TimeoutException, IOException  {
+        readBytes(buffer, bytesToRead, -1);
+    }
+    
+    public void readBytes(byte[] buffer, int bytesToRead, int timeoutMsecs) throws TimeoutException, IOException  {
+        readBytes(buffer, 0, bytesToRead, timeoutMsecs);
+    }
+    
+    public void readBytes(byte[] buffer, int offset, int bytesToRead, int timeoutMsecs) throws TimeoutException, 
+            IOException  {
+        checkRegion(buffer, offset, bytesToRead);
+        if (bytesToRead > 0) {
+            readBytes(namedPipeHandle, buffer, offset, bytesToRead, timeoutMsecs);
+        }
+    }
+    
+    public byte[] readMessage() throws TimeoutException, IOException  {
+        return readMessage(-1);
+    }
+    
+    public byte[] readMessage(int timeoutMsecs) throws TimeoutException, IOException  {
+        return readMessage(namedPipeHandle, timeoutMsecs);
+    }
+    
+    // Reads a framed message into buffer at offset and returns its length.  If it is longer than length, this 
+    // fails with XpnpException.ERROR_BUFFER_TOO_SMALL and the message is kept for the next read.
+    public int readMessage(byte[] buffer, int offset, int length, int timeoutMsecs) throws TimeoutException, 
+            IOException  {
+        checkRegion(buffer, offset, length);
+        return readMessageInto(namedPipeHandle, buffer, offset, length, timeoutMsecs);
+    }
+    
+    public XpnpBuffer readMessage(XpnpBufferPool pool) throws TimeoutException, IOException  {
+        return readMessage(pool, -1);
+    }
+    
+    // Reads a framed message into a buffer taken from pool; the native code fills it directly, so once the pool 
+    // holds buffers of the sizes in use this allocates nothing.  Close the returned buffer when done with it.
+    public XpnpBuffer readMessage(XpnpBufferPool pool, int timeoutMsecs) throws TimeoutException, IOException  {
+        XpnpBuffer buffer = pool.acquire(pool.getLastMessageSize());
+        boolean received = false;
+        try {
+            while (true) {
+                ByteBuffer storage = buffer.getStorage();
+                int msgLen = readMessageDirect(namedPipeHandle, storage, storage.capacity(), timeoutMsecs);
+                if (msgLen >= 0) {
+                    pool.setLastMessageSize(msgLen);
+                    storage.clear();
+                    storage.limit(msgLen);
+                    received = true;
+                    return buffer;
+                }
+                // Too small; the message is kept for the next read.
+                buffer.close();
+                buffer = pool.acquire(-msgLen);
+            }
+        } finally {
+            if (!received) {
+                buffer.close();
+            }
+        }
+    }
+    
+    public void writeMessage(byte[] buffer) throws IOException {
+        writeMessage(buffer, 0, buffer.length);
+    }
+    
+    public void writeMessage(byte[] buffer, int offset, int length) throws IOException {
+        checkRegion(buffer, offset, length);
+        writeMessage(namedPipeHandle, buffer, offset, length);
+    }
+    
+    // The async forms return at once, and their futures are completed from native completion threads.  A pending 
+    // read or accept waits without holding any thread.  Stages added to a future without an executor run on a 
+    // completion thread, so they must not block.  Only one async read or accept may be pending on a pipe, and the 
+    // pipe must not be read until it completes; closing the pipe fails it.  A pipe with async calls pending stays 
+    // reachable, so it is not closed by XpnpCleaner meanwhile.  Writes are copied, so the array may be reused at 
+    // once, and go out in the order they were made.  A write the peer has not taken within 5 seconds fails with 
+    // TimeoutException, as do any queued behind it, since the connection can no longer be used.
+    public CompletableFuture<byte[]> readMessageAsync() {
+        CompletableFuture<byte[]> future = new CompletableFuture<byte[]>();
+        keepReachable(future);
+        try {
+            readMessageAsync(namedPipeHandle, future);
+        } catch (IOException e) {
+            future.completeExceptionally(e);
+        }
+        return future;
+    }
+    
+    public CompletableFuture<Void> writeMessageAsync(byte[] buffer) {
+        return writeMessageAsync(buffer, 0, buffer.length);
+    }
+    
+    public CompletableFuture<Void> writeMessageAsync(byte[] buffer, int offset, int length) {
+        checkRegion(buffer, offset, length);
+        CompletableFuture<Void> future = new CompletableFuture<Void>();
+        keepReachable(future);
+        try {
+            writeMessageAsync(namedPipeHandle, buffer, offset, length, future);
+        } catch (IOException e) {
+            future.completeExceptionally(e);
+        }
+        return future;
+    }
+    
+    public CompletableFuture<XpNamedPipe> acceptConnectionAsync() {
+        CompletableFuture<Long> future = new CompletableFuture<Long>();
+        keepReachable(future);
+        try {
+            acceptConnectionAsync(namedPipeHandle, future);
+        } catch (IOException e) {
+            future.completeExceptionally(e);
+        }
+        return future.thenApply(XpNamedPipe::new);
+    }
+    
+    public void write(byte[] buffer) throws IOException {
+        write(buffer, 0, buffer.length);
+    }
+    
+    // Writes length bytes from buffer at offset; only those bytes are copied out of the array.
+    public void write(byte[] buffer, int offset, int length) throws IOException {
+        checkRegion(buffer, offset, length);
+        if (length > 0) {
+            writeRegion(namedPipeHandle, buffer, offset, length);
+        }
+    }
+    
+    // Writes the buffer's remaining bytes and advances its position.  Direct buffers are written from in place;
+    // for heap buffers only the remaining bytes are copied out of the backing array.
+    public void write(ByteBuffer buffer) throws IOException {
+        int position = buffer.position();
+        int length = buffer.remaining();
+        if (length == 0) {
+            return;
+        }
+        if (buffer.isDirect()) {
+            writeDirect(namedPipeHandle, buffer, position, length);
+        } else if (buffer.hasArray()) {
+            writeRegion(namedPipeHandle, buffer.array(), buffer.arrayOffset() + position, length);
+        } else {
+            // A read-only heap buffer does not expose its array.
+            byte[] data = new byte[length];
+            buffer.duplicate().get(data);
+            writeRegion(namedPipeHandle, data, 0, length);
+        }
+        buffer.position(position + length);
+    }
+    
+    long getHandle() {
+        return namedPipeHandle;
+    }
+    
+    private XpNamedPipe(long pipeHandle) {
+        this.namedPipeHandle = pipeHandle;
+        this.cleanable = XpnpCleaner.register(this, new PipeCloser(pipeHandle));
+    }
+    
+    // The native code holds a pending call's future, and through this stage the pipe, until the call completes.
+    private void keepReachable(CompletableFuture<?> future) {
+        future.whenComplete((result, error) -> getHandle());
+    }
+    
+    private static XpnpLatencies getLatencies(long pipeHandle, int operation, double[] percentiles, boolean reset) 
+            throws IOException {
+        double[] percentilesCopy = percentiles.clone();
+        return new XpnpLatencies(percentilesCopy, latencyPercentiles(pipeHandle, operation, percentilesCopy, reset));
+    }
+    
+    private static byte[] getPipeName(String shortName, boolean userLocal) throws IOException {
+        ConcurrentHashMap<String, byte[]> names = userLocal ? userLocalNames : globalNames;
+        byte[] pipeName = names.get(shortName);
+        if (pipeName == null) {
+            pipeName = makePipeName(shortName.getBytes(StandardCharsets.UTF_8), userLocal);
+            if (names.size() >= MAX_CACHED_NAMES) {
+                names.clear();
+            }
+            names.put(shortName, pipeName);
+        }
+        return pipeName;
+    }
+    
+    private static void checkRegion(byte[] buffer, int offset, int length) {
+        if (offset < 0 || length < 0 || offset > buffer.length - length) {
+            throw new IndexOutOfBoundsException("offset " + offset + ", length " + length + ", array length " 
+                    + buffer.length);
+        }
+    }
+    
+    // Holds only the handle, so that the cleaner does not keep the pipe reachable.
+    private static final class PipeCloser implements Runnable {
+        private final long pipeHandle;
+        
+        PipeCloser(long pipeHandle) {
+            this.pipeHandle = pipeHandle;
+        }
+        
+        @Override
+        public void run() {
+            closePipe(pipeHandle);
+        }
+    }
+    
+    // Failures are thrown by the native code as XpnpException (TimeoutException for timeouts), carrying the
+    // library's error code, so no further native calls are needed to report them.
+    // Pipe names are passed as UTF-8 and used by the native code as they are.
+    private static native byte[] makePipeName(byte[] shortName, boolean userLocal) throws IOException;
+
+    private static native long createPipe(byte[] fullName, boolean privatePipe) throws IOException;
+    
+    private static native void stopPipe(long pipeHandle) throws IOException;
+
+    private static native boolean closePipe(long pipeHandle);
+    
+    private static native long acceptConnection(long pipeHandle, int timeoutMsecs) throws IOException;
+    
+    private static native void readBytes(long pipeHandle, byte[] buffer, int offset, int bytesToRead, int timeoutMsecs) 
+            throws IOException;
+
+    private static native long openPipe(byte[] fullName, boolean privatePipe) throws IOException;
+
+    private static native int readDirect(long pipeHandle, ByteBuffer buffer, int offset, int length, int timeoutMsecs) 
+            throws IOException;
+    
+    private static native void writeDirect(long pipeHandle, ByteBuffer buffer, int offset, int length) throws IOException;
+    
+    private static native int readRegion(long pipeHandle, byte[] buffer, int offset, int length, int timeoutMsecs) 
+            throws IOException;
+    
+    private static native void writeRegion(long pipeHandle, byte[] buffer, int offset, int length) throws IOException;
+    
+    private static native byte[] readMessage(long pipeHandle, int timeoutMsecs) throws IOException;
+    
+    private static native int readMessageInto(long pipeHandle, byte[] buffer, int offset, int length, int timeoutMsecs) 
+            throws IOException;
+    
+    private static native int readMessageDirect(long pipeHandle, ByteBuffer buffer, int length, int timeoutMsecs) 
+            throws IOException;
+    
+    private static native void writeMessage(long pipeHandle, byte[] buffer, int offset, int length) throws IOException;
+    
+    private static native void readMessageAsync(long pipeHandle, CompletableFuture<byte[]> future) throws IOException;
+    
+    private static native void writeMessageAsync(long pipeHandle, byte[] buffer, int offset, int length, 
+            CompletableFuture<Void> future) throws IOException;
+    
+    private static native void acceptConnectionAsync(long pipeHandle, CompletableFuture<Long> future) throws IOException;
+    
+    private static native void createProcess(String commandLine, String workingDirectory) throws IOException;
+    
+    private static native int openPipeCount();
+    
+    private static native long[] pipeStats(long pipeHandle) throws IOException;
+    
+    private static native void enableLatencyHistograms(boolean enabled);
+    
+    private static native long[] latencyPercentiles(long pipeHandle, int operation, double[] percentiles, 
+            boolean reset) throws IOException;
+    
+    // Used by XpnpSelector.
+    static native long createSelector() throws IOException;
+    
+    static native void closeSelector(long selectorHandle) throws IOException;
+    
+    static native void selectorRegister(long selectorHandle, long pipeHandle, int interest) throws IOException;
+    
+    static native void selectorUnregister(long selectorHandle, long pipeHandle) throws IOException;
+    
+    static native void selectorResume(long selectorHandle, long pipeHandle) throws IOException;
+    
+    static native int select(long selectorHandle, long[] ready, int timeoutMsecs) throws IOException;
+    
+    static native void selectorWakeup(long selectorHandle) throws IOException;
+    
+    // On by default; XpnpTransferBench turns it off to compare byte[] transfers staged on the heap.
+    static native void enableThreadScratch(boolean enabled);
+    
+}
@@ -0,0 +1,48 @@
+package xpnp;
+
+import java.nio.ByteBuffer;
+
+// A message received into a buffer from an XpnpBufferPool.  Closing it returns the buffer to the pool, after which 
+// neither it nor its ByteBuffer may be used.
+public class XpnpBuffer implements AutoCloseable {
+    private final XpnpBufferPool pool;
+    private final ByteBuffer storage;
+    private final int sizeClass;
+    private boolean released = false;
+    
+    XpnpBuffer(XpnpBufferPool pool, ByteBuffer storage, int sizeClass) {
+        this.pool = pool;
+        this.storage = storage;
+        this.sizeClass = sizeClass;
+    }
+    
+    // The message, from position 0 to the limit.
+    public ByteBuffer getBuffer() {
+        return storage;
+    }
+    
+    public int getLength() {
+        return storage.limit();
+    }
+    
+    @Override
+    public void close() {
+        if (!released) {
+            released = true;
+            pool.release(this);
+        }
+    }
+    
+    ByteBuffer getStorage() {
+        return storage;
+    }
+    
+    int getSizeClass() {
+        return sizeClass;
+    }
+    
+    void reuse() {
+        released = false;
+        storage.clear();
+    }
+}
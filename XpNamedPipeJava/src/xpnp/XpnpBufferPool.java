@@ -0,0 +1,78 @@
+package xpnp;
+
+import java.nio.ByteBuffer;
+import java.util.ArrayDeque;
+import java.util.ArrayList;
+
+// Direct buffers for XpNamedPipe.readMessage(XpnpBufferPool), reused so that receiving does not allocate.  Buffers 
+// come in power-of-two sizes from minBufferSize up, and up to maxPooled of each size are kept once released.  A 
+// pool may be shared by any number of pipes and threads.
+public class XpnpBufferPool {
+    private final int minBufferSize;
+    private final int maxPooled;
+    private final ArrayList<ArrayDeque<XpnpBuffer>> freeBuffers = new ArrayList<ArrayDeque<XpnpBuffer>>();
+    // The last message received, so that the next read starts with a buffer likely to fit.
+    private volatile int lastMessageSize;
+    
+    public XpnpBufferPool() {
+        this(4096, 64);
+    }
+    
+    public XpnpBufferPool(int minBufferSize, int maxPooled) {
+        if (minBufferSize <= 0 || Integer.bitCount(minBufferSize) != 1) {
+            throw new IllegalArgumentException("minBufferSize must be a power of two");
+        }
+        if (maxPooled < 0) {
+            throw new IllegalArgumentException("maxPooled < 0");
+        }
+        this.minBufferSize = minBufferSize;
+        this.maxPooled = maxPooled;
+        this.lastMessageSize = minBufferSize;
+    }
+    
+    // Returns a buffer with room for at least size bytes.
+    public XpnpBuffer acquire(int size) {
+        int sizeClass = getSizeClass(size);
+        synchronized (freeBuffers) {
+            if (sizeClass < freeBuffers.size()) {
+                XpnpBuffer buffer = freeBuffers.get(sizeClass).pollLast();
+                if (buffer != null) {
+                    buffer.reuse();
+                    return buffer;
+                }
+            }
+        }
+        return new XpnpBuffer(this, ByteBuffer.allocateDirect(minBufferSize << sizeClass), sizeClass);
+    }
+    
+    void release(XpnpBuffer buffer) {
+        synchronized (freeBuffers) {
+            while (freeBuffers.size() <= buffer.getSizeClass()) {
+                freeBuffers.add(new ArrayDeque<XpnpBuffer>());
+            }
+            ArrayDeque<XpnpBuffer> free = freeBuffers.get(buffer.getSizeClass());
+            if (free.size() < maxPooled) {
+                free.addLast(buffer);
+            }
+        }
+    }
+    
+    int getLastMessageSize() {
+        return lastMessageSize;
+    }
+    
+    void setLastMessageSize(int size) {
+        lastMessageSize = size;
+    }
+    
+    private int getSizeClass(int size) {
+        int sizeClass = 0;
+        while ((minBufferSize << sizeClass) < size) {
+            if ((minBufferSize << sizeClass) >= (1 << 30)) {
+                throw new IllegalArgumentException("Buffer size " + size + " too large");
+            }
+            sizeClass++;
+        }
+        return sizeClass;
+    }
+}
@@ -0,0 +1,55 @@
+package xpnp;
+
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.channels.ByteChannel;
+import java.nio.channels.ClosedChannelException;
+
+// A blocking ByteChannel over a pipe.  Each read or write is one native call; direct buffers are read into and 
+// written from in place.  Closing the channel closes the pipe.
+public class XpnpChannel implements ByteChannel {
+    private final XpNamedPipe pipe;
+    private volatile boolean open = true;
+
+    public XpnpChannel(XpNamedPipe pipe) {
+        this.pipe = pipe;
+    }
+
+    // Returns -1 once the peer has closed the pipe.
+    public int read(ByteBuffer buffer) throws IOException {
+        checkOpen();
+        if (!buffer.hasRemaining()) {
+            return 0;
+        }
+        try {
+            return pipe.read(buffer);
+        } catch (XpnpException e) {
+            if (e.getErrorCode() == XpnpException.ERROR_PIPE_CLOSED) {
+                return -1;
+            }
+            throw e;
+        }
+    }
+
+    public int write(ByteBuffer buffer) throws IOException {
+        checkOpen();
+        int length = buffer.remaining();
+        pipe.write(buffer);
+        return length;
+    }
+
+    public boolean isOpen() {
+        return open;
+    }
+
+    public void close() {
+        open = false;
+        pipe.close();
+    }
+
+    private void checkOpen() throws ClosedChannelException {
+        if (!open) {
+            throw new ClosedChannelException();
+        }
+    }
+}
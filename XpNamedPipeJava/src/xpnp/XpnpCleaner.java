@@ -0,0 +1,66 @@
+package xpnp;
+
+import java.lang.ref.PhantomReference;
+import java.lang.ref.ReferenceQueue;
+import java.util.Collections;
+import java.util.Set;
+import java.util.concurrent.ConcurrentHashMap;
+
+// Releases the native resources of objects that become unreachable without being closed, in the way 
+// java.lang.ref.Cleaner does on later Java versions.  Unlike finalize(), this does not hold the objects for an 
+// extra collection: only a phantom reference is queued, and one daemon thread runs the cleanup actions.  An 
+// action must not refer to the object it cleans up after, or the object never becomes unreachable.
+final class XpnpCleaner {
+    interface Cleanable {
+        // Runs the action, unless it has already run.
+        void clean();
+    }
+    
+    private static final ReferenceQueue<Object> queue = new ReferenceQueue<Object>();
+    // Keeps the references themselves reachable until they are cleaned.
+    private static final Set<CleanerReference> references = 
+            Collections.newSetFromMap(new ConcurrentHashMap<CleanerReference, Boolean>());
+    
+    static {
+        Thread thread = new Thread(new Runnable() {
+            @Override
+            public void run() {
+                while (true) {
+                    try {
+                        ((CleanerReference)queue.remove()).clean();
+                    } catch (Throwable t) {
+                        // Keep cleaning up after the rest.
+                    }
+                }
+            }
+        }, "xpnp-cleaner");
+        thread.setDaemon(true);
+        thread.start();
+    }
+    
+    private XpnpCleaner() {
+    }
+    
+    static Cleanable register(Object referent, Runnable action) {
+        CleanerReference reference = new CleanerReference(referent, action);
+        references.add(reference);
+        return reference;
+    }
+    
+    private static final class CleanerReference extends PhantomReference<Object> implements Cleanable {
+        private final Runnable action;
+        
+        CleanerReference(Object referent, Runnable action) {
+            super(referent, queue);
+            this.action = action;
+        }
+        
+        @Override
+        public void clean() {
+            if (references.remove(this)) {
+                clear();
+                action.run();
+            }
+        }
+    }
+}
@@ -0,0 +1,34 @@
+package xpnp;
+
+import java.io.IOException;
+
+/**
+ * A failed pipe operation, with the library's error code saying what kind of failure it was.
+ */
+public class XpnpException extends IOException {
+    public static final int ERROR_TIMEOUT = 1;
+    public static final int ERROR_BUFFER_TOO_SMALL = 2;
+    public static final int ERROR_PIPE_CLOSED = 3;
+    public static final int ERROR_PEER_DEAD = 4;
+    public static final int ERROR_INTERRUPTED = 5;
+    public static final int ERROR_INVALID_ARGUMENT = 6;
+    public static final int ERROR_PROTOCOL = 7;
+    public static final int ERROR_SYSTEM = 8;
+
+    private final int errorCode;
+
+    public XpnpException(String message, int errorCode) {
+        super(message);
+        this.errorCode = errorCode;
+    }
+
+    public XpnpException(String message, int errorCode, Throwable cause) {
+        super(message, cause);
+        this.errorCode = errorCode;
+    }
+
+    public int getErrorCode() {
+        return errorCode;
+    }
+
+}
@@ -0,0 +1,95 @@
+package xpnp;
+
+import java.io.IOException;
+import java.io.InputStream;
+
+// A buffered InputStream over a pipe.  Each refill is one native call that takes whatever has arrived, up to the
+// buffer size, so single-byte and other small reads are served from the buffer.  Reads at least as large as the
+// buffer go straight into the caller's array.  Closing the stream closes the pipe.
+public class XpnpInputStream extends InputStream {
+    public static final int DEFAULT_BUFFER_SIZE = 8 * 1024;
+
+    private final XpNamedPipe pipe;
+    private final byte[] buffer;
+    private int position = 0;
+    private int count = 0;
+    private boolean endOfStream = false;
+
+    public XpnpInputStream(XpNamedPipe pipe) {
+        this(pipe, DEFAULT_BUFFER_SIZE);
+    }
+
+    public XpnpInputStream(XpNamedPipe pipe, int bufferSize) {
+        if (bufferSize <= 0) {
+            throw new IllegalArgumentException("bufferSize <= 0");
+        }
+        this.pipe = pipe;
+        this.buffer = new byte[bufferSize];
+    }
+
+    @Override
+    public synchronized int read() throws IOException {
+        if (position == count && !fill()) {
+            return -1;
+        }
+        return buffer[position++] & 0xff;
+    }
+
+    @Override
+    public synchronized int read(byte[] b, int off, int len) throws IOException {
+        if (off < 0 || len < 0 || off > b.length - len) {
+            throw new IndexOutOfBoundsException();
+        }
+        if (len == 0) {
+            return 0;
+        }
+        if (position == count) {
+            if (len >= buffer.length) {
+                return readPipe(b, off, len);
+            }
+            if (!fill()) {
+                return -1;
+            }
+        }
+        int bytesCopied = Math.min(len, count - position);
+        System.arraycopy(buffer, position, b, off, bytesCopied);
+        position += bytesCopied;
+        return bytesCopied;
+    }
+
+    @Override
+    public synchronized int available() {
+        return count - position;
+    }
+
+    @Override
+    public void close() {
+        pipe.close();
+    }
+
+    private boolean fill() throws IOException {
+        int bytesRead = readPipe(buffer, 0, buffer.length);
+        if (bytesRead < 0) {
+            return false;
+        }
+        position = 0;
+        count = bytesRead;
+        return true;
+    }
+
+    // Returns -1 once the peer has closed the pipe.
+    private int readPipe(byte[] b, int off, int len) throws IOException {
+        if (endOfStream) {
+            return -1;
+        }
+        try {
+            return pipe.read(b, off, len);
+        } catch (XpnpException e) {
+            if (e.getErrorCode() == XpnpException.ERROR_PIPE_CLOSED) {
+                endOfStream = true;
+                return -1;
+            }
+            throw e;
+        }
+    }
+}
@@ -0,0 +1,50 @@
+package xpnp;
+
+import java.util.Arrays;
+
+// Latency percentiles taken from one of the native library's histograms; see XPNP_getLatencyPercentiles in 
+// XpNamedPipe.h.  Values are in microseconds and at most 1/16 above the true ones.
+public class XpnpLatencies {
+    // The operations timed, as passed to XpNamedPipe.getLatencies.
+    public static final int ACCEPT = 0;
+    public static final int CONNECT = 1;
+    public static final int READ = 2;
+    public static final int WRITE = 3;
+    
+    private final long sampleCount;
+    private final double[] percentiles;
+    private final long[] valuesMicros;
+    
+    // values holds the sample count followed by the value at each percentile.
+    XpnpLatencies(double[] percentiles, long[] values) {
+        this.sampleCount = values[0];
+        this.percentiles = percentiles;
+        this.valuesMicros = Arrays.copyOfRange(values, 1, values.length);
+    }
+    
+    public long getSampleCount() {
+        return sampleCount;
+    }
+    
+    public double[] getPercentiles() {
+        return percentiles.clone();
+    }
+    
+    public long[] getValuesMicros() {
+        return valuesMicros.clone();
+    }
+    
+    // The value at the index'th percentile asked for.
+    public long getValueMicros(int index) {
+        return valuesMicros[index];
+    }
+    
+    @Override
+    public String toString() {
+        StringBuilder builder = new StringBuilder("samples=").append(sampleCount);
+        for (int i = 0; i < percentiles.length; i++) {
+            builder.append(" p").append(percentiles[i]).append('=').append(valuesMicros[i]).append("us");
+        }
+        return builder.toString();
+    }
+}
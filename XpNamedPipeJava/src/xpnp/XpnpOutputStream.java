@@ -0,0 +1,73 @@
+package xpnp;
+
+import java.io.IOException;
+import java.io.OutputStream;
+
+// A buffered OutputStream over a pipe.  Small writes collect in the buffer and go out in one native call when it
+// fills or on flush; writes at least as large as the buffer go straight from the caller's array.  Closing the
+// stream flushes it and closes the pipe.
+public class XpnpOutputStream extends OutputStream {
+    public static final int DEFAULT_BUFFER_SIZE = 8 * 1024;
+
+    private final XpNamedPipe pipe;
+    private final byte[] buffer;
+    private int count = 0;
+
+    public XpnpOutputStream(XpNamedPipe pipe) {
+        this(pipe, DEFAULT_BUFFER_SIZE);
+    }
+
+    public XpnpOutputStream(XpNamedPipe pipe, int bufferSize) {
+        if (bufferSize <= 0) {
+            throw new IllegalArgumentException("bufferSize <= 0");
+        }
+        this.pipe = pipe;
+        this.buffer = new byte[bufferSize];
+    }
+
+    @Override
+    public synchronized void write(int b) throws IOException {
+        if (count == buffer.length) {
+            flushBuffer();
+        }
+        buffer[count++] = (byte)b;
+    }
+
+    @Override
+    public synchronized void write(byte[] b, int off, int len) throws IOException {
+        if (off < 0 || len < 0 || off > b.length - len) {
+            throw new IndexOutOfBoundsException();
+        }
+        if (len >= buffer.length) {
+            flushBuffer();
+            pipe.write(b, off, len);
+            return;
+        }
+        if (len > buffer.length - count) {
+            flushBuffer();
+        }
+        System.arraycopy(b, off, buffer, count, len);
+        count += len;
+    }
+
+    @Override
+    public synchronized void flush() throws IOException {
+        flushBuffer();
+    }
+
+    @Override
+    public synchronized void close() throws IOException {
+        try {
+            flushBuffer();
+        } finally {
+            pipe.close();
+        }
+    }
+
+    private void flushBuffer() throws IOException {
+        if (count > 0) {
+            pipe.write(buffer, 0, count);
+            count = 0;
+        }
+    }
+}
@@ -0,0 +1,84 @@
+package xpnp;
+
+// A snapshot of the counts the native library keeps for a pipe; see XPNP_getPipeStats in XpNamedPipe.h for what 
+// each one covers.
+public class XpnpPipeStats {
+    private final long bytesRead;
+    private final long bytesWritten;
+    private final long messagesRead;
+    private final long messagesWritten;
+    private final long readCalls;
+    private final long writeCalls;
+    private final long readWaitMicros;
+    private final long writeWaitMicros;
+    private final long timeouts;
+    private final long interruptions;
+    private final long partialReads;
+    
+    // values is in the order of the fields of XPNP_PipeStats.
+    XpnpPipeStats(long[] values) {
+        bytesRead = values[0];
+        bytesWritten = values[1];
+        messagesRead = values[2];
+        messagesWritten = values[3];
+        readCalls = values[4];
+        writeCalls = values[5];
+        readWaitMicros = values[6];
+        writeWaitMicros = values[7];
+        timeouts = values[8];
+        interruptions = values[9];
+        partialReads = values[10];
+    }
+    
+    public long getBytesRead() {
+        return bytesRead;
+    }
+    
+    public long getBytesWritten() {
+        return bytesWritten;
+    }
+    
+    public long getMessagesRead() {
+        return messagesRead;
+    }
+    
+    public long getMessagesWritten() {
+        return messagesWritten;
+    }
+    
+    public long getReadCalls() {
+        return readCalls;
+    }
+    
+    public long getWriteCalls() {
+        return writeCalls;
+    }
+    
+    public long getReadWaitMicros() {
+        return readWaitMicros;
+    }
+    
+    public long getWriteWaitMicros() {
+        return writeWaitMicros;
+    }
+    
+    public long getTimeouts() {
+        return timeouts;
+    }
+    
+    public long getInterruptions() {
+        return interruptions;
+    }
+    
+    public long getPartialReads() {
+        return partialReads;
+    }
+    
+    @Override
+    public String toString() {
+        return "bytesRead=" + bytesRead + " bytesWritten=" + bytesWritten + " messagesRead=" + messagesRead 
+                + " messagesWritten=" + messagesWritten + " readCalls=" + readCalls + " writeCalls=" + writeCalls 
+                + " readWaitMicros=" + readWaitMicros + " writeWaitMicros=" + writeWaitMicros + " timeouts=" 
+                + timeouts + " interruptions=" + interruptions + " partialReads=" + partialReads;
+    }
+}
@@ -0,0 +1,120 @@
+package xpnp;
+
+import java.io.IOException;
+import java.util.ArrayList;
+import java.util.Collections;
+import java.util.List;
+import java.util.concurrent.ConcurrentHashMap;
+
+// Waits on many pipes from one thread, so that a server does not need a thread per connection.  A pipe is 
+// reported by select once, when it has data to read (or, for a listening pipe, a client to accept), and is not 
+// watched again until it is resumed; until then its owner may read from it (or accept) freely.  A pipe must not 
+// be read between registering or resuming it and select reporting it.
+public class XpnpSelector implements AutoCloseable {
+    private static final int SELECT_READ = 1;
+    private static final int SELECT_ACCEPT = 2;
+    private static final int MAX_READY = 64;
+    
+    private final ConcurrentHashMap<Long, XpNamedPipe> pipes = new ConcurrentHashMap<Long, XpNamedPipe>();
+    // Closing a pipe clears its handle, so the handle each pipe was registered with is kept for unregistering it.
+    private final ConcurrentHashMap<XpNamedPipe, Long> handles = new ConcurrentHashMap<XpNamedPipe, Long>();
+    private long selectorHandle;
+    private final XpnpCleaner.Cleanable cleanable;
+    
+    public XpnpSelector() throws IOException {
+        selectorHandle = XpNamedPipe.createSelector();
+        cleanable = XpnpCleaner.register(this, new SelectorCloser(selectorHandle));
+    }
+    
+    public void register(XpNamedPipe pipe) throws IOException {
+        register(pipe, SELECT_READ);
+    }
+    
+    public void registerAccept(XpNamedPipe listeningPipe) throws IOException {
+        register(listeningPipe, SELECT_ACCEPT);
+    }
+    
+    // Waits until the selector no longer uses the pipe, so that it can then be closed.  A pipe closed while
+    // registered must still be unregistered; until it is, the selector keeps its native pipe open.
+    public void unregister(XpNamedPipe pipe) throws IOException {
+        long pipeHandle = getRegisteredHandle(pipe);
+        XpNamedPipe.selectorUnregister(selectorHandle, pipeHandle);
+        pipes.remove(pipeHandle);
+        handles.remove(pipe);
+    }
+    
+    public void resume(XpNamedPipe pipe) throws IOException {
+        XpNamedPipe.selectorResume(selectorHandle, getRegisteredHandle(pipe));
+    }
+    
+    // Returns the pipes that became ready, or an empty list if none did within timeoutMsecs (-1 waits 
+    // indefinitely) or wakeup was called.  Reads following select should use a short timeout: data that only 
+    // the library sees, such as a heartbeat, can also make a pipe ready.
+    public List<XpNamedPipe> select(int timeoutMsecs) throws IOException {
+        long[] ready = new long[MAX_READY];
+        int count = XpNamedPipe.select(selectorHandle, ready, timeoutMsecs);
+        if (count == 0) {
+            return Collections.emptyList();
+        }
+        List<XpNamedPipe> readyPipes = new ArrayList<XpNamedPipe>(count);
+        for (int i = 0; i < count; i++) {
+            XpNamedPipe pipe = pipes.get(ready[i]);
+            if (pipe != null) {
+                readyPipes.add(pipe);
+            }
+        }
+        return readyPipes;
+    }
+    
+    // Makes a thread blocked in select (or the next call to it) return an empty list.
+    public void wakeup() throws IOException {
+        XpNamedPipe.selectorWakeup(selectorHandle);
+    }
+    
+    // Stops watching all registered pipes; it does not close them.
+    @Override
+    public synchronized void close() {
+        if (selectorHandle != 0) {
+            selectorHandle = 0;
+            cleanable.clean();
+            pipes.clear();
+            handles.clear();
+        }
+    }
+    
+    private void register(XpNamedPipe pipe, int interest) throws IOException {
+        long pipeHandle = pipe.getHandle();
+        pipes.put(pipeHandle, pipe);
+        handles.put(pipe, pipeHandle);
+        try {
+            XpNamedPipe.selectorRegister(selectorHandle, pipeHandle, interest);
+        } catch (IOException e) {
+            pipes.remove(pipeHandle);
+            handles.remove(pipe);
+            throw e;
+        }
+    }
+    
+    private long getRegisteredHandle(XpNamedPipe pipe) {
+        Long pipeHandle = handles.get(pipe);
+        return pipeHandle != null ? pipeHandle : pipe.getHandle();
+    }
+    
+    // Holds only the handle, so that the cleaner does not keep the selector reachable.
+    private static final class SelectorCloser implements Runnable {
+        private final long selectorHandle;
+        
+        SelectorCloser(long selectorHandle) {
+            this.selectorHandle = selectorHandle;
+        }
+        
+        @Override
+        public void run() {
+            try {
+                XpNamedPipe.closeSelector(selectorHandle);
+            } catch (IOException e) {
+                // Nothing more can be done with it.
+            }
+        }
+    }
+}
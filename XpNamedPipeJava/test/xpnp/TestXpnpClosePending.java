@@ -0,0 +1,131 @@
+package xpnp;
+
+import java.io.IOException;
+import java.util.Arrays;
+import java.util.Collections;
+import java.util.List;
+import java.util.concurrent.CompletableFuture;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.TimeUnit;
+
+// Closes pipes while reads, async reads and selector registrations are pending on them, and checks that the
+// pending work fails (or, for a pipe only the cleaner could close, still completes) instead of the process
+// crashing.  Exits with status 1 if any check fails.
+public class TestXpnpClosePending {
+    private static final String PIPE_NAME = "xpnp-close-pending-test";
+    private static final int WAIT_SECS = 5;
+
+    private static int failures = 0;
+
+    public static void main(String[] args) throws Exception {
+        XpNamedPipe listeningPipe = XpNamedPipe.createNamedPipe(PIPE_NAME, true);
+        try {
+            testBlockingRead(listeningPipe);
+            testAsyncRead(listeningPipe);
+            testSelectorRegistration(listeningPipe);
+            testUnreachableAsyncRead(listeningPipe);
+        } finally {
+            listeningPipe.close();
+        }
+        System.out.println(failures == 0 ? "All checks passed" : failures + " check(s) failed");
+        System.exit(failures == 0 ? 0 : 1);
+    }
+
+    private static void testBlockingRead(XpNamedPipe listeningPipe) throws Exception {
+        XpNamedPipe[] pair = connect(listeningPipe);
+        final XpNamedPipe server = pair[0];
+        final CompletableFuture<Throwable> outcome = new CompletableFuture<Throwable>();
+        Thread reader = new Thread(new Runnable() {
+            @Override
+            public void run() {
+                try {
+                    server.readMessage();
+                    outcome.complete(null);
+                } catch (Throwable t) {
+                    outcome.complete(t);
+                }
+            }
+        });
+        reader.start();
+        Thread.sleep(200);
+        server.close();
+        Throwable error = outcome.get(WAIT_SECS, TimeUnit.SECONDS);
+        check(error instanceof XpnpException, "blocking read fails when its pipe is closed: " + error);
+        pair[1].close();
+    }
+
+    private static void testAsyncRead(XpNamedPipe listeningPipe) throws Exception {
+        XpNamedPipe[] pair = connect(listeningPipe);
+        CompletableFuture<byte[]> read = pair[0].readMessageAsync();
+        Thread.sleep(200);
+        pair[0].close();
+        try {
+            read.get(WAIT_SECS, TimeUnit.SECONDS);
+            check(false, "async read fails when its pipe is closed");
+        } catch (ExecutionException e) {
+            check(e.getCause() instanceof XpnpException, "async read fails when its pipe is closed: " + e.getCause());
+        }
+        pair[1].close();
+    }
+
+    private static void testSelectorRegistration(XpNamedPipe listeningPipe) throws Exception {
+        int openBefore = XpNamedPipe.getOpenPipeCount();
+        XpNamedPipe[] pair = connect(listeningPipe);
+        XpnpSelector selector = new XpnpSelector();
+        try {
+            selector.register(pair[0]);
+            Thread.sleep(200);
+            pair[0].close();
+            // The selector's probe is still pending on the closed pipe; data arriving completes it.
+            pair[1].writeMessage(new byte[] {1});
+            List<XpNamedPipe> ready = selector.select(WAIT_SECS * 1000);
+            check(ready.isEmpty() || ready.equals(Collections.singletonList(pair[0])),
+                    "select reports a pipe closed while registered, or nothing: " + ready);
+            try {
+                selector.unregister(pair[0]);
+                check(true, "unregistering a closed pipe");
+            } catch (IOException e) {
+                check(false, "unregistering a closed pipe: " + e);
+            }
+        } finally {
+            selector.close();
+            pair[1].close();
+        }
+        long deadline = System.currentTimeMillis() + WAIT_SECS * 1000;
+        while (XpNamedPipe.getOpenPipeCount() != openBefore && System.currentTimeMillis() < deadline) {
+            Thread.sleep(50);
+        }
+        int openAfter = XpNamedPipe.getOpenPipeCount();
+        check(openAfter == openBefore, "the selector releases a closed pipe once it is unregistered: " + openBefore +
+                " pipes open before, " + openAfter + " after");
+    }
+
+    private static void testUnreachableAsyncRead(XpNamedPipe listeningPipe) throws Exception {
+        XpNamedPipe[] pair = connect(listeningPipe);
+        CompletableFuture<byte[]> read = pair[0].readMessageAsync();
+        pair[0] = null;
+        for (int i = 0; i < 5; i++) {
+            System.gc();
+            Thread.sleep(100);
+        }
+        byte[] message = {1, 2, 3};
+        pair[1].writeMessage(message);
+        byte[] received = read.get(WAIT_SECS, TimeUnit.SECONDS);
+        check(Arrays.equals(message, received), "async read on an otherwise unreachable pipe completes");
+        pair[1].close();
+    }
+
+    // Returns the server end, then the client end, of a new connection.
+    private static XpNamedPipe[] connect(XpNamedPipe listeningPipe) throws IOException, Exception {
+        CompletableFuture<XpNamedPipe> accepted = listeningPipe.acceptConnectionAsync();
+        XpNamedPipe client = XpNamedPipe.openNamedPipe(PIPE_NAME, true);
+        return new XpNamedPipe[] {accepted.get(WAIT_SECS, TimeUnit.SECONDS), client};
+    }
+
+    private static void check(boolean passed, String description) {
+        System.out.println((passed ? "PASS " : "FAIL ") + description);
+        if (!passed) {
+            failures++;
+        }
+    }
+}
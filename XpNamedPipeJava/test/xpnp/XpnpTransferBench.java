@@ -0,0 +1,128 @@
+package xpnp;
+
+import java.io.IOException;
+import java.nio.ByteBuffer;
+
+// Compares the cost of a round trip through the JNI layer for byte[] transfers (staged natively and copied with 
+// one region call each way) and for direct ByteBuffers (used in place), across message sizes.  Above the 4 KB that 
+// is staged on the stack, byte[] transfers are also run with the per-thread scratch memory turned off, as the 
+// "heap" path, so that its gain over allocating on every call can be seen.  An echo thread in the same process 
+// sends each message back.  Like JMH, it warms up before measuring and reports several rounds.
+//
+// Usage: XpnpTransferBench [roundTrips]
+public class XpnpTransferBench {
+    private static final int[] SIZES = {64, 128, 256, 512, 4096, 8192, 16384, 65536, 262144, 1048576};
+    private static final int STACK_SCRATCH_SIZE = 4096;
+    private static final int WARMUP_ROUNDS = 2;
+    private static final int MEASURED_ROUNDS = 5;
+    
+    public static void main(String[] args) throws Exception {
+        int roundTrips = args.length > 0 ? Integer.parseInt(args[0]) : 20000;
+        
+        final XpNamedPipe listeningPipe = XpNamedPipe.createNamedPipe("xpnptransferbench", true);
+        final XpNamedPipe[] serverPipe = new XpNamedPipe[1];
+        Thread acceptor = new Thread(new Runnable() {
+            @Override
+            public void run() {
+                try {
+                    serverPipe[0] = listeningPipe.acceptConnection(10000);
+                } catch (IOException e) {
+                    System.out.println("Accept failed: " + e);
+                }
+            }
+        });
+        acceptor.start();
+        XpNamedPipe pipe = XpNamedPipe.openNamedPipe("xpnptransferbench", true);
+        acceptor.join();
+        if (serverPipe[0] == null) {
+            return;
+        }
+        startEcho(serverPipe[0]);
+        
+        System.out.println(String.format("%-8s %-8s %12s %12s", "size", "path", "mean ns/rt", "best ns/rt"));
+        for (int size : SIZES) {
+            // Large messages take fewer round trips, so that each size copies about as much as 4 KB ones do.
+            int count = (int)Math.max(Math.min(roundTrips, (long)roundTrips * STACK_SCRATCH_SIZE / size), 100);
+            report(size, "array", measure(pipe, size, count, false));
+            if (size > STACK_SCRATCH_SIZE) {
+                XpNamedPipe.enableThreadScratch(false);
+                try {
+                    report(size, "heap", measure(pipe, size, count, false));
+                } finally {
+                    XpNamedPipe.enableThreadScratch(true);
+                }
+            }
+            report(size, "direct", measure(pipe, size, count, true));
+        }
+        
+        pipe.close();
+        serverPipe[0].close();
+        listeningPipe.close();
+    }
+    
+    // Echoes a 4-byte length and that many bytes, until the pipe closes.
+    private static void startEcho(final XpNamedPipe pipe) {
+        Thread echo = new Thread(new Runnable() {
+            @Override
+            public void run() {
+                byte[] buffer = new byte[SIZES[SIZES.length - 1]];
+                try {
+                    while (true) {
+                        pipe.readBytes(buffer, 0, 4, -1);
+                        int length = ByteBuffer.wrap(buffer, 0, 4).getInt();
+                        pipe.readBytes(buffer, 0, length, -1);
+                        pipe.write(buffer, 0, length);
+                    }
+                } catch (IOException e) {
+                    // Closed at the end of the run.
+                }
+            }
+        });
+        echo.setDaemon(true);
+        echo.start();
+    }
+    
+    // Returns the nanoseconds per round trip for each measured round.
+    private static long[] measure(XpNamedPipe pipe, int size, int count, boolean direct) throws IOException {
+        byte[] header = ByteBuffer.allocate(4).putInt(size).array();
+        byte[] message = new byte[size];
+        ByteBuffer directHeader = ByteBuffer.allocateDirect(4);
+        directHeader.putInt(0, size);
+        ByteBuffer directMessage = ByteBuffer.allocateDirect(size);
+        
+        long[] results = new long[MEASURED_ROUNDS];
+        for (int round = 0; round < WARMUP_ROUNDS + MEASURED_ROUNDS; round++) {
+            long start = System.nanoTime();
+            for (int i = 0; i < count; i++) {
+                if (direct) {
+                    directHeader.clear();
+                    pipe.write(directHeader);
+                    directMessage.clear();
+                    pipe.write(directMessage);
+                    directMessage.clear();
+                    while (directMessage.hasRemaining()) {
+                        pipe.read(directMessage, -1);
+                    }
+                } else {
+                    pipe.write(header);
+                    pipe.write(message);
+                    pipe.readBytes(message, size, -1);
+                }
+            }
+            if (round >= WARMUP_ROUNDS) {
+                results[round - WARMUP_ROUNDS] = (System.nanoTime() - start) / count;
+            }
+        }
+        return results;
+    }
+    
+    private static void report(int size, String path, long[] results) {
+        long total = 0;
+        long best = Long.MAX_VALUE;
+        for (long result : results) {
+            total += result;
+            best = Math.min(best, result);
+        }
+        System.out.println(String.format("%-8d %-8s %12d %12d", size, path, total / results.length, best));
+    }
+}
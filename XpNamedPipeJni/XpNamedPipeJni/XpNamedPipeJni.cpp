@@ -1,284 +1,1007 @@
-// XpNamedPipeJni.cpp : Defines the exported functions for the DLL application.
-//
-
-#include "stdafx.h"
-
-#include "util.hpp"
-#include "XpNamedPipeJni.h"
-#include "XpNamedPipe.h"
-
-using namespace util;
-
-static boost::thread_specific_ptr<ErrorInfo> GBL_errorInfo;
-
-// Local function definitions
-
-static void setErrorInfo(const std::string& errorMessage, int errorCode = 0) {
-    GBL_errorInfo.reset(new ErrorInfo(errorMessage, errorCode));
-}
-
-static void setErrorInfo(const ErrorInfo& info) {
-    GBL_errorInfo.reset(new ErrorInfo(info));
-}
-
-static void throwXpnpError() {
-    char buffer[1024] = "";
-    XPNP_getErrorMessage(buffer, sizeof(buffer));
-    throw ErrorInfo(buffer, XPNP_getErrorCode());
-}
-
-static void checkXpnpResult(int result) {
-    if (result == 0) {
-        throwXpnpError();
-    }
-}
-
-static std::string toStdString(JNIEnv* pEnv, jstring javaString) {
-    const jchar* javaChars = NULL;
-    std::string result;
-    bool error = false;
-    std::exception except;
-    try {
-        javaChars = pEnv->GetStringChars(javaString, NULL);
-        if (javaChars == NULL) {
-            throw std::bad_alloc();
-        }
-
-        std::wstring utf16 = std::wstring((wchar_t*)javaChars, pEnv->GetStringLength(javaString));
-        
-        result = toUtf8(utf16);
-    } catch (std::exception& e) {
-        error = true;
-        except = e;
-    }
-    if (javaChars != NULL) {
-        pEnv->ReleaseStringChars(javaString, javaChars);
-    }
-
-    if (error) {
-        throw except;
-    }
-    return result;
-}
-
-static jstring toJavaString(JNIEnv* pEnv, const std::string& utf8) {
-    std::wstring utf16 = toUtf16(utf8);
-    jstring result = pEnv->NewString((const jchar*)utf16.c_str(), (jsize)utf16.length());
-    if (result == NULL) {
-        throw std::bad_alloc();
-    }
-    return result;
-}
-
-// Exported function definitions
-
-jstring JNICALL Java_xpnp_XpNamedPipe_getErrorMessage(JNIEnv* pEnv, jclass cls) {
-    std::wstring errorMsgUtf16;
-
-    ErrorInfo* pErrorInfo = GBL_errorInfo.get();
-
-    if (pErrorInfo != NULL) {
-        try {
-            errorMsgUtf16 = toUtf16(pErrorInfo->what());
-        } catch (...) {
-            errorMsgUtf16 = L"Error converting error message to UTF-16";
-        }
-    }
-
-    return pEnv->NewString((const jchar*)errorMsgUtf16.c_str(), (jsize)errorMsgUtf16.length());
-}
-
-jint JNICALL Java_xpnp_XpNamedPipe_getErrorCode(JNIEnv* pEnv, jclass cls) {
-    jint errorCode = 0;
-    ErrorInfo* pErrorInfo = GBL_errorInfo.get();
-    if (pErrorInfo != NULL) {
-        errorCode = pErrorInfo->getErrorCode();
-    }
-    return errorCode;
-}
-
-jstring JNICALL Java_xpnp_XpNamedPipe_makePipeName(JNIEnv* pEnv, jclass cls, jstring javaName, jboolean userLocal) {
-    jstring result = NULL;
-    try {
-        std::string pipeName = toStdString(pEnv, javaName);
-
-        char fullPipeName[256] = "";
-        int xpnpResult = XPNP_makePipeName(pipeName.c_str(), userLocal, fullPipeName, sizeof(fullPipeName));
-        checkXpnpResult(xpnpResult);
-
-        result = toJavaString(pEnv, fullPipeName);
-    } catch (std::exception& except) {
-        setErrorInfo(except.what());
-    }
-
-    return result;
-}
-
-jlong JNICALL Java_xpnp_XpNamedPipe_createPipe(JNIEnv* pEnv, jclass cls, jstring javaName, 
-        jboolean privatePipe) {
-    XPNP_PipeHandle pipeHandle = NULL;
-    try {
-        std::string pipeName = toStdString(pEnv, javaName);
-
-        pipeHandle = XPNP_createPipe(pipeName.c_str(), privatePipe);
-
-        if (pipeHandle == NULL) {
-            throwXpnpError();
-        }
-    } catch (std::exception& except) {
-        setErrorInfo(except.what());
-    }
-
-    return (jlong)(unsigned __int64)pipeHandle;
-}
-
-jboolean JNICALL Java_xpnp_XpNamedPipe_stopPipe(JNIEnv* pEnv, jclass cls, jlong pipeHandle) {
-    try {
-        checkXpnpResult(XPNP_stopPipe((XPNP_PipeHandle)pipeHandle));
-        return 1;
-    } catch (std::exception& except) {
-        setErrorInfo(except.what());
-        return 0;
-    }
-}
-
-jboolean JNICALL Java_xpnp_XpNamedPipe_closePipe(JNIEnv* pEnv, jclass cls, jlong pipeHandle) {
-    try {
-        checkXpnpResult(XPNP_closePipe((XPNP_PipeHandle)pipeHandle));
-        return 1;
-    } catch (std::exception& except) {
-        setErrorInfo(except.what());
-        return 0;
-    }
-}
-
-jlong JNICALL Java_xpnp_XpNamedPipe_acceptConnection(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jint timeoutMsecs) {
-    try {
-        XPNP_PipeHandle newPipe = XPNP_acceptConnection((XPNP_PipeHandle)pipeHandle, timeoutMsecs);
-        if (newPipe == NULL) {
-            throwXpnpError();
-        }
-        return (jlong)(unsigned __int64)newPipe;
-    } catch (ErrorInfo& info) {
-        setErrorInfo(info);
-        return 0;
-    } catch (std::exception& except) {
-        setErrorInfo(except.what());
-        return 0;
-    }
-}
-
-jint JNICALL Java_xpnp_XpNamedPipe_readPipe(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray readBufferJava, jint timeoutMsecs) {
-    jbyte* readBuffer = NULL;
-    int bytesRead = 0;
-    try {
-        readBuffer = pEnv->GetByteArrayElements(readBufferJava, NULL);
-        if (readBuffer == NULL) {
-            throw std::bad_alloc();
-        }
-
-        bytesRead = XPNP_readPipe((XPNP_PipeHandle)pipeHandle, (char*)readBuffer, pEnv->GetArrayLength(readBufferJava), timeoutMsecs);
-        checkXpnpResult(bytesRead);
-    } catch (ErrorInfo& info) {
-        setErrorInfo(info);
-    } catch (std::exception& except) { 
-        setErrorInfo(except.what());
-    }
-    if (readBuffer != NULL) {
-        pEnv->ReleaseByteArrayElements(readBufferJava, readBuffer, 0);
-    }
-    return bytesRead;
-}
-
-jboolean JNICALL Java_xpnp_XpNamedPipe_readBytes(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray readBufferJava, jint bytesToRead, 
-            jint timeoutMsecs) {
-    jbyte* readBuffer = NULL;
-    jboolean result = 0;
-    try {
-        if (bytesToRead > pEnv->GetArrayLength(readBufferJava)) {
-            throw std::length_error("Buffer length less than bytesToRead");
-        }
-        readBuffer = pEnv->GetByteArrayElements(readBufferJava, NULL);
-        if (readBuffer == NULL) {
-            throw std::bad_alloc();
-        }
-
-        result = XPNP_readBytes((XPNP_PipeHandle)pipeHandle, (char*)readBuffer, bytesToRead, timeoutMsecs);
-        checkXpnpResult(result);
-    } catch (ErrorInfo& info) {
-        setErrorInfo(info);
-    } catch (std::exception& except) { 
-        setErrorInfo(except.what());
-    }
-    if (readBuffer != NULL) {
-        pEnv->ReleaseByteArrayElements(readBufferJava, readBuffer, 0);
-    }
-    return result;
-}
-
-jlong JNICALL Java_xpnp_XpNamedPipe_openPipe(JNIEnv* pEnv, jclass cls, jstring javaName, jboolean privatePipe) {
-    XPNP_PipeHandle newPipe = NULL;
-    try {
-        std::string pipeName = toStdString(pEnv, javaName);
-        newPipe = XPNP_openPipe(pipeName.c_str(), privatePipe);
-        if (newPipe == NULL) {
-            throwXpnpError();
-        }
-    } catch (std::exception& except) {
-        setErrorInfo(except.what());
-    }
-
-    return (jlong)(unsigned __int64)newPipe;
-}
-
-jboolean JNICALL Java_xpnp_XpNamedPipe_writePipe(JNIEnv* pEnv, jclass cls, jlong pipe, jbyteArray pipeDataJava) {
-    jboolean result = 0;
-    jbyte* pipeData = NULL;
-    try {
-        pipeData = pEnv->GetByteArrayElements(pipeDataJava, NULL);
-        if (pipeData == NULL) {
-            throw std::bad_alloc();
-        }
-        result = XPNP_writePipe((XPNP_PipeHandle)pipe, (char*)pipeData, pEnv->GetArrayLength(pipeDataJava));
-        checkXpnpResult(result);
-    } catch (std::exception& except) {
-        setErrorInfo(except.what());
-    }
-    if (pipeData != NULL) {
-        pEnv->ReleaseByteArrayElements(pipeDataJava, pipeData, 0);
-    }
-    return result;
-}
-
-jboolean JNICALL Java_xpnp_XpNamedPipe_createProcess(JNIEnv* pEnv, jclass cls, jstring commandLineJava, jstring workingDirectoryJava) {
-    jboolean result = 0;
-    wchar_t* commandLineBuffer = NULL;
-    try {
-        std::string commandLine = toStdString(pEnv, commandLineJava);
-        std::string workingDirectory = toStdString(pEnv, workingDirectoryJava);
-
-        commandLineBuffer = newUtf16(commandLine.c_str());
-
-        STARTUPINFO startupInfo;
-        memset(&startupInfo, 0, sizeof(startupInfo));
-        startupInfo.cb = sizeof(startupInfo);
-
-        PROCESS_INFORMATION processInfo;
-        memset(&processInfo, 0, sizeof(processInfo));
-
-        if (!CreateProcess(NULL, commandLineBuffer, NULL, NULL, FALSE, 0, NULL, 
-                util::toUtf16(workingDirectory).c_str(), &startupInfo, &processInfo)) {
-            util::throwWindowsError("CreateProcess");
-        }
-        CloseHandle(processInfo.hThread);
-        CloseHandle(processInfo.hProcess);
-        result = 1;
-    } catch (std::exception& except) {
-        setErrorInfo(except.what());
-    }
-    if (commandLineBuffer != NULL) {
-        delete [] commandLineBuffer;
-    }
-    return result;
-}
-
+// XpNamedPipeJni.cpp : Defines the exported functions for the DLL application.
+//
+
+#include "stdafx.h"
+
+#include "util.hpp"
+#include "XpNamedPipeJni.h"
+#include "XpNamedPipe.h"
+
+using namespace util;
+
+// Transfers up to this size are staged on the stack; larger ones use per-thread scratch memory.
+const int STACK_SCRATCH_SIZE = 4 * 1024;
+const size_t MAX_THREAD_SCRATCH_SIZE = 1024 * 1024;
+
+// Threads that run async calls and complete their futures.
+const int COMPLETION_THREADS = 2;
+
+// How long a completion thread waits for a message once its pipe is ready.  Readiness can come from a control frame
+// alone, in which case the read times out having taken nothing and goes back to waiting in the selector.
+const int READY_READ_TIMEOUT_MSECS = 100;
+
+const int MAX_READY_PIPES = 64;
+
+// Bounds on the blocking parts of async calls, so that a peer that stops reading, or a client that never finishes
+// the handshake, cannot hold a completion thread for long.  An accept that times out goes back to waiting; a write
+// that times out fails, along with any queued behind it on the pipe.
+const int ASYNC_WRITE_TIMEOUT_MSECS = 5000;
+const int ASYNC_ACCEPT_TIMEOUT_MSECS = 2000;
+
+// Type definitions
+
+// Scratch memory kept by each thread for transfers too large for the stack, so that they do not allocate on every
+// call.  Buffers above MAX_THREAD_SCRATCH_SIZE are not kept.
+struct ThreadScratch {
+    ThreadScratch() : inUse(false) {
+    }
+
+    std::vector<char> data;
+    bool inUse;
+};
+
+static boost::thread_specific_ptr<ThreadScratch> GBL_threadScratch;
+
+// Cleared only by XpnpTransferBench, to measure the heap staging that thread scratch memory replaced.
+static volatile bool GBL_threadScratchEnabled = true;
+
+// Native staging for part of a Java array, so that only the bytes transferred are copied in or out.  Small
+// transfers are staged on the stack and larger ones in the thread's scratch memory; the JNI region calls then copy
+// them in one pass, and the blocking I/O happens with no array pinned.
+class ScratchBuffer {
+public:
+    explicit ScratchBuffer(int size = 0) : data(stackData), capacity(STACK_SCRATCH_SIZE), threadScratch(NULL) {
+        reserve(size);
+    }
+
+    ~ScratchBuffer() {
+        if (threadScratch != NULL) {
+            if (threadScratch->data.size() > MAX_THREAD_SCRATCH_SIZE) {
+                std::vector<char>().swap(threadScratch->data);
+            }
+            threadScratch->inUse = false;
+        }
+    }
+
+    // Makes room for size bytes; the contents are not kept.
+    void reserve(int size) {
+        if (size <= capacity) {
+            return;
+        }
+        if (threadScratch == NULL && GBL_threadScratchEnabled) {
+            ThreadScratch* scratch = GBL_threadScratch.get();
+            if (scratch == NULL) {
+                scratch = new ThreadScratch();
+                GBL_threadScratch.reset(scratch);
+            }
+            // A second buffer on the same thread falls back to the heap.
+            if (!scratch->inUse) {
+                scratch->inUse = true;
+                threadScratch = scratch;
+            }
+        }
+        if (threadScratch != NULL) {
+            threadScratch->data.resize(size);
+            data = &threadScratch->data[0];
+        } else {
+            heapData.reset(new char[size]);
+            data = heapData.get();
+        }
+        capacity = size;
+    }
+
+    char* get() {
+        return data;
+    }
+
+    int getCapacity() {
+        return capacity;
+    }
+
+private:
+    char stackData[STACK_SCRATCH_SIZE];
+    boost::scoped_array<char> heapData;
+    char* data;
+    int capacity;
+    ThreadScratch* threadScratch;
+};
+
+class AsyncCompletions;
+
+// Globals
+
+// Exception classes thrown to Java, and their constructors; looked up once, in JNI_OnLoad.
+static jclass GBL_xpnpExceptionClass = NULL;
+static jmethodID GBL_xpnpExceptionInit = NULL;
+static jclass GBL_timeoutExceptionClass = NULL;
+static jmethodID GBL_timeoutExceptionInit = NULL;
+
+// For completing futures from the completion threads; looked up in JNI_OnLoad.
+static JavaVM* GBL_pVm = NULL;
+static jmethodID GBL_futureComplete = NULL;
+static jmethodID GBL_futureCompleteExceptionally = NULL;
+static jclass GBL_longClass = NULL;
+static jmethodID GBL_longValueOf = NULL;
+
+// Started on the first async call, and kept for the life of the process.
+static boost::mutex GBL_asyncMutex;
+static AsyncCompletions* GBL_asyncCompletions = NULL;
+
+// Local function definitions
+
+static jclass findGlobalClass(JNIEnv* pEnv, const char* name) {
+    jclass localClass = pEnv->FindClass(name);
+    if (localClass == NULL) {
+        return NULL;
+    }
+    jclass globalClass = (jclass)pEnv->NewGlobalRef(localClass);
+    pEnv->DeleteLocalRef(localClass);
+    return globalClass;
+}
+
+static void throwXpnpError(int errorCode) {
+    char buffer[1024] = "";
+    XPNP_getErrorMessage(buffer, sizeof(buffer));
+    throw ErrorInfo(buffer, errorCode);
+}
+
+// The I/O calls return a negated error code; the others return 0 and leave the code to XPNP_getErrorCode.
+static void checkXpnpResult(int result) {
+    if (result < 0) {
+        throwXpnpError(-result);
+    } else if (result == 0) {
+        throwXpnpError(XPNP_getErrorCode());
+    }
+}
+
+// Makes the Java exception for a failed call: TimeoutException for XPNP_ERROR_TIMEOUT, otherwise XpnpException
+// carrying the error code, so Java needs no further calls to find out what went wrong.  An exception the JVM
+// already has pending (such as an OutOfMemoryError) is taken instead.  Returns NULL if it could not be made.
+static jthrowable newJavaException(JNIEnv* pEnv, const char* failure, const std::exception& except) {
+    if (pEnv->ExceptionCheck()) {
+        jthrowable pending = pEnv->ExceptionOccurred();
+        pEnv->ExceptionClear();
+        return pending;
+    }
+    int errorCode = XPNP_ERROR_SYSTEM;
+    const ErrorInfo* pErrorInfo = dynamic_cast<const ErrorInfo*>(&except);
+    if (pErrorInfo != NULL && pErrorInfo->getErrorCode() != 0) {
+        errorCode = pErrorInfo->getErrorCode();
+    } else if (dynamic_cast<const std::invalid_argument*>(&except) != NULL ||
+            dynamic_cast<const std::length_error*>(&except) != NULL) {
+        errorCode = XPNP_ERROR_INVALID_ARGUMENT;
+    }
+
+    std::wstring messageUtf16;
+    try {
+        messageUtf16 = toUtf16(std::string(failure) + ": " + except.what());
+    } catch (...) {
+        messageUtf16 = L"Error converting error message to UTF-16";
+    }
+    jstring message = pEnv->NewString((const jchar*)messageUtf16.c_str(), (jsize)messageUtf16.length());
+    if (message == NULL) {
+        return NULL;
+    }
+
+    jobject exception = NULL;
+    if (errorCode == XPNP_ERROR_TIMEOUT) {
+        exception = pEnv->NewObject(GBL_timeoutExceptionClass, GBL_timeoutExceptionInit, message);
+    } else {
+        exception = pEnv->NewObject(GBL_xpnpExceptionClass, GBL_xpnpExceptionInit, message, (jint)errorCode);
+    }
+    pEnv->DeleteLocalRef(message);
+    return (jthrowable)exception;
+}
+
+static void throwJavaException(JNIEnv* pEnv, const char* failure, const std::exception& except) {
+    jthrowable exception = newJavaException(pEnv, failure, except);
+    if (exception != NULL) {
+        pEnv->Throw(exception);
+    }
+}
+
+static std::string toStdString(JNIEnv* pEnv, jstring javaString) {
+    const jchar* javaChars = NULL;
+    std::string result;
+    bool error = false;
+    std::exception except;
+    try {
+        javaChars = pEnv->GetStringChars(javaString, NULL);
+        if (javaChars == NULL) {
+            throw std::bad_alloc();
+        }
+
+        std::wstring utf16 = std::wstring((wchar_t*)javaChars, pEnv->GetStringLength(javaString));
+        
+        result = toUtf8(utf16);
+    } catch (std::exception& e) {
+        error = true;
+        except = e;
+    }
+    if (javaChars != NULL) {
+        pEnv->ReleaseStringChars(javaString, javaChars);
+    }
+
+    if (error) {
+        throw except;
+    }
+    return result;
+}
+
+// Pipe names cross JNI as UTF-8 byte arrays, which the library takes as they are, with no UTF-16 round trip.
+static std::string toUtf8Name(JNIEnv* pEnv, jbyteArray nameJava) {
+    if (nameJava == NULL) {
+        throw std::invalid_argument("Pipe name is null");
+    }
+    jsize length = pEnv->GetArrayLength(nameJava);
+    std::string name(length, '\0');
+    if (length > 0) {
+        pEnv->GetByteArrayRegion(nameJava, 0, length, (jbyte*)&name[0]);
+    }
+    if (name.find('\0') != std::string::npos) {
+        throw std::invalid_argument("Pipe name contains a null character");
+    }
+    return name;
+}
+
+static jbyteArray toJavaBytes(JNIEnv* pEnv, const char* utf8) {
+    jsize length = (jsize)strlen(utf8);
+    jbyteArray result = pEnv->NewByteArray(length);
+    if (result == NULL) {
+        throw std::bad_alloc();
+    }
+    pEnv->SetByteArrayRegion(result, 0, length, (const jbyte*)utf8);
+    return result;
+}
+
+// The memory behind [offset, offset + length) of a direct ByteBuffer, which native I/O can use in place.
+static char* getDirectBufferRegion(JNIEnv* pEnv, jobject bufferJava, jint offset, jint length) {
+    char* address = (char*)pEnv->GetDirectBufferAddress(bufferJava);
+    if (address == NULL) {
+        throw std::invalid_argument("Not a direct buffer");
+    }
+    if (offset < 0 || length <= 0 || offset > pEnv->GetDirectBufferCapacity(bufferJava) - length) {
+        throw std::invalid_argument("Offset or length outside the buffer");
+    }
+    return address + offset;
+}
+
+// Reads a framed message into buffer, growing it if the message is longer, and returns the message length.
+// Fails with XPNP_ERROR_BUFFER_TOO_SMALL, leaving the message to be read again, if it is longer than maxLen.
+static int readMessage(XPNP_PipeHandle pipe, ScratchBuffer& buffer, int maxLen, int timeoutMsecs) {
+    int msgLen = 0;
+    int bufLen = buffer.getCapacity() < maxLen ? buffer.getCapacity() : maxLen;
+    int result = XPNP_readMessage(pipe, buffer.get(), bufLen, &msgLen, timeoutMsecs);
+    if (result == -XPNP_ERROR_BUFFER_TOO_SMALL && msgLen <= maxLen) {
+        buffer.reserve(msgLen);
+        result = XPNP_readMessage(pipe, buffer.get(), msgLen, &msgLen, timeoutMsecs);
+    }
+    checkXpnpResult(result);
+    return msgLen;
+}
+
+// Runs the async calls.  A read or accept waits in a selector rather than on a thread; once its pipe is ready, a
+// completion thread takes the pipe out of the selector, makes the call, and completes the future.  A read that
+// finds only a control frame goes back to waiting.  Writes run on a completion thread directly, one at a time for
+// each pipe, so that they go out in the order they were submitted.  Each completion thread attaches to the JVM once,
+// when it starts, and keeps its JNIEnv.
+class AsyncCompletions {
+public:
+    enum CallType {
+        CALL_READ, CALL_ACCEPT, CALL_WRITE
+    };
+
+    struct Call {
+        Call(CallType type, XPNP_PipeHandle pipe) : type(type), pipe(pipe), future(NULL) {
+        }
+
+        CallType type;
+        XPNP_PipeHandle pipe;
+        // A global reference to the CompletableFuture.
+        jobject future;
+        std::vector<char> message;
+    };
+
+    AsyncCompletions() {
+        selector = XPNP_createSelector();
+        if (selector == NULL) {
+            throwXpnpError(XPNP_getErrorCode());
+        }
+        pollerThread = boost::thread(&AsyncCompletions::pollLoop, this);
+        for (int i = 0; i < COMPLETION_THREADS; i++) {
+            completionThreads.add_thread(new boost::thread(&AsyncCompletions::completionLoop, this));
+        }
+    }
+
+    // Takes ownership of the call, unless it throws.
+    void submit(Call* call) {
+        boost::mutex::scoped_lock lock(mutex);
+        if (call->type == CALL_WRITE) {
+            // The first write queued for a pipe runs now; the others run in turn as each one finishes.
+            std::deque<Call*>& queue = writeQueues[call->pipe];
+            queue.push_back(call);
+            if (queue.size() == 1) {
+                runnable.push_back(call);
+                callRunnable.notify_one();
+            }
+        } else {
+            startWaiting(call);
+        }
+    }
+
+    // Fails any read or accept still waiting on the pipe, which is being closed.  One already taken up by a
+    // completion thread fails when it finds the pipe closed.
+    void cancelWaiting(JNIEnv* pEnv, XPNP_PipeHandle pipe) {
+        Call* call = NULL;
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            std::map<XPNP_PipeHandle, Call*>::iterator it = waiting.find(pipe);
+            if (it == waiting.end()) {
+                return;
+            }
+            call = it->second;
+            waiting.erase(it);
+        }
+        XPNP_selectorUnregister(selector, pipe);
+        jthrowable error = newJavaException(pEnv, getFailure(call->type),
+                ErrorInfo("Pipe closed", XPNP_ERROR_INTERRUPTED));
+        if (error != NULL) {
+            completeFuture(pEnv, call, NULL, error);
+            pEnv->DeleteLocalRef(error);
+        }
+        pEnv->DeleteGlobalRef(call->future);
+        delete call;
+    }
+
+private:
+    // Called with the mutex held.
+    void startWaiting(Call* call) {
+        if (waiting.find(call->pipe) != waiting.end()) {
+            throw std::invalid_argument("An async read or accept is already pending on the pipe");
+        }
+        waiting[call->pipe] = call;
+        int interest = call->type == CALL_READ ? XPNP_SELECT_READ : XPNP_SELECT_ACCEPT;
+        if (!XPNP_selectorRegister(selector, call->pipe, interest)) {
+            waiting.erase(call->pipe);
+            throwXpnpError(XPNP_getErrorCode());
+        }
+    }
+
+    void pollLoop() {
+        std::vector<XPNP_PipeHandle> ready(MAX_READY_PIPES);
+        while (true) {
+            int count = XPNP_select(selector, &ready[0], (int)ready.size(), -1);
+            boost::mutex::scoped_lock lock(mutex);
+            for (int i = 0; i < count; i++) {
+                std::map<XPNP_PipeHandle, Call*>::iterator it = waiting.find(ready[i]);
+                if (it != waiting.end()) {
+                    runnable.push_back(it->second);
+                    waiting.erase(it);
+                    callRunnable.notify_one();
+                }
+            }
+        }
+    }
+
+    void completionLoop() {
+        JNIEnv* pEnv = NULL;
+        if (GBL_pVm->AttachCurrentThreadAsDaemon((void**)&pEnv, NULL) != JNI_OK) {
+            return;
+        }
+        while (true) {
+            Call* call = NULL;
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                while (runnable.empty()) {
+                    callRunnable.wait(lock);
+                }
+                call = runnable.front();
+                runnable.pop_front();
+            }
+            if (call->type != CALL_WRITE) {
+                XPNP_selectorUnregister(selector, call->pipe);
+            }
+            // The thread never returns to Java, so its local references are released per call.
+            bool framed = pEnv->PushLocalFrame(16) == 0;
+            if (!framed) {
+                pEnv->ExceptionClear();
+            }
+            jthrowable error = NULL;
+            bool completed = complete(pEnv, call, error);
+            if (call->type == CALL_WRITE) {
+                std::vector<Call*> abandoned;
+                finishWrite(call->pipe, error != NULL, abandoned);
+                for (size_t i = 0; i < abandoned.size(); i++) {
+                    completeFuture(pEnv, abandoned[i], NULL, error);
+                    pEnv->DeleteGlobalRef(abandoned[i]->future);
+                    delete abandoned[i];
+                }
+            }
+            if (framed) {
+                pEnv->PopLocalFrame(NULL);
+            }
+            if (completed) {
+                pEnv->DeleteGlobalRef(call->future);
+                delete call;
+            }
+        }
+    }
+
+    // Lets the next write queued for the pipe run or, if this one failed (leaving the connection unusable), takes
+    // them all to be failed with it.
+    void finishWrite(XPNP_PipeHandle pipe, bool failed, std::vector<Call*>& abandoned) {
+        boost::mutex::scoped_lock lock(mutex);
+        std::map<XPNP_PipeHandle, std::deque<Call*> >::iterator it = writeQueues.find(pipe);
+        std::deque<Call*>& queue = it->second;
+        queue.pop_front();
+        if (failed) {
+            abandoned.assign(queue.begin(), queue.end());
+            queue.clear();
+        }
+        if (queue.empty()) {
+            writeQueues.erase(it);
+        } else {
+            runnable.push_back(queue.front());
+            callRunnable.notify_one();
+        }
+    }
+
+    // Makes the call and completes its future, setting error if it failed.  Returns false, with the call waiting
+    // again, if a read found no message yet or an accept's client did not finish the handshake in time.  A read
+    // that runs out of time partway through a message fails with XPNP_ERROR_PROTOCOL rather than XPNP_ERROR_TIMEOUT,
+    // since what it took is lost; its future fails like any other, leaving a pipe that can only be closed.
+    bool complete(JNIEnv* pEnv, Call* call, jthrowable& error) {
+        jobject result = NULL;
+        try {
+            if (call->type == CALL_READ) {
+                ScratchBuffer buffer;
+                int msgLen = 0;
+                try {
+                    msgLen = readMessage(call->pipe, buffer, INT_MAX, READY_READ_TIMEOUT_MSECS);
+                } catch (ErrorInfo& errorInfo) {
+                    // Only a read that took nothing can simply wait again.
+                    if (errorInfo.getErrorCode() != XPNP_ERROR_TIMEOUT) {
+                        throw;
+                    }
+                    boost::mutex::scoped_lock lock(mutex);
+                    startWaiting(call);
+                    return false;
+                }
+                jbyteArray message = pEnv->NewByteArray(msgLen);
+                if (message == NULL) {
+                    throw std::bad_alloc();
+                }
+                pEnv->SetByteArrayRegion(message, 0, msgLen, (const jbyte*)buffer.get());
+                result = message;
+            } else if (call->type == CALL_ACCEPT) {
+                // The selector has already connected the client, so only the handshake remains.
+                XPNP_PipeHandle newPipe = XPNP_acceptConnection(call->pipe, ASYNC_ACCEPT_TIMEOUT_MSECS);
+                if (newPipe == NULL) {
+                    if (XPNP_getErrorCode() == XPNP_ERROR_TIMEOUT) {
+                        // The client has been dropped; wait for the next one.
+                        boost::mutex::scoped_lock lock(mutex);
+                        startWaiting(call);
+                        return false;
+                    }
+                    throwXpnpError(XPNP_getErrorCode());
+                }
+                result = pEnv->CallStaticObjectMethod(GBL_longClass, GBL_longValueOf, (jlong)(unsigned __int64)newPipe);
+                if (result == NULL) {
+                    throw std::bad_alloc();
+                }
+            } else {
+                const char* message = call->message.empty() ? NULL : &call->message[0];
+                checkXpnpResult(XPNP_writeMessageEx(call->pipe, message, (int)call->message.size(),
+                        ASYNC_WRITE_TIMEOUT_MSECS));
+            }
+        } catch (std::exception& except) {
+            error = newJavaException(pEnv, getFailure(call->type), except);
+            if (error == NULL) {
+                error = pEnv->ExceptionOccurred();
+                pEnv->ExceptionClear();
+            }
+        }
+
+        completeFuture(pEnv, call, result, error);
+        return true;
+    }
+
+    static void completeFuture(JNIEnv* pEnv, Call* call, jobject result, jthrowable error) {
+        if (error != NULL) {
+            pEnv->CallBooleanMethod(call->future, GBL_futureCompleteExceptionally, error);
+        } else {
+            pEnv->CallBooleanMethod(call->future, GBL_futureComplete, result);
+        }
+        // Dependent stages run here, and whatever they throw is theirs to handle.
+        pEnv->ExceptionClear();
+    }
+
+    static const char* getFailure(CallType type) {
+        switch (type) {
+        case CALL_READ:
+            return "Failed to read message";
+        case CALL_ACCEPT:
+            return "Failed to accept connection";
+        default:
+            return "Failed to write message";
+        }
+    }
+
+    XPNP_SelectorHandle selector;
+
+    boost::mutex mutex;
+    boost::condition_variable callRunnable;
+
+    std::map<XPNP_PipeHandle, Call*> waiting;
+    // Writes not yet finished, for each pipe with any; the first is running or runnable.
+    std::map<XPNP_PipeHandle, std::deque<Call*> > writeQueues;
+    std::deque<Call*> runnable;
+
+    boost::thread pollerThread;
+    boost::thread_group completionThreads;
+};
+
+static AsyncCompletions& getAsyncCompletions() {
+    boost::mutex::scoped_lock lock(GBL_asyncMutex);
+    if (GBL_asyncCompletions == NULL) {
+        GBL_asyncCompletions = new AsyncCompletions();
+    }
+    return *GBL_asyncCompletions;
+}
+
+static void cancelAsync(JNIEnv* pEnv, XPNP_PipeHandle pipe) {
+    AsyncCompletions* asyncCompletions = NULL;
+    {
+        boost::mutex::scoped_lock lock(GBL_asyncMutex);
+        asyncCompletions = GBL_asyncCompletions;
+    }
+    if (asyncCompletions != NULL) {
+        asyncCompletions->cancelWaiting(pEnv, pipe);
+    }
+}
+
+// Hands a call to the completion threads; on failure, the future is left alone and a Java exception is thrown.
+static void submitAsync(JNIEnv* pEnv, AsyncCompletions::Call* call, jobject future, const char* failure) {
+    call->future = pEnv->NewGlobalRef(future);
+    if (call->future == NULL) {
+        delete call;
+        return;
+    }
+    try {
+        getAsyncCompletions().submit(call);
+    } catch (std::exception& except) {
+        pEnv->DeleteGlobalRef(call->future);
+        delete call;
+        throwJavaException(pEnv, failure, except);
+    }
+}
+
+// Exported function definitions
+
+jint JNICALL JNI_OnLoad(JavaVM* pVm, void* reserved) {
+    JNIEnv* pEnv = NULL;
+    if (pVm->GetEnv((void**)&pEnv, JNI_VERSION_1_6) != JNI_OK) {
+        return JNI_ERR;
+    }
+    GBL_xpnpExceptionClass = findGlobalClass(pEnv, "xpnp/XpnpException");
+    GBL_timeoutExceptionClass = findGlobalClass(pEnv, "xpnp/TimeoutException");
+    if (GBL_xpnpExceptionClass == NULL || GBL_timeoutExceptionClass == NULL) {
+        return JNI_ERR;
+    }
+    GBL_xpnpExceptionInit = pEnv->GetMethodID(GBL_xpnpExceptionClass, "<init>", "(Ljava/lang/String;I)V");
+    GBL_timeoutExceptionInit = pEnv->GetMethodID(GBL_timeoutExceptionClass, "<init>", "(Ljava/lang/String;)V");
+    if (GBL_xpnpExceptionInit == NULL || GBL_timeoutExceptionInit == NULL) {
+        return JNI_ERR;
+    }
+
+    jclass futureClass = pEnv->FindClass("java/util/concurrent/CompletableFuture");
+    GBL_longClass = findGlobalClass(pEnv, "java/lang/Long");
+    if (futureClass == NULL || GBL_longClass == NULL) {
+        return JNI_ERR;
+    }
+    GBL_futureComplete = pEnv->GetMethodID(futureClass, "complete", "(Ljava/lang/Object;)Z");
+    GBL_futureCompleteExceptionally = pEnv->GetMethodID(futureClass, "completeExceptionally", "(Ljava/lang/Throwable;)Z");
+    GBL_longValueOf = pEnv->GetStaticMethodID(GBL_longClass, "valueOf", "(J)Ljava/lang/Long;");
+    if (GBL_futureComplete == NULL || GBL_futureCompleteExceptionally == NULL || GBL_longValueOf == NULL) {
+        return JNI_ERR;
+    }
+    GBL_pVm = pVm;
+    return JNI_VERSION_1_6;
+}
+
+jbyteArray JNICALL Java_xpnp_XpNamedPipe_makePipeName(JNIEnv* pEnv, jclass cls, jbyteArray javaName, jboolean userLocal) {
+    jbyteArray result = NULL;
+    try {
+        std::string pipeName = toUtf8Name(pEnv, javaName);
+
+        char fullPipeName[256] = "";
+        int xpnpResult = XPNP_makePipeName(pipeName.c_str(), userLocal, fullPipeName, sizeof(fullPipeName));
+        checkXpnpResult(xpnpResult);
+
+        result = toJavaBytes(pEnv, fullPipeName);
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to make pipe name", except);
+    }
+
+    return result;
+}
+
+jlong JNICALL Java_xpnp_XpNamedPipe_createPipe(JNIEnv* pEnv, jclass cls, jbyteArray javaName, 
+        jboolean privatePipe) {
+    XPNP_PipeHandle pipeHandle = NULL;
+    try {
+        std::string pipeName = toUtf8Name(pEnv, javaName);
+
+        pipeHandle = XPNP_createPipe(pipeName.c_str(), privatePipe);
+
+        if (pipeHandle == NULL) {
+            throwXpnpError(XPNP_getErrorCode());
+        }
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to create named pipe", except);
+    }
+
+    return (jlong)(unsigned __int64)pipeHandle;
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_stopPipe(JNIEnv* pEnv, jclass cls, jlong pipeHandle) {
+    try {
+        checkXpnpResult(XPNP_stopPipe((XPNP_PipeHandle)pipeHandle));
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to stop pipe", except);
+    }
+}
+
+jboolean JNICALL Java_xpnp_XpNamedPipe_closePipe(JNIEnv* pEnv, jclass cls, jlong pipeHandle) {
+    cancelAsync(pEnv, (XPNP_PipeHandle)pipeHandle);
+    return XPNP_closePipe((XPNP_PipeHandle)pipeHandle) != 0;
+}
+
+jint JNICALL Java_xpnp_XpNamedPipe_openPipeCount(JNIEnv* pEnv, jclass cls) {
+    return XPNP_getOpenPipeCount();
+}
+
+// The counts in XPNP_PipeStats field order, which XpnpPipeStats relies on.
+jlongArray JNICALL Java_xpnp_XpNamedPipe_pipeStats(JNIEnv* pEnv, jclass cls, jlong pipeHandle) {
+    try {
+        XPNP_PipeStats pipeStats;
+        checkXpnpResult(XPNP_getPipeStats((XPNP_PipeHandle)pipeHandle, &pipeStats));
+        jlong values[] = {pipeStats.bytesRead, pipeStats.bytesWritten, pipeStats.messagesRead,
+                pipeStats.messagesWritten, pipeStats.readCalls, pipeStats.writeCalls, pipeStats.readWaitMicros,
+                pipeStats.writeWaitMicros, pipeStats.timeouts, pipeStats.interruptions, pipeStats.partialReads};
+        const jsize valueCount = sizeof(values) / sizeof(values[0]);
+        jlongArray valuesJava = pEnv->NewLongArray(valueCount);
+        if (valuesJava == NULL) {
+            return NULL;
+        }
+        pEnv->SetLongArrayRegion(valuesJava, 0, valueCount, values);
+        return valuesJava;
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to get pipe statistics", except);
+        return NULL;
+    }
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_enableLatencyHistograms(JNIEnv* pEnv, jclass cls, jboolean enabled) {
+    XPNP_setLatencyHistograms(enabled);
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_enableThreadScratch(JNIEnv* pEnv, jclass cls, jboolean enabled) {
+    GBL_threadScratchEnabled = enabled != JNI_FALSE;
+}
+
+// Returns the sample count followed by the latency at each percentile.
+jlongArray JNICALL Java_xpnp_XpNamedPipe_latencyPercentiles(JNIEnv* pEnv, jclass cls, jlong pipeHandle,
+        jint operation, jdoubleArray percentilesJava, jboolean reset) {
+    try {
+        jsize count = pEnv->GetArrayLength(percentilesJava);
+        std::vector<jdouble> percentiles(count + 1);
+        std::vector<jlong> values(count + 1);
+        pEnv->GetDoubleArrayRegion(percentilesJava, 0, count, &percentiles[0]);
+        checkXpnpResult(XPNP_getLatencyPercentiles((XPNP_PipeHandle)pipeHandle, operation, &percentiles[0], count,
+                &values[1], &values[0], reset));
+        jlongArray valuesJava = pEnv->NewLongArray(count + 1);
+        if (valuesJava == NULL) {
+            return NULL;
+        }
+        pEnv->SetLongArrayRegion(valuesJava, 0, count + 1, &values[0]);
+        return valuesJava;
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to get latency percentiles", except);
+        return NULL;
+    }
+}
+
+jlong JNICALL Java_xpnp_XpNamedPipe_acceptConnection(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jint timeoutMsecs) {
+    try {
+        XPNP_PipeHandle newPipe = XPNP_acceptConnection((XPNP_PipeHandle)pipeHandle, timeoutMsecs);
+        if (newPipe == NULL) {
+            throwXpnpError(XPNP_getErrorCode());
+        }
+        return (jlong)(unsigned __int64)newPipe;
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to accept connection", except);
+        return 0;
+    }
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_readBytes(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray bufferJava, jint offset,
+        jint bytesToRead, jint timeoutMsecs) {
+    try {
+        ScratchBuffer buffer(bytesToRead);
+        checkXpnpResult(XPNP_readBytes((XPNP_PipeHandle)pipeHandle, buffer.get(), bytesToRead, timeoutMsecs));
+        pEnv->SetByteArrayRegion(bufferJava, offset, bytesToRead, (const jbyte*)buffer.get());
+    } catch (std::exception& except) { 
+        throwJavaException(pEnv, "Failed to read bytes", except);
+    }
+}
+
+jlong JNICALL Java_xpnp_XpNamedPipe_openPipe(JNIEnv* pEnv, jclass cls, jbyteArray javaName, jboolean privatePipe) {
+    XPNP_PipeHandle newPipe = NULL;
+    try {
+        std::string pipeName = toUtf8Name(pEnv, javaName);
+        newPipe = XPNP_openPipe(pipeName.c_str(), privatePipe);
+        if (newPipe == NULL) {
+            throwXpnpError(XPNP_getErrorCode());
+        }
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to open named pipe", except);
+    }
+
+    return (jlong)(unsigned __int64)newPipe;
+}
+
+jint JNICALL Java_xpnp_XpNamedPipe_readDirect(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jobject bufferJava, jint offset,
+        jint length, jint timeoutMsecs) {
+    try {
+        char* buffer = getDirectBufferRegion(pEnv, bufferJava, offset, length);
+        int bytesRead = XPNP_readPipe((XPNP_PipeHandle)pipeHandle, buffer, length, timeoutMsecs);
+        checkXpnpResult(bytesRead);
+        return bytesRead;
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to read pipe", except);
+        return 0;
+    }
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_writeDirect(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jobject bufferJava, jint offset,
+        jint length) {
+    try {
+        const char* buffer = getDirectBufferRegion(pEnv, bufferJava, offset, length);
+        checkXpnpResult(XPNP_writePipe((XPNP_PipeHandle)pipeHandle, buffer, length));
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to write to pipe", except);
+    }
+}
+
+jint JNICALL Java_xpnp_XpNamedPipe_readRegion(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray bufferJava, jint offset,
+        jint length, jint timeoutMsecs) {
+    try {
+        ScratchBuffer buffer(length);
+        int bytesRead = XPNP_readPipe((XPNP_PipeHandle)pipeHandle, buffer.get(), length, timeoutMsecs);
+        checkXpnpResult(bytesRead);
+        // Only the bytes received go back to the array.
+        pEnv->SetByteArrayRegion(bufferJava, offset, bytesRead, (const jbyte*)buffer.get());
+        return bytesRead;
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to read pipe", except);
+        return 0;
+    }
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_writeRegion(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray bufferJava, jint offset,
+        jint length) {
+    try {
+        ScratchBuffer buffer(length);
+        pEnv->GetByteArrayRegion(bufferJava, offset, length, (jbyte*)buffer.get());
+        if (pEnv->ExceptionCheck()) {
+            return;
+        }
+        checkXpnpResult(XPNP_writePipe((XPNP_PipeHandle)pipeHandle, buffer.get(), length));
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to write to pipe", except);
+    }
+}
+
+jbyteArray JNICALL Java_xpnp_XpNamedPipe_readMessage(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jint timeoutMsecs) {
+    try {
+        ScratchBuffer buffer;
+        int msgLen = readMessage((XPNP_PipeHandle)pipeHandle, buffer, INT_MAX, timeoutMsecs);
+        jbyteArray result = pEnv->NewByteArray(msgLen);
+        if (result != NULL) {
+            pEnv->SetByteArrayRegion(result, 0, msgLen, (const jbyte*)buffer.get());
+        }
+        return result;
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to read message", except);
+        return NULL;
+    }
+}
+
+jint JNICALL Java_xpnp_XpNamedPipe_readMessageInto(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray bufferJava,
+        jint offset, jint length, jint timeoutMsecs) {
+    try {
+        ScratchBuffer buffer;
+        int msgLen = readMessage((XPNP_PipeHandle)pipeHandle, buffer, length, timeoutMsecs);
+        pEnv->SetByteArrayRegion(bufferJava, offset, msgLen, (const jbyte*)buffer.get());
+        return msgLen;
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to read message", except);
+        return 0;
+    }
+}
+
+// Reads a framed message straight into a direct buffer.  A message longer than length is left to be read again,
+// and its length is returned negated.
+jint JNICALL Java_xpnp_XpNamedPipe_readMessageDirect(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jobject bufferJava,
+        jint length, jint timeoutMsecs) {
+    try {
+        char* buffer = getDirectBufferRegion(pEnv, bufferJava, 0, length);
+        int msgLen = 0;
+        int result = XPNP_readMessage((XPNP_PipeHandle)pipeHandle, buffer, length, &msgLen, timeoutMsecs);
+        if (result == -XPNP_ERROR_BUFFER_TOO_SMALL) {
+            return -msgLen;
+        }
+        checkXpnpResult(result);
+        return msgLen;
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to read message", except);
+        return 0;
+    }
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_writeMessage(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray bufferJava,
+        jint offset, jint length) {
+    try {
+        ScratchBuffer buffer(length);
+        pEnv->GetByteArrayRegion(bufferJava, offset, length, (jbyte*)buffer.get());
+        if (pEnv->ExceptionCheck()) {
+            return;
+        }
+        checkXpnpResult(XPNP_writeMessage((XPNP_PipeHandle)pipeHandle, buffer.get(), length));
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to write message", except);
+    }
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_readMessageAsync(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jobject future) {
+    submitAsync(pEnv, new AsyncCompletions::Call(AsyncCompletions::CALL_READ, (XPNP_PipeHandle)pipeHandle), future,
+            "Failed to start reading message");
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_writeMessageAsync(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray bufferJava,
+        jint offset, jint length, jobject future) {
+    AsyncCompletions::Call* call = NULL;
+    try {
+        call = new AsyncCompletions::Call(AsyncCompletions::CALL_WRITE, (XPNP_PipeHandle)pipeHandle);
+        // Copied now, so that the caller may reuse the array straight away.
+        call->message.resize(length);
+    } catch (std::exception& except) {
+        delete call;
+        throwJavaException(pEnv, "Failed to start writing message", except);
+        return;
+    }
+    if (length > 0) {
+        pEnv->GetByteArrayRegion(bufferJava, offset, length, (jbyte*)&call->message[0]);
+        if (pEnv->ExceptionCheck()) {
+            delete call;
+            return;
+        }
+    }
+    submitAsync(pEnv, call, future, "Failed to start writing message");
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_acceptConnectionAsync(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jobject future) {
+    submitAsync(pEnv, new AsyncCompletions::Call(AsyncCompletions::CALL_ACCEPT, (XPNP_PipeHandle)pipeHandle), future,
+            "Failed to start accepting connection");
+}
+
+jlong JNICALL Java_xpnp_XpNamedPipe_createSelector(JNIEnv* pEnv, jclass cls) {
+    try {
+        XPNP_SelectorHandle selector = XPNP_createSelector();
+        if (selector == NULL) {
+            throwXpnpError(XPNP_getErrorCode());
+        }
+        return (jlong)(unsigned __int64)selector;
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to create selector", except);
+        return 0;
+    }
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_closeSelector(JNIEnv* pEnv, jclass cls, jlong selectorHandle) {
+    try {
+        checkXpnpResult(XPNP_closeSelector((XPNP_SelectorHandle)selectorHandle));
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to close selector", except);
+    }
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_selectorRegister(JNIEnv* pEnv, jclass cls, jlong selectorHandle, jlong pipeHandle,
+        jint interest) {
+    try {
+        checkXpnpResult(XPNP_selectorRegister((XPNP_SelectorHandle)selectorHandle, (XPNP_PipeHandle)pipeHandle, interest));
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to register pipe", except);
+    }
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_selectorUnregister(JNIEnv* pEnv, jclass cls, jlong selectorHandle, jlong pipeHandle) {
+    try {
+        checkXpnpResult(XPNP_selectorUnregister((XPNP_SelectorHandle)selectorHandle, (XPNP_PipeHandle)pipeHandle));
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to unregister pipe", except);
+    }
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_selectorResume(JNIEnv* pEnv, jclass cls, jlong selectorHandle, jlong pipeHandle) {
+    try {
+        checkXpnpResult(XPNP_selectorResume((XPNP_SelectorHandle)selectorHandle, (XPNP_PipeHandle)pipeHandle));
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to resume pipe", except);
+    }
+}
+
+// Returns 0, rather than throwing, when the wait times out or the selector is woken up.
+jint JNICALL Java_xpnp_XpNamedPipe_select(JNIEnv* pEnv, jclass cls, jlong selectorHandle, jlongArray readyJava,
+        jint timeoutMsecs) {
+    try {
+        std::vector<XPNP_PipeHandle> ready(pEnv->GetArrayLength(readyJava));
+        if (ready.empty()) {
+            throw std::invalid_argument("ready array is empty");
+        }
+        int result = XPNP_select((XPNP_SelectorHandle)selectorHandle, &ready[0], (int)ready.size(), timeoutMsecs);
+        if (result == -XPNP_ERROR_TIMEOUT || result == -XPNP_ERROR_INTERRUPTED) {
+            return 0;
+        }
+        checkXpnpResult(result);
+
+        std::vector<jlong> readyHandles(result);
+        for (int i = 0; i < result; i++) {
+            readyHandles[i] = (jlong)(unsigned __int64)ready[i];
+        }
+        pEnv->SetLongArrayRegion(readyJava, 0, result, &readyHandles[0]);
+        return result;
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to wait for pipes", except);
+        return 0;
+    }
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_selectorWakeup(JNIEnv* pEnv, jclass cls, jlong selectorHandle) {
+    try {
+        checkXpnpResult(XPNP_selectorWakeup((XPNP_SelectorHandle)selectorHandle));
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to wake up selector", except);
+    }
+}
+
+void JNICALL Java_xpnp_XpNamedPipe_createProcess(JNIEnv* pEnv, jclass cls, jstring commandLineJava, jstring workingDirectoryJava) {
+    wchar_t* commandLineBuffer = NULL;
+    try {
+        std::string commandLine = toStdString(pEnv, commandLineJava);
+        std::string workingDirectory = toStdString(pEnv, workingDirectoryJava);
+
+        commandLineBuffer = newUtf16(commandLine.c_str());
+
+        STARTUPINFO startupInfo;
+        memset(&startupInfo, 0, sizeof(startupInfo));
+        startupInfo.cb = sizeof(startupInfo);
+
+        PROCESS_INFORMATION processInfo;
+        memset(&processInfo, 0, sizeof(processInfo));
+
+        if (!CreateProcess(NULL, commandLineBuffer, NULL, NULL, FALSE, 0, NULL, 
+                util::toUtf16(workingDirectory).c_str(), &startupInfo, &processInfo)) {
+            util::throwWindowsError("CreateProcess");
+        }
+        CloseHandle(processInfo.hThread);
+        CloseHandle(processInfo.hProcess);
+    } catch (std::exception& except) {
+        throwJavaException(pEnv, "Failed to start process", except);
+    }
+    if (commandLineBuffer != NULL) {
+        delete [] commandLineBuffer;
+    }
+}
+
@@ -1,32 +1,70 @@
-#pragma once
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-jstring JNICALL Java_xpnp_XpNamedPipe_getErrorMessage(JNIEnv* pEnv, jclass cls);
-
-jint JNICALL Java_xpnp_XpNamedPipe_getErrorCode(JNIEnv* pEnv, jclass cls);
-
-jstring JNICALL Java_xpnp_XpNamedPipe_makePipeName(JNIEnv* pEnv, jclass cls, jstring javaName, jboolean userLocal);
-
-jlong JNICALL Java_xpnp_XpNamedPipe_createPipe(JNIEnv* pEnv, jclass cls, jstring javaName, jboolean privatePipe);
-
-jboolean JNICALL Java_xpnp_XpNamedPipe_stopPipe(JNIEnv* pEnv, jclass cls, jlong pipeHandle);
-
-jboolean JNICALL Java_xpnp_XpNamedPipe_closePipe(JNIEnv* pEnv, jclass cls, jlong pipeHandle);
-
-jlong JNICALL Java_xpnp_XpNamedPipe_acceptConnection(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jint timeoutMsecs);
-
-jint JNICALL Java_xpnp_XpNamedPipe_readPipe(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray buffer, jint timeoutMsecs);
-
-jboolean JNICALL Java_xpnp_XpNamedPipe_readBytes(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray buffer, jint bytesToRead, jint timeoutMsecs);
-
-jlong JNICALL Java_xpnp_XpNamedPipe_openPipe(JNIEnv* pEnv, jclass cls, jstring pipeNameJava, jboolean privatePipe);
-
-jboolean JNICALL Java_xpnp_XpNamedPipe_writePipe(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray pipeDataJava);
-
-jboolean JNICALL Java_xpnp_XpNamedPipe_createProcess(JNIEnv* pEnv, jclass cls, jstring commandLineJava, jstring workingDirectoryJava);
-
-#ifdef __cplusplus
-}
-#endif
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+jbyteArray JNICALL Java_xpnp_XpNamedPipe_makePipeName(JNIEnv* pEnv, jclass cls, jbyteArray javaName, jboolean userLocal);
+
+jlong JNICALL Java_xpnp_XpNamedPipe_createPipe(JNIEnv* pEnv, jclass cls, jbyteArray javaName, jboolean privatePipe);
+
+void JNICALL Java_xpnp_XpNamedPipe_stopPipe(JNIEnv* pEnv, jclass cls, jlong pipeHandle);
+
+jboolean JNICALL Java_xpnp_XpNamedPipe_closePipe(JNIEnv* pEnv, jclass cls, jlong pipeHandle);
+
+jint JNICALL Java_xpnp_XpNamedPipe_openPipeCount(JNIEnv* pEnv, jclass cls);
+
+jlongArray JNICALL Java_xpnp_XpNamedPipe_pipeStats(JNIEnv* pEnv, jclass cls, jlong pipeHandle);
+
+void JNICALL Java_xpnp_XpNamedPipe_enableLatencyHistograms(JNIEnv* pEnv, jclass cls, jboolean enabled);
+
+void JNICALL Java_xpnp_XpNamedPipe_enableThreadScratch(JNIEnv* pEnv, jclass cls, jboolean enabled);
+
+jlongArray JNICALL Java_xpnp_XpNamedPipe_latencyPercentiles(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jint operation, jdoubleArray percentilesJava, jboolean reset);
+
+jlong JNICALL Java_xpnp_XpNamedPipe_acceptConnection(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jint timeoutMsecs);
+
+void JNICALL Java_xpnp_XpNamedPipe_readBytes(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray bufferJava, jint offset, jint bytesToRead, jint timeoutMsecs);
+
+jlong JNICALL Java_xpnp_XpNamedPipe_openPipe(JNIEnv* pEnv, jclass cls, jbyteArray pipeNameJava, jboolean privatePipe);
+
+jint JNICALL Java_xpnp_XpNamedPipe_readDirect(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jobject bufferJava, jint offset, jint length, jint timeoutMsecs);
+
+void JNICALL Java_xpnp_XpNamedPipe_writeDirect(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jobject bufferJava, jint offset, jint length);
+
+jint JNICALL Java_xpnp_XpNamedPipe_readRegion(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray bufferJava, jint offset, jint length, jint timeoutMsecs);
+
+void JNICALL Java_xpnp_XpNamedPipe_writeRegion(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray bufferJava, jint offset, jint length);
+
+jbyteArray JNICALL Java_xpnp_XpNamedPipe_readMessage(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jint timeoutMsecs);
+
+jint JNICALL Java_xpnp_XpNamedPipe_readMessageInto(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray bufferJava, jint offset, jint length, jint timeoutMsecs);
+
+jint JNICALL Java_xpnp_XpNamedPipe_readMessageDirect(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jobject bufferJava, jint length, jint timeoutMsecs);
+
+void JNICALL Java_xpnp_XpNamedPipe_writeMessage(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray bufferJava, jint offset, jint length);
+
+void JNICALL Java_xpnp_XpNamedPipe_readMessageAsync(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jobject future);
+
+void JNICALL Java_xpnp_XpNamedPipe_writeMessageAsync(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jbyteArray bufferJava, jint offset, jint length, jobject future);
+
+void JNICALL Java_xpnp_XpNamedPipe_acceptConnectionAsync(JNIEnv* pEnv, jclass cls, jlong pipeHandle, jobject future);
+
+jlong JNICALL Java_xpnp_XpNamedPipe_createSelector(JNIEnv* pEnv, jclass cls);
+
+void JNICALL Java_xpnp_XpNamedPipe_closeSelector(JNIEnv* pEnv, jclass cls, jlong selectorHandle);
+
+void JNICALL Java_xpnp_XpNamedPipe_selectorRegister(JNIEnv* pEnv, jclass cls, jlong selectorHandle, jlong pipeHandle, jint interest);
+
+void JNICALL Java_xpnp_XpNamedPipe_selectorUnregister(JNIEnv* pEnv, jclass cls, jlong selectorHandle, jlong pipeHandle);
+
+void JNICALL Java_xpnp_XpNamedPipe_selectorResume(JNIEnv* pEnv, jclass cls, jlong selectorHandle, jlong pipeHandle);
+
+jint JNICALL Java_xpnp_XpNamedPipe_select(JNIEnv* pEnv, jclass cls, jlong selectorHandle, jlongArray readyJava, jint timeoutMsecs);
+
+void JNICALL Java_xpnp_XpNamedPipe_selectorWakeup(JNIEnv* pEnv, jclass cls, jlong selectorHandle);
+
+void JNICALL Java_xpnp_XpNamedPipe_createProcess(JNIEnv* pEnv, jclass cls, jstring commandLineJava, jstring workingDirectoryJava);
+
+#ifdef __cplusplus
+}
+#endif